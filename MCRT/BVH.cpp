@@ -0,0 +1,272 @@
+#include "BVH.h"
+#include "Stats.h"
+
+#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+
+using namespace std;
+using namespace Eigen;
+
+static inline float surfaceArea(const Vector3f &vmin, const Vector3f &vmax)
+{
+	Vector3f d = (vmax - vmin).cwiseMax(0.0f);
+	return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+const float BVH::EmptyBound = 1e30f;
+
+static inline bool isEmpty(const bvh_node_t &node)
+{
+	return node.vmin[0] >= BVH::EmptyBound;
+}
+
+// The root of a tree without primitives. Count 0 still reads as an inner
+// node, but its box lies beyond every ray's range, so traversal stops at
+// the root test and never looks at the missing children.
+static bvh_node_t emptyRoot()
+{
+	const float e = BVH::EmptyBound;
+	bvh_node_t root = { { e, e, e }, 0, { e, e, e }, 0 };
+	return root;
+}
+
+void BVH::clear()
+{
+	_prims.clear();
+	_order.clear();
+	_nodes.clear();
+}
+
+void BVH::build(const triangle_t *triangles, size_t count)
+{
+	ScopedTimer timer("scene.bvh");
+	clear();
+	if (count == 0) {
+		_nodes.push_back(emptyRoot());
+		return;
+	}
+
+	_prims.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		const triangle_t &t = triangles[i];
+		Vector3f v1(t.v0[0], t.v0[1], t.v0[2]);
+		Vector3f v2 = v1 + Vector3f(t.e1[0], t.e1[1], t.e1[2]);
+		Vector3f v3 = v1 + Vector3f(t.e2[0], t.e2[1], t.e2[2]);
+		_prims[i].vmin = v1.cwiseMin(v2).cwiseMin(v3);
+		_prims[i].vmax = v1.cwiseMax(v2).cwiseMax(v3);
+		_prims[i].centroid = (_prims[i].vmin + _prims[i].vmax) * 0.5f;
+	}
+	_buildFromPrims();
+}
+
+void BVH::build(const AlignedBox3f *boxes, size_t count)
+{
+	clear();
+	if (count == 0) {
+		_nodes.push_back(emptyRoot());
+		return;
+	}
+
+	_prims.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		_prims[i].vmin = boxes[i].min();
+		_prims[i].vmax = boxes[i].max();
+		_prims[i].centroid = boxes[i].center();
+	}
+	_buildFromPrims();
+}
+
+void BVH::_buildFromPrims()
+{
+	size_t count = _prims.size();
+	_order.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		_order[i] = i;
+	}
+
+	_nodes.reserve(count * 2 / MaxLeafSize + 1);
+	_buildNode(0, count, 1);
+
+	_prims.clear();
+	_prims.shrink_to_fit();
+}
+
+void BVH::_setBounds(bvh_node_t &node, size_t begin, size_t end)
+{
+	Vector3f vmin = _prims[_order[begin]].vmin;
+	Vector3f vmax = _prims[_order[begin]].vmax;
+	for (size_t i = begin + 1; i < end; i++) {
+		vmin = vmin.cwiseMin(_prims[_order[i]].vmin);
+		vmax = vmax.cwiseMax(_prims[_order[i]].vmax);
+	}
+	memcpy(node.vmin, vmin.data(), 3 * sizeof(float));
+	memcpy(node.vmax, vmax.data(), 3 * sizeof(float));
+}
+
+int BVH::_buildNode(size_t begin, size_t end, int depth)
+{
+	int index = (int)_nodes.size();
+	_nodes.emplace_back();
+	_setBounds(_nodes[index], begin, end);
+
+	size_t count = end - begin;
+	auto makeLeaf = [&]() {
+		_nodes[index].start = (int)begin;
+		_nodes[index].count = (int)count;
+		return index;
+	};
+	if (count <= (size_t)MaxLeafSize || depth >= MaxDepth) {
+		return makeLeaf();
+	}
+
+	Vector3f cmin = _prims[_order[begin]].centroid;
+	Vector3f cmax = cmin;
+	for (size_t i = begin + 1; i < end; i++) {
+		cmin = cmin.cwiseMin(_prims[_order[i]].centroid);
+		cmax = cmax.cwiseMax(_prims[_order[i]].centroid);
+	}
+
+	// binned SAH over all three axes
+	struct Bin {
+		Vector3f vmin, vmax;
+		size_t count;
+	};
+	const float inf = numeric_limits<float>::infinity();
+	float bestCost = inf;
+	int bestAxis = -1, bestSplit = 0;
+
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = cmax[axis] - cmin[axis];
+		if (extent <= 0.0f) continue;
+
+		Bin bins[BinCount];
+		for (auto &b : bins) {
+			b.vmin = Vector3f(inf, inf, inf);
+			b.vmax = Vector3f(-inf, -inf, -inf);
+			b.count = 0;
+		}
+		float scale = BinCount / extent;
+		for (size_t i = begin; i < end; i++) {
+			const PrimitiveInfo &p = _prims[_order[i]];
+			int b = min((int)((p.centroid[axis] - cmin[axis]) * scale), BinCount - 1);
+			bins[b].vmin = bins[b].vmin.cwiseMin(p.vmin);
+			bins[b].vmax = bins[b].vmax.cwiseMax(p.vmax);
+			bins[b].count++;
+		}
+
+		// sweep from the right to collect suffix areas, then from the left
+		float rightArea[BinCount];
+		size_t rightCount[BinCount];
+		Vector3f rmin(inf, inf, inf), rmax(-inf, -inf, -inf);
+		size_t rc = 0;
+		for (int i = BinCount - 1; i > 0; i--) {
+			rmin = rmin.cwiseMin(bins[i].vmin);
+			rmax = rmax.cwiseMax(bins[i].vmax);
+			rc += bins[i].count;
+			rightArea[i] = surfaceArea(rmin, rmax);
+			rightCount[i] = rc;
+		}
+		Vector3f lmin(inf, inf, inf), lmax(-inf, -inf, -inf);
+		size_t lc = 0;
+		for (int i = 0; i < BinCount - 1; i++) {
+			lmin = lmin.cwiseMin(bins[i].vmin);
+			lmax = lmax.cwiseMax(bins[i].vmax);
+			lc += bins[i].count;
+			if (lc == 0 || rightCount[i + 1] == 0) continue;
+			float cost = lc * surfaceArea(lmin, lmax) + rightCount[i + 1] * rightArea[i + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+
+	Vector3f nmin(_nodes[index].vmin[0], _nodes[index].vmin[1], _nodes[index].vmin[2]);
+	Vector3f nmax(_nodes[index].vmax[0], _nodes[index].vmax[1], _nodes[index].vmax[2]);
+	float leafCost = count * surfaceArea(nmin, nmax);
+
+	size_t mid;
+	if (bestAxis < 0) {
+		// all centroids coincide, fall back to splitting the range in half
+		mid = begin + count / 2;
+	}
+	else {
+		if (bestCost >= leafCost && count <= (size_t)MaxLeafSize * 4) {
+			return makeLeaf();
+		}
+		float scale = BinCount / (cmax[bestAxis] - cmin[bestAxis]);
+		auto it = partition(_order.begin() + begin, _order.begin() + end, [&](size_t i) {
+			int b = min((int)((_prims[i].centroid[bestAxis] - cmin[bestAxis]) * scale), BinCount - 1);
+			return b <= bestSplit;
+		});
+		mid = it - _order.begin();
+		if (mid == begin || mid == end) mid = begin + count / 2;
+	}
+
+	_buildNode(begin, mid, depth + 1);
+	int right = _buildNode(mid, end, depth + 1);
+	_nodes[index].start = right;
+	_nodes[index].count = 0;
+	return index;
+}
+
+vector<int> BVH::parentIndices(const bvh_node_t *nodes, size_t count)
+{
+	vector<int> parents(count, -1);
+	for (size_t i = 0; i < count; i++) {
+		if (nodes[i].count > 0) continue;
+		parents[i + 1] = (int)i;
+		parents[nodes[i].start] = (int)i;
+	}
+	return parents;
+}
+
+vector<int> BVH::refit(
+	bvh_node_t *nodes, const vector<int> &parents,
+	const triangle_t *triangles, const vector<int> &leaves)
+{
+	ScopedTimer timer("scene.refit");
+	// every child has a higher index than its parent, so walking the dirty
+	// nodes from the back handles children first
+	vector<int> dirty;
+	vector<char> marked(parents.size(), 0);
+	for (int leaf : leaves) {
+		for (int n = leaf; n >= 0 && !marked[n]; n = parents[n]) {
+			marked[n] = 1;
+			dirty.push_back(n);
+		}
+	}
+	sort(dirty.begin(), dirty.end());
+
+	const float inf = numeric_limits<float>::infinity();
+	for (auto it = dirty.rbegin(); it != dirty.rend(); ++it) {
+		bvh_node_t &node = nodes[*it];
+		Vector3f vmin(inf, inf, inf), vmax(-inf, -inf, -inf);
+		if (node.count > 0) {
+			for (int i = node.start; i < node.start + node.count; i++) {
+				const triangle_t &t = triangles[i];
+				Vector3f e1(t.e1[0], t.e1[1], t.e1[2]), e2(t.e2[0], t.e2[1], t.e2[2]);
+				if (e1.isZero() && e2.isZero()) continue;
+				Vector3f v1(t.v0[0], t.v0[1], t.v0[2]);
+				vmin = vmin.cwiseMin(v1).cwiseMin(v1 + e1).cwiseMin(v1 + e2);
+				vmax = vmax.cwiseMax(v1).cwiseMax(v1 + e1).cwiseMax(v1 + e2);
+			}
+		}
+		else {
+			for (const bvh_node_t *child : { &nodes[*it + 1], &nodes[node.start] }) {
+				if (isEmpty(*child)) continue;
+				vmin = vmin.cwiseMin(Vector3f(child->vmin[0], child->vmin[1], child->vmin[2]));
+				vmax = vmax.cwiseMax(Vector3f(child->vmax[0], child->vmax[1], child->vmax[2]));
+			}
+		}
+		if (vmin[0] > vmax[0]) {
+			vmin = vmax = Vector3f(EmptyBound, EmptyBound, EmptyBound);
+		}
+		memcpy(node.vmin, vmin.data(), 3 * sizeof(float));
+		memcpy(node.vmax, vmax.data(), 3 * sizeof(float));
+	}
+	return dirty;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Types.h"
+#include "Scene.h"
+
+#include <vector>
+
+// Flattened BVH node, laid out for std430 next to the triangle SSBO. Nodes
+// are stored depth first: the left child of an inner node directly follows
+// it, `start` holds the right child index. Leaves have count > 0 and cover
+// triangles [start, start + count) in leaf order.
+struct bvh_node_t {
+	float vmin[3];
+	int start;
+	float vmax[3];
+	int count;
+};
+
+class BVH
+{
+public:
+	BVH() {};
+
+	void build(const triangle_t *triangles, size_t count);
+	// over arbitrary boxes, e.g. the world bounds of instances
+	void build(const Eigen::AlignedBox3f *boxes, size_t count);
+	void clear();
+
+	const bvh_node_t *nodes() const { return _nodes.data(); }
+	size_t nodeCount() const { return _nodes.size(); }
+
+	// leaf order: slot i of the reordered buffers holds input triangle order()[i]
+	const std::vector<size_t> &order() const { return _order; }
+
+	// traversal stack depth needed by trace.glsl and CpuTracer
+	static const int MaxDepth = 32;
+
+	// Refitting keeps the tree and recomputes the bounds of the given leaves
+	// and their ancestors from leaf-ordered `triangles`, children before
+	// parents, and returns the refitted nodes in ascending order. Degenerate
+	// triangles (removed faces) add nothing; nodes left without any get an
+	// empty box far outside the scene that no ray reaches. The tree quality
+	// degrades as geometry moves away from where it was built.
+	static std::vector<int> parentIndices(const bvh_node_t *nodes, size_t count);
+	static std::vector<int> refit(
+		bvh_node_t *nodes, const std::vector<int> &parents,
+		const triangle_t *triangles, const std::vector<int> &leaves);
+	static const float EmptyBound;
+
+private:
+	struct PrimitiveInfo {
+		Eigen::Vector3f vmin;
+		Eigen::Vector3f vmax;
+		Eigen::Vector3f centroid;
+	};
+
+	void _buildFromPrims();
+	int _buildNode(size_t begin, size_t end, int depth);
+	void _setBounds(bvh_node_t &node, size_t begin, size_t end);
+
+private:
+	std::vector<PrimitiveInfo> _prims;
+	std::vector<size_t> _order;
+	std::vector<bvh_node_t> _nodes;
+
+private:
+	static const int BinCount = 16;
+	static const int MaxLeafSize = 4;
+};
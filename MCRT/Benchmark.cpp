@@ -0,0 +1,554 @@
+#include "Benchmark.h"
+#include "Scene.h"
+#include "SceneBuffers.h"
+#include "CpuTracer.h"
+#include "BVH.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace Eigen;
+
+typedef chrono::steady_clock Clock;
+
+static const char *MtlFileName = "mcrt_bench.mtl";
+
+enum SceneKind { Cornell, Spheres, InstancedSpheres, HeightField };
+
+struct BenchScene
+{
+	const char *name;
+	SceneKind kind;
+	int count;		// spheres in the grid, or quads per height field side
+	int rings;		// tessellation of each sphere
+	size_t triangles;	// used by --max-triangles
+};
+
+static const BenchScene Scenes[] = {
+	{ "cornell-1k", Cornell, 1, 16, 1036 },
+	{ "spheres-10k", Spheres, 9, 17, 10416 },
+	{ "spheres-100k", Spheres, 25, 32, 102412 },
+	{ "spheres-inst-100k", InstancedSpheres, 25, 32, 102412 },
+	{ "mesh-1m", HeightField, 708, 0, 1002540 },
+	{ "mesh-10m", HeightField, 2237, 0, 10008350 },
+};
+
+struct BenchResult
+{
+	string name;
+	vector<pair<string, double>> metrics;
+
+	void add(const char *key, double value) { metrics.push_back(make_pair(string(key), value)); }
+};
+
+static double msSince(Clock::time_point start)
+{
+	return chrono::duration<double, milli>(Clock::now() - start).count();
+}
+
+static size_t peakMemory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+		return pmc.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss;
+#else
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// ---------------------------------------------------------------- scenes
+
+struct ObjWriter
+{
+	FILE *fp;
+	int vertexCount;
+
+	int vertex(float x, float y, float z)
+	{
+		fprintf(fp, "v %.6f %.6f %.6f\n", x, y, z);
+		return ++vertexCount;
+	}
+
+	void quad(const char *group, const char *mtl, const float p[4][3])
+	{
+		fprintf(fp, "g %s\nusemtl %s\ns off\n", group, mtl);
+		int a = vertex(p[0][0], p[0][1], p[0][2]);
+		int b = vertex(p[1][0], p[1][1], p[1][2]);
+		int c = vertex(p[2][0], p[2][1], p[2][2]);
+		int d = vertex(p[3][0], p[3][1], p[3][2]);
+		fprintf(fp, "f %d %d %d %d\n", a, b, c, d);
+	}
+
+	void sphere(const char *group, const char *mtl, float cx, float cy, float cz, float r, int rings)
+	{
+		const float pi = 3.14159265f;
+		int segments = rings * 2;
+		fprintf(fp, "g %s\nusemtl %s\ns 1\n", group, mtl);
+		int base = vertexCount + 1;
+		for (int i = 0; i <= rings; i++) {
+			float th = pi * i / rings;
+			for (int j = 0; j < segments; j++) {
+				float ph = 2 * pi * j / segments;
+				vertex(cx + r * sinf(th) * cosf(ph), cy + r * cosf(th), cz + r * sinf(th) * sinf(ph));
+			}
+		}
+		for (int i = 0; i < rings; i++) {
+			for (int j = 0; j < segments; j++) {
+				int a = base + i * segments + j;
+				int b = base + i * segments + (j + 1) % segments;
+				int c = b + segments, d = a + segments;
+				fprintf(fp, "f %d %d %d %d\n", a, b, c, d);
+			}
+		}
+	}
+
+	void heightField(const char *group, const char *mtl, int n)
+	{
+		fprintf(fp, "g %s\nusemtl %s\ns 1\n", group, mtl);
+		int base = vertexCount + 1;
+		for (int i = 0; i <= n; i++) {
+			for (int j = 0; j <= n; j++) {
+				float x = -4.9f + 9.8f * j / n, z = -4.9f + 9.8f * i / n;
+				float y = 1.5f + 0.8f * sinf(x * 1.7f) * cosf(z * 1.3f) + 0.3f * sinf(x * 5.1f + z * 4.3f);
+				vertex(x, y, z);
+			}
+		}
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				int a = base + i * (n + 1) + j;
+				fprintf(fp, "f %d %d %d %d\n", a, a + n + 1, a + n + 2, a + 1);
+			}
+		}
+	}
+};
+
+static bool writeMaterials()
+{
+	ofstream f(MtlFileName);
+	f << "newmtl light\nillum 4\nKd 0 0 0\nKa 1 1 1\n"
+		<< "newmtl white\nillum 4\nKd 1 1 1\nKa 0 0 0\n"
+		<< "newmtl red\nillum 4\nKd 1 0 0\nKa 0 0 0\n"
+		<< "newmtl blue\nillum 4\nKd 0 0 1\nKa 0 0 0\n"
+		<< "newmtl mirror\nillum 4\nKd 1 1 1\nKa 0 0 0\nKs 1 1 1\nNs 1000\n";
+	return f.good();
+}
+
+// Sphere i of a grid of `count` on the floor.
+static void spherePlacement(int count, int i, float &x, float &z, float &r)
+{
+	int side = (int)ceil(sqrt((double)count));
+	r = 4.5f / side;
+	x = -4.5f + r * (2 * (i % side) + 1);
+	z = -4.5f + r * (2 * (i / side) + 1);
+}
+
+// Every scene sits in the same 10x10x10 room as scene01.obj, so the
+// default camera frames all of them.
+static bool writeScene(const BenchScene &b, const char *fileName)
+{
+	FILE *fp = fopen(fileName, "w");
+	if (fp == NULL) {
+		cout << "Error: cannot open " << fileName << " for writing" << endl;
+		return false;
+	}
+
+	ObjWriter w = { fp, 0 };
+	fprintf(fp, "mtllib %s\n", MtlFileName);
+	const float floor[4][3] = { { -5, 0, -5 }, { -5, 0, 5 }, { 5, 0, 5 }, { 5, 0, -5 } };
+	const float ceiling[4][3] = { { -5, 10, -5 }, { 5, 10, -5 }, { 5, 10, 5 }, { -5, 10, 5 } };
+	const float back[4][3] = { { -5, 0, -5 }, { 5, 0, -5 }, { 5, 10, -5 }, { -5, 10, -5 } };
+	const float left[4][3] = { { -5, 0, -5 }, { -5, 10, -5 }, { -5, 10, 5 }, { -5, 0, 5 } };
+	const float right[4][3] = { { 5, 0, -5 }, { 5, 0, 5 }, { 5, 10, 5 }, { 5, 10, -5 } };
+	const float light[4][3] = { { -1.5f, 9.99f, -1.5f }, { 1.5f, 9.99f, -1.5f }, { 1.5f, 9.99f, 1.5f }, { -1.5f, 9.99f, 1.5f } };
+	w.quad("floor", "white", floor);
+	w.quad("ceiling", "white", ceiling);
+	w.quad("back", "white", back);
+	w.quad("left", "red", left);
+	w.quad("right", "blue", right);
+	w.quad("light", "light", light);
+
+	char group[32];
+	switch (b.kind) {
+	case Cornell:
+		w.sphere("sphere", "mirror", 1.5f, 2, 0, 2, b.rings);
+		break;
+	case Spheres:
+		for (int i = 0; i < b.count; i++) {
+			float x, z, r;
+			spherePlacement(b.count, i, x, z, r);
+			sprintf(group, "sphere%d", i);
+			w.sphere(group, i % 2 ? "white" : "mirror", x, r, z, r * 0.9f, b.rings);
+		}
+		break;
+	case InstancedSpheres:
+		w.sphere("sphere", "mirror", 0, 0, 0, 1, b.rings);
+		break;
+	case HeightField:
+		w.heightField("terrain", "white", b.count);
+		break;
+	}
+
+	bool ok = ferror(fp) == 0;
+	fclose(fp);
+	return ok;
+}
+
+// The same grid as Spheres, as instances of a single sphere mesh.
+static bool writeInstances(const BenchScene &b, const char *objFileName, const char *fileName)
+{
+	ofstream f(fileName);
+	f << "mesh room " << objFileName << " floor ceiling back left right light" << endl
+		<< "mesh sphere " << objFileName << " sphere" << endl
+		<< "instance room" << endl;
+	for (int i = 0; i < b.count; i++) {
+		float x, z, r;
+		spherePlacement(b.count, i, x, z, r);
+		f << "instance sphere scale " << r * 0.9f << " translate " << x << " " << r << " " << z << endl;
+	}
+	return f.good();
+}
+
+// ----------------------------------------------------------- measurement
+
+// Fastest of several runs of `fn`, repeated while the total stays short so
+// small scenes are not dominated by timer noise.
+template <typename Fn>
+static double measureMs(Fn fn, double maxSeconds = 0.25, int maxRuns = 10)
+{
+	double best = 0, total = 0;
+	for (int runs = 0; runs < maxRuns && (runs == 0 || total < maxSeconds * 1000.0); runs++) {
+		auto start = Clock::now();
+		fn();
+		double ms = msSince(start);
+		best = runs == 0 ? ms : min(best, ms);
+		total += ms;
+	}
+	return best;
+}
+
+// Repeats `pass` until at least minSeconds have elapsed and returns the
+// number of rays per second.
+template <typename Pass>
+static double measureRays(Pass pass, double minSeconds = 0.5)
+{
+	pass();	// warm up caches and the worker threads
+	size_t rays = 0;
+	int runs = 0;
+	auto start = Clock::now();
+	double elapsed = 0;
+	while (runs < 3 || elapsed < minSeconds) {
+		rays += pass();
+		runs++;
+		elapsed = msSince(start) / 1000.0;
+	}
+	return rays / elapsed;
+}
+
+static bool benchmarkScene(const BenchScene &b, int width, int height, unsigned int threads, BenchResult &r)
+{
+	string objFileName = string("mcrt_bench_") + b.name + ".obj";
+	if (!writeScene(b, objFileName.c_str())) {
+		return false;
+	}
+
+	r.name = b.name;
+	{
+		ifstream f(objFileName, ios::binary | ios::ate);
+		r.add("obj_bytes", (double)f.tellg());
+	}
+
+	string sceneFileName = string("mcrt_bench_") + b.name + ".scene";
+	bool instanced = b.kind == InstancedSpheres;
+	if (instanced && !writeInstances(b, objFileName.c_str(), sceneFileName.c_str())) {
+		return false;
+	}
+
+	Scene s;
+	bool loaded = true;
+	double loadMs = measureMs([&]() {
+		s.clear();
+		loaded = loaded && (instanced
+			? s.readFromSceneFile(sceneFileName.c_str())
+			: s.readFromObjFile(objFileName.c_str()));
+	});
+	remove(objFileName.c_str());
+	if (instanced) {
+		remove(sceneFileName.c_str());
+	}
+	if (!loaded) {
+		return false;
+	}
+
+	SceneBuffers buffers;
+	double buildMs = measureMs([&]() { buffers.build(s); });
+
+	// move the last group a little and refit, as an interactive edit would
+	bool edited = true;
+	double editMs = measureMs([&]() {
+		edited = edited && s.transformGroup(s.groupCount() - 1, Affine3f(Translation3f(0.01f, 0, 0)));
+		edited = edited && buffers.update(s);
+	});
+	s.clear();
+	if (!edited) {
+		return false;
+	}
+
+	BVH bvh;
+	double bvhMs = measureMs([&]() { bvh.build(buffers.triangles(), buffers.faceCount()); });
+	bvh.clear();
+
+	size_t sceneBytes = buffers.groupCount() * sizeof(group_t)
+		+ buffers.faceCount() * (sizeof(triangle_t) + sizeof(face_attr_t))
+		+ buffers.materialCount() * sizeof(material_t)
+		+ buffers.nodeCount() * sizeof(bvh_node_t)
+		+ buffers.instanceCount() * sizeof(instance_t)
+		+ buffers.topNodeCount() * sizeof(bvh_node_t);
+
+	CpuTracer t(width, height, threads);
+	double setupMs = measureMs([&]() { t.load(buffers); });
+
+	double primary = measureRays([&]() { return t.castPrimaryRays(); });
+	t.castPrimaryRays();
+	double secondary = measureRays([&]() { return t.castSecondaryRays(); });
+	double occlusion = measureRays([&]() { return t.castOcclusionRays(); });
+
+	const int frames = 4;
+	t.renderFrame();
+	auto start = Clock::now();
+	for (int i = 0; i < frames; i++) {
+		t.renderFrame();
+	}
+	double frameMs = msSince(start) / frames;
+
+	r.add("triangles", (double)buffers.faceCount());
+	r.add("bvh_nodes", (double)buffers.nodeCount());
+	r.add("instances", (double)buffers.instanceCount());
+	r.add("obj_load_ms", loadMs);
+	r.add("build_ms", buildMs);
+	r.add("bvh_build_ms", bvhMs);
+	r.add("edit_ms", editMs);
+	r.add("tracer_setup_ms", setupMs);
+	r.add("primary_mrays_per_s", primary / 1e6);
+	r.add("secondary_mrays_per_s", secondary / 1e6);
+	r.add("occlusion_mrays_per_s", occlusion / 1e6);
+	r.add("frame_ms", frameMs);
+	r.add("scene_bytes", (double)sceneBytes);
+	r.add("peak_rss_bytes", (double)peakMemory());
+	return true;
+}
+
+// ------------------------------------------------------------- reporting
+
+static string formatNumber(double v)
+{
+	char buf[64];
+	if (v == floor(v) && fabs(v) < 1e15) sprintf(buf, "%.0f", v);
+	else sprintf(buf, "%.6g", v);
+	return buf;
+}
+
+// One scene per line keeps the files easy to diff and lets readBaseline get
+// away with a line scanner instead of a JSON parser.
+static bool writeJson(const char *fileName, const vector<BenchResult> &results,
+	int width, int height, unsigned int threads, const char *kernel)
+{
+	ofstream f(fileName);
+	if (!f) {
+		cout << "Error: cannot open " << fileName << " for writing" << endl;
+		return false;
+	}
+	f << "{" << endl
+		<< "  \"format\": \"mcrt-benchmark\"," << endl
+		<< "  \"version\": 1," << endl
+		<< "  \"kernel\": \"" << kernel << "\"," << endl
+		<< "  \"threads\": " << threads << "," << endl
+		<< "  \"width\": " << width << "," << endl
+		<< "  \"height\": " << height << "," << endl
+		<< "  \"scenes\": [" << endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		f << "    { \"name\": \"" << results[i].name << "\"";
+		for (auto &m : results[i].metrics) {
+			f << ", \"" << m.first << "\": " << formatNumber(m.second);
+		}
+		f << " }" << (i + 1 < results.size() ? "," : "") << endl;
+	}
+	f << "  ]" << endl << "}" << endl;
+	return f.good();
+}
+
+static bool readBaseline(const char *fileName, map<string, map<string, double>> &baseline)
+{
+	ifstream f(fileName);
+	if (!f) {
+		cout << "Error: cannot open baseline " << fileName << endl;
+		return false;
+	}
+	string line;
+	while (getline(f, line)) {
+		size_t pos = line.find("\"name\": \"");
+		if (pos == string::npos) continue;
+		pos += 9;
+		string name = line.substr(pos, line.find('"', pos) - pos);
+		auto &metrics = baseline[name];
+		while ((pos = line.find(", \"", pos)) != string::npos) {
+			pos += 3;
+			size_t end = line.find('"', pos);
+			if (end == string::npos || line.compare(end, 3, "\": ") != 0) break;
+			metrics[line.substr(pos, end - pos)] = atof(line.c_str() + end + 3);
+			pos = end;
+		}
+	}
+	return true;
+}
+
+// Throughput metrics regress when they drop, everything else when it grows.
+static int compareResults(const vector<BenchResult> &results,
+	const map<string, map<string, double>> &baseline, double threshold)
+{
+	int regressions = 0;
+	cout << endl << "Comparison against baseline (threshold " << threshold << "%):" << endl;
+	for (auto &r : results) {
+		auto old = baseline.find(r.name);
+		if (old == baseline.end()) {
+			cout << "  " << r.name << ": not in baseline" << endl;
+			continue;
+		}
+		for (auto &m : r.metrics) {
+			auto o = old->second.find(m.first);
+			if (o == old->second.end() || o->second == 0) continue;
+			if (m.first == "triangles" || m.first == "bvh_nodes" || m.first == "obj_bytes" || m.first == "instances") continue;
+
+			double change = (m.second - o->second) / o->second * 100.0;
+			bool higherIsBetter = m.first.find("_per_s") != string::npos;
+			bool regressed = higherIsBetter ? change < -threshold : change > threshold;
+			char line[160];
+			sprintf(line, "  %-14s %-22s %12.4g -> %12.4g  %+7.1f%%%s",
+				r.name.c_str(), m.first.c_str(), o->second, m.second, change,
+				regressed ? "  REGRESSION" : "");
+			cout << line << endl;
+			regressions += regressed;
+		}
+	}
+	cout << regressions << " regression(s)" << endl;
+	return regressions;
+}
+
+static void printUsage()
+{
+	cout << "Usage: mcrt --benchmark [options]" << endl
+		<< "  --output <file.json>      results (benchmark.json)" << endl
+		<< "  --baseline <file.json>    compare against an earlier run" << endl
+		<< "  --threshold <percent>     allowed slowdown before flagging (10)" << endl
+		<< "  --max-triangles <n>       skip larger scenes (10000000)" << endl
+		<< "  --size <w>x<h>            ray grid resolution (640x480)" << endl
+		<< "  --threads <n>             worker threads (all cores)" << endl;
+}
+
+// Exit codes: 0 success, 2 bad arguments, 3 failed scene or output, 4
+// regressions against the baseline.
+int runBenchmark(int argc, char *argv[])
+{
+	const char *output = "benchmark.json";
+	const char *baselineFile = nullptr;
+	double threshold = 10;
+	size_t maxTriangles = 10000000;
+	int width = 640, height = 480;
+	unsigned int threads = 0;
+
+	for (int i = 2; i < argc; i++) {
+		const char *opt = argv[i];
+		if (strcmp(opt, "--help") == 0) {
+			printUsage();
+			return 0;
+		}
+		if (i + 1 >= argc) {
+			cout << "Error: missing value for " << opt << endl;
+			printUsage();
+			return 2;
+		}
+		const char *arg = argv[++i];
+		if (strcmp(opt, "--output") == 0) output = arg;
+		else if (strcmp(opt, "--baseline") == 0) baselineFile = arg;
+		else if (strcmp(opt, "--threshold") == 0) threshold = atof(arg);
+		else if (strcmp(opt, "--max-triangles") == 0) maxTriangles = (size_t)atof(arg);
+		else if (strcmp(opt, "--threads") == 0) threads = (unsigned int)atoi(arg);
+		else if (strcmp(opt, "--size") == 0 && sscanf(arg, "%dx%d", &width, &height) == 2 && width > 0 && height > 0);
+		else {
+			cout << "Error: invalid option " << opt << " " << arg << endl;
+			printUsage();
+			return 2;
+		}
+	}
+
+	map<string, map<string, double>> baseline;
+	if (baselineFile && !readBaseline(baselineFile, baseline)) {
+		return 2;
+	}
+	if (!writeMaterials()) {
+		cout << "Error: cannot write " << MtlFileName << endl;
+		return 3;
+	}
+
+	CpuTracer probe(1, 1, threads);
+	cout << "MCRT benchmark (" << probe.threadCount() << " threads, "
+		<< probe.kernelName() << ", " << width << "x" << height << ")" << endl;
+
+	vector<BenchResult> results;
+	bool failed = false;
+	for (auto &b : Scenes) {
+		if (b.triangles > maxTriangles) continue;
+		cout << "  " << b.name << "..." << flush;
+		BenchResult r;
+		if (!benchmarkScene(b, width, height, threads, r)) {
+			cout << " failed" << endl;
+			failed = true;
+			continue;
+		}
+		map<string, double> m(r.metrics.begin(), r.metrics.end());
+		cout << " load " << m["obj_load_ms"] << " ms, build " << m["build_ms"]
+			<< " ms, primary " << m["primary_mrays_per_s"] << " Mrays/s, secondary "
+			<< m["secondary_mrays_per_s"] << " Mrays/s, occlusion " << m["occlusion_mrays_per_s"]
+			<< " Mrays/s, frame " << m["frame_ms"] << " ms" << endl;
+		results.push_back(r);
+	}
+	remove(MtlFileName);
+
+	if (!writeJson(output, results, width, height, probe.threadCount(), probe.kernelName())) {
+		return 3;
+	}
+	cout << "Results have been written to " << output << endl;
+
+	if (baselineFile && compareResults(results, baseline, threshold) > 0) {
+		return 4;
+	}
+	return failed ? 3 : 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// Benchmark suite run by `mcrt --benchmark`. Generates procedural scenes of
+// growing size (Cornell box, sphere grids, tessellated height fields from
+// about 1K to 10M triangles), measures OBJ load, scene build, BVH build,
+// primary/secondary/occlusion ray throughput, render time and memory, and writes the
+// results as JSON. With --baseline the results are compared against an
+// earlier JSON file and slowdowns beyond the threshold are reported.
+int runBenchmark(int argc, char *argv[]);
@@ -0,0 +1,48 @@
+#include "Camera.h"
+
+#include <cmath>
+
+using namespace std;
+using namespace Eigen;
+
+void Camera::setFrustum(float fovy, float aspect, float zNear, float zFar)
+{
+	float halfH = tanf(fovy / 180.0f * 3.14159f * 0.5f) * zNear;
+	float halfW = aspect * halfH;
+	float zL = zNear - zFar;
+	_projMat << zNear / halfW, 0, 0, 0,
+				0, zNear / halfH, 0, 0,
+				0, 0, (zFar + zNear) / zL, 2.0f * zFar * zNear / zL,
+				0, 0, -1, 0;
+}
+
+void Camera::setCamera(const Vector3f &eye, const Vector3f &at, const Vector3f &up)
+{
+	_cop = eye;
+	Vector3f dn = (at - eye).normalized();
+	Vector3f rn = dn.cross(up).normalized();
+	Vector3f un = rn.cross(dn);
+	_viewMat << rn(0), rn(1), rn(2), -rn.dot(eye),
+				un(0), un(1), un(2), -un.dot(eye),
+				-dn(0), -dn(1), -dn(2), dn.dot(eye),
+				0, 0, 0, 1;
+}
+
+void Camera::computeInvMatrix()
+{
+	_viewProjMat = _projMat * _viewMat;
+	_invMat = _viewProjMat.inverse();
+	_ray00 = _getRayVector(-1, -1);
+	_ray01 = _getRayVector(-1, 1);
+	_ray10 = _getRayVector(1, -1);
+	_ray11 = _getRayVector(1, 1);
+}
+
+Vector3f Camera::_getRayVector(float x, float y)
+{
+	Vector4f r = _invMat * Vector4f(x, y, 0, 1);
+	r[0] /= r[3];
+	r[1] /= r[3];
+	r[2] /= r[3];
+	return Vector3f(r[0], r[1], r[2]) - _cop;
+}
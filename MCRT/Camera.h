@@ -0,0 +1,32 @@
+#pragma once
+
+#include "Types.h"
+
+class Camera
+{
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	Camera() {};
+
+	void setFrustum(float fovy, float aspect, float zNear, float zFar);
+	void setCamera(
+		const Eigen::Vector3f &eye,
+		const Eigen::Vector3f &at,
+		const Eigen::Vector3f &up);
+	void computeInvMatrix();
+
+	const Eigen::Vector3f &eye() const { return _cop; }
+	const Eigen::Vector3f &ray00() const { return _ray00; }
+	const Eigen::Vector3f &ray01() const { return _ray01; }
+	const Eigen::Vector3f &ray10() const { return _ray10; }
+	const Eigen::Vector3f &ray11() const { return _ray11; }
+	const Eigen::Matrix4f &viewProjection() const { return _viewProjMat; }
+
+private:
+	Eigen::Vector3f _getRayVector(float x, float y);
+
+private:
+	Eigen::Vector3f _cop, _ray00, _ray01, _ray10, _ray11;
+	Eigen::Matrix4f _viewMat, _projMat, _viewProjMat, _invMat;
+};
@@ -0,0 +1,992 @@
+#include "CpuTracer.h"
+#include "ImageWriter.h"
+#include "Stats.h"
+
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+using namespace std;
+using namespace Eigen;
+
+#define MAX_SCENE_BOUNDS    100.0f
+#define EPS                 0.000001f
+#define MIN_LUMINANCE       0.01f
+#define PI                  3.14159265f
+// shadow rays stop this fraction short of the light
+#define SHADOW_EPS          0.001f
+
+// bounces before Russian roulette may end a path
+#define RR_DEPTH            3
+
+struct CpuTracer::hit_info_t
+{
+	float dist;
+	int fptr;
+	float u, v;
+	int instance;
+};
+
+struct CpuTracer::path_t
+{
+	Vector3f origin;
+	Vector3f dir;
+	Vector3f throughput;
+	Vector3f radiance;
+	hit_info_t hit;
+	uint32_t pixel;		// Sampler.h pixel seed
+	uint32_t sample;	// index into the pixel's sample sequence
+	int depth;
+	float bsdfPdf;		// of the last bounce, 0 for camera rays
+};
+
+static inline Vector3f loadVec3(const float *v)
+{
+	return Vector3f(v[0], v[1], v[2]);
+}
+
+static inline float intersectNode(const Vector3f &origin, const Vector3f &invDir, const bvh_node_t &node, float maxDist)
+{
+	Vector3f tMin = (loadVec3(node.vmin) - origin).cwiseProduct(invDir);
+	Vector3f tMax = (loadVec3(node.vmax) - origin).cwiseProduct(invDir);
+	float tNear = max(tMin.cwiseMin(tMax).maxCoeff(), 0.0f);
+	float tFar = min(tMin.cwiseMax(tMax).minCoeff(), maxDist);
+	return tNear <= tFar ? tNear : MAX_SCENE_BOUNDS;
+}
+
+static Vector3f getNormal(float u, float v, const face_attr_t &attr)
+{
+	float w = 1.0f - u - v;
+	return (w * loadVec3(attr.vn1) + u * loadVec3(attr.vn2) + v * loadVec3(attr.vn3)).normalized();
+}
+
+static inline Vector3f toObjectPoint(const instance_t &inst, const Vector3f &p)
+{
+	const float (*m)[4] = inst.toObject;
+	return Vector3f(
+		m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+		m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+		m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+}
+
+// Directions stay unnormalized, so a distance along the ray is the same in
+// object and world space.
+static inline Vector3f toObjectVector(const instance_t &inst, const Vector3f &v)
+{
+	const float (*m)[4] = inst.toObject;
+	return Vector3f(
+		m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+		m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+		m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+}
+
+static inline Vector3f toWorldPoint(const instance_t &inst, const Vector3f &p)
+{
+	const float (*m)[4] = inst.toWorld;
+	return Vector3f(
+		m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+		m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+		m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+}
+
+static inline Vector3f toWorldVector(const instance_t &inst, const Vector3f &v)
+{
+	const float (*m)[4] = inst.toWorld;
+	return Vector3f(
+		m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+		m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+		m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+}
+
+// normals go through the transposed inverse
+static inline Vector3f toWorldNormal(const instance_t &inst, const Vector3f &n)
+{
+	const float (*m)[4] = inst.toObject;
+	return Vector3f(
+		m[0][0] * n[0] + m[1][0] * n[1] + m[2][0] * n[2],
+		m[0][1] * n[0] + m[1][1] * n[1] + m[2][1] * n[2],
+		m[0][2] * n[0] + m[1][2] * n[1] + m[2][2] * n[2]).normalized();
+}
+
+static bool isIdentity(const instance_t &inst)
+{
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 4; c++) {
+			if (inst.toWorld[r][c] != (r == c ? 1.0f : 0.0f)) return false;
+		}
+	}
+	return true;
+}
+
+// same model as evalBsdf in trace.glsl
+static Vector3f evalBsdf(const material_t &mat, const Vector3f &n, const Vector3f &dir, const Vector3f &wi)
+{
+	float LdN = max(wi.dot(n), 0.0f);
+	Vector3f R = (2 * LdN * n - wi).normalized();
+	float sfactor = R.dot(-dir);
+	Vector3f f = loadVec3(mat.Kd);
+	if (sfactor > 0) {
+		f += loadVec3(mat.Ks) * powf(sfactor, mat.Ns);
+	}
+	return f / PI;
+}
+
+static inline float powerHeuristic(float a, float b)
+{
+	return a * a / max(a * a + b * b, EPS);
+}
+
+static inline float luminance(const float *rgb)
+{
+	return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+}
+
+static Vector3f sampleHemisphere(const Vector3f &w, float s0, float s1)
+{
+	float r1 = 2.0f * 3.14159f * s0;
+	float r2 = s1;
+	float r2s = sqrtf(r2);
+
+	Vector3f u;
+	if (fabsf(w[0]) > 0.1f) u = Vector3f(0, 1, 0).cross(w);
+	else u = Vector3f(1, 0, 0).cross(w);
+	u.normalize();
+
+	Vector3f v = w.cross(u);
+	Vector3f d = u * cosf(r1) * r2s + v * sinf(r1) * r2s + w * sqrtf(1 - r2);
+
+	return d.normalized();
+}
+
+CpuTracer::CpuTracer(int width, int height, unsigned int threads)
+	: _frames(0), _firstSample(0), _region{ 0, 0, width, height },
+	  _width(width), _height(height), _scheduler(threads),
+	  _errorThreshold(0), _minSamples(16), _maxDepth(3), _sampler(SobolSampler),
+	  _triangles(nullptr), _nodes(nullptr), _attributes(nullptr), _materials(nullptr),
+	  _emitters(nullptr), _emitterCount(0), _topNodes(nullptr), _instances(nullptr),
+	  _kernels(&selectSimdKernels())
+{
+	_tilesX = (width + _tileSize - 1) / _tileSize;
+	_tilesY = (height + _tileSize - 1) / _tileSize;
+	_canvas.assign((size_t)width * height * 4, 0.0f);
+	_variance.assign((size_t)width * height, 0.0f);
+	_resetTiles();
+
+	float aspect = height != 0 ? float(width) / float(height) : width;
+	_camera.setFrustum(60, aspect, 1., 30.);
+	_camera.setCamera(
+		Vector3f(0, 5, 15),
+		Vector3f(0, 5, 0),
+		Vector3f(0, 1, 0));
+	_camera.computeInvMatrix();
+}
+
+CpuTracer::RenderStats CpuTracer::render(const SceneBuffers &s, int samples, double timeBudget)
+{
+	typedef chrono::steady_clock Clock;
+	RenderStats stats = {};
+
+	auto start = Clock::now();
+	load(s);
+	auto loaded = Clock::now();
+	stats.setupSeconds = chrono::duration<double>(loaded - start).count();
+
+	double elapsed = 0, slowest = 0;
+	while (_frames < samples && !converged()) {
+		if (_frames > 0 && timeBudget > 0 && elapsed + slowest > timeBudget) {
+			stats.timedOut = true;
+			break;
+		}
+		auto frameStart = Clock::now();
+		renderFrame();
+		Stats::shared().poll();
+		auto frameEnd = Clock::now();
+		slowest = max(slowest, chrono::duration<double>(frameEnd - frameStart).count());
+		elapsed = chrono::duration<double>(frameEnd - loaded).count();
+	}
+
+	stats.samples = _frames;
+	stats.renderSeconds = elapsed;
+	stats.averageSamples = averageSamples();
+	stats.converged = converged();
+	return stats;
+}
+
+void CpuTracer::setAdaptive(float threshold, int minSamples)
+{
+	_errorThreshold = threshold;
+	_minSamples = max(minSamples, 2);
+}
+
+void CpuTracer::setMaxDepth(int depth)
+{
+	_maxDepth = max(depth, 1);
+}
+
+void CpuTracer::setSampler(SamplerType type)
+{
+	_sampler = type;
+}
+
+double CpuTracer::averageSamples() const
+{
+	double pixels = 0, samples = 0;
+	for (size_t tile = 0; tile < tileCount(); tile++) {
+		int x0, y0, x1, y1;
+		_tileBounds(tile, x0, y0, x1, y1);
+		double area = double(x1 - x0) * (y1 - y0);
+		pixels += area;
+		samples += area * _tileSamples[tile];
+	}
+	return pixels > 0 ? samples / pixels : 0;
+}
+
+void CpuTracer::setRegion(int x0, int y0, int x1, int y1)
+{
+	_region[0] = max(x0, 0);
+	_region[1] = max(y0, 0);
+	_region[2] = min(x1, _width);
+	_region[3] = min(y1, _height);
+	reset();
+}
+
+void CpuTracer::setFirstSample(int firstSample)
+{
+	_firstSample = firstSample;
+	reset();
+}
+
+void CpuTracer::reset()
+{
+	for (int y = _region[1]; y < _region[3]; y++) {
+		size_t row = (size_t)y * _width;
+		fill(&_canvas[(row + _region[0]) * 4], &_canvas[(row + _region[2]) * 4], 0.0f);
+		fill(&_variance[row + _region[0]], &_variance[row + _region[2]], 0.0f);
+	}
+	_frames = 0;
+	_resetTiles();
+}
+
+int CpuTracer::pixelSamples(int x, int y) const
+{
+	return _tileSamples[(size_t)(y / _tileSize) * _tilesX + x / _tileSize];
+}
+
+void CpuTracer::_resetTiles()
+{
+	_tileSamples.assign(tileCount(), 0);
+	_tileActive.assign(tileCount(), 0);
+	_activeTiles.clear();
+	for (size_t tile = 0; tile < tileCount(); tile++) {
+		int x0, y0, x1, y1;
+		_tileBounds(tile, x0, y0, x1, y1);
+		if (x1 <= _region[0] || x0 >= _region[2] || y1 <= _region[1] || y0 >= _region[3]) continue;
+		_tileActive[tile] = 1;
+		_activeTiles.push_back(tile);
+	}
+}
+
+void CpuTracer::load(const SceneBuffers &s)
+{
+	ScopedTimer timer("cpu.setup");
+	_triangles = s.triangles();
+	_attributes = s.attributes();
+	_materials = s.materials();
+	_emitters = s.emitters();
+	_emitterCount = s.emitterCount();
+	_topNodes = s.topNodes();
+	_instances = s.instances();
+	_identity.resize(s.instanceCount());
+	for (size_t i = 0; i < s.instanceCount(); i++) {
+		_identity[i] = isIdentity(_instances[i]);
+	}
+	_frames = 0;
+	_resetTiles();
+	buildTrianglePacks(*_kernels, _triangles, s.nodes(), s.nodeCount(), _packNodes, _packs, _leafPacks);
+	_nodes = _packNodes.data();
+}
+
+void CpuTracer::renderFrame()
+{
+	ScopedTimer timer("cpu.frame");
+	_frames++;
+
+	size_t samples = 0;
+	for (size_t tile : _activeTiles) {
+		int x0, y0, x1, y1;
+		_tileBounds(tile, x0, y0, x1, y1);
+		samples += (size_t)(x1 - x0) * (y1 - y0);
+	}
+
+	atomic<size_t> rays(0);
+	_scheduler.parallelFor(_activeTiles.size(), [&](size_t i) {
+		rays += _renderTile(_activeTiles[i]);
+	});
+	Stats::shared().count("rays", (double)rays);
+	Stats::shared().count("samples", (double)samples);
+
+	// converged tiles drop out of the following passes
+	size_t active = 0;
+	for (size_t tile : _activeTiles) {
+		if (_tileActive[tile]) _activeTiles[active++] = tile;
+	}
+	_activeTiles.resize(active);
+}
+
+bool CpuTracer::saveCanvas(const char *fileName) const
+{
+	return writeImage(fileName, _canvas.data(), _width, _height);
+}
+
+void CpuTracer::_tileBounds(size_t tile, int &x0, int &y0, int &x1, int &y1) const
+{
+	x0 = (int)(tile % _tilesX) * _tileSize;
+	y0 = (int)(tile / _tilesX) * _tileSize;
+	x1 = min(x0 + _tileSize, _width);
+	y1 = min(y0 + _tileSize, _height);
+}
+
+int CpuTracer::_primaryPacket(int bx, int by, int x1, int y1, int sample, RayPacket &rays) const
+{
+	// coherent primary rays of a 4x2 pixel block share one traversal
+	Vector3f eye = _camera.eye();
+	int active = 0;
+	for (int i = 0; i < RayPacket::Size; i++) {
+		int x = bx + i % PacketWidth, y = by + i / PacketWidth;
+		if (x >= x1 || y >= y1) continue;
+		float jx = 0, jy = 0;
+		if (sample >= 0) {
+			sample2D(_sampler, pixelSeed(x, y, _width), (uint32_t)sample, 0, jx, jy);
+			jx -= 0.5f;
+			jy -= 0.5f;
+		}
+		float px = (x + jx) / float(_width - 1);
+		float py = (y + jy) / float(_height - 1);
+		Vector3f dir = ((1 - px) * ((1 - py) * _camera.ray00() + py * _camera.ray01())
+			+ px * ((1 - py) * _camera.ray10() + py * _camera.ray11())).normalized();
+		Vector3f o = eye + dir * EPS;
+		rays.ox[i] = o[0]; rays.oy[i] = o[1]; rays.oz[i] = o[2];
+		rays.dx[i] = dir[0]; rays.dy[i] = dir[1]; rays.dz[i] = dir[2];
+		rays.idx[i] = 1.0f / dir[0]; rays.idy[i] = 1.0f / dir[1]; rays.idz[i] = 1.0f / dir[2];
+		active |= 1 << i;
+	}
+	return active;
+}
+
+size_t CpuTracer::_renderTile(size_t tile)
+{
+	int x0, y0, x1, y1;
+	_tileBounds(tile, x0, y0, x1, y1);
+	int n = ++_tileSamples[tile];
+	int sample = _firstSample + n - 1;
+	float weight = 1.0f / float(n);
+	int tileWidth = x1 - x0;
+	size_t traced = 0;
+
+	// paths live in one slot per tile pixel, `queue` holds the slots whose
+	// last ray hit something and still need shading
+	static thread_local vector<path_t> paths;
+	static thread_local vector<int> queue, next;
+	paths.resize((size_t)tileWidth * (y1 - y0));
+	queue.clear();
+
+	// generate and intersect primary rays as coherent packets
+	RayPacket rays = RayPacket();
+	hit_info_t hits[RayPacket::Size];
+	for (int by = y0; by < y1; by += PacketHeight) {
+		for (int bx = x0; bx < x1; bx += PacketWidth) {
+			int active = _primaryPacket(bx, by, x1, y1, sample, rays);
+			int hitMask = _intersectPacket(rays, active, hits);
+
+			for (int i = 0; i < RayPacket::Size; i++) {
+				if (!(active & (1 << i))) continue;
+				int x = bx + i % PacketWidth, y = by + i / PacketWidth;
+				int slot = (y - y0) * tileWidth + (x - x0);
+				path_t &p = paths[slot];
+				p.origin = _camera.eye();
+				p.dir = Vector3f(rays.dx[i], rays.dy[i], rays.dz[i]);
+				p.throughput = Vector3f(1, 1, 1);
+				p.radiance = Vector3f(0, 0, 0);
+				p.pixel = pixelSeed(x, y, _width);
+				p.sample = (uint32_t)sample;
+				p.depth = 0;
+				p.bsdfPdf = 0;
+				p.hit = hits[i];
+				traced++;
+				if (hitMask & (1 << i)) queue.push_back(slot);
+			}
+		}
+	}
+
+	// shade the hits of this bounce, then intersect the paths that go on
+	while (!queue.empty()) {
+		next.clear();
+		for (int slot : queue) {
+			if (_shade(paths[slot])) next.push_back(slot);
+		}
+		queue.clear();
+		for (int slot : next) {
+			path_t &p = paths[slot];
+			traced++;
+			if (_isIntersected(p.origin + p.dir * EPS, p.dir, p.hit)) queue.push_back(slot);
+		}
+	}
+
+	// accumulate
+	double error = 0;
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			Vector3f color = paths[(y - y0) * tileWidth + (x - x0)].radiance.cwiseMax(0.0f).cwiseMin(1.0f);
+			size_t index = (size_t)y * _width + x;
+			float *pix = &_canvas[index * 4];
+			float lumOld = luminance(pix);
+			pix[0] += (color[0] - pix[0]) * weight;
+			pix[1] += (color[1] - pix[1]) * weight;
+			pix[2] += (color[2] - pix[2]) * weight;
+			pix[3] += (1.0f - pix[3]) * weight;
+
+			// Welford update of the luminance variance; the running mean
+			// is the canvas itself
+			float lum = luminance(color.data()), lumNew = luminance(pix);
+			float &m2 = _variance[index];
+			m2 = n == 1 ? 0.0f : m2 + (lum - lumOld) * (lum - lumNew);
+			if (n > 1) {
+				float stdError = sqrtf(m2 / float(n - 1) / float(n));
+				error += stdError / max(lumNew, MIN_LUMINANCE);
+			}
+		}
+	}
+
+	if (_errorThreshold > 0 && n >= _minSamples
+			&& error / (double(x1 - x0) * (y1 - y0)) < _errorThreshold) {
+		_tileActive[tile] = 0;
+	}
+	return traced;
+}
+
+size_t CpuTracer::castPrimaryRays()
+{
+	atomic<size_t> cast(0);
+	_bounceRays.assign((size_t)_width * _height * 6, 0.0f);
+
+	_scheduler.parallelFor((size_t)_tilesX * _tilesY, [&](size_t tile) {
+		int x0, y0, x1, y1;
+		_tileBounds(tile, x0, y0, x1, y1);
+		RayPacket rays = RayPacket();
+		hit_info_t hits[RayPacket::Size];
+		size_t count = 0;
+
+		for (int by = y0; by < y1; by += PacketHeight) {
+			for (int bx = x0; bx < x1; bx += PacketWidth) {
+				int active = _primaryPacket(bx, by, x1, y1, -1, rays);
+				int hitMask = _intersectPacket(rays, active, hits);
+
+				// keep one diffuse bounce per hit for castSecondaryRays
+				for (int i = 0; i < RayPacket::Size; i++) {
+					if (!(active & (1 << i))) continue;
+					count++;
+					if (!(hitMask & (1 << i))) continue;
+					int x = bx + i % PacketWidth, y = by + i / PacketWidth;
+					float s0, s1;
+					sample2D(_sampler, pixelSeed(x, y, _width), 0, bounceDimension(0), s0, s1);
+					Vector3f dir(rays.dx[i], rays.dy[i], rays.dz[i]);
+					Vector3f hP = _camera.eye() + dir * hits[i].dist;
+					Vector3f hN = _normal(hits[i]);
+					Vector3f nextDir = sampleHemisphere(hN, s0, s1);
+					float *bounce = &_bounceRays[((size_t)y * _width + x) * 6];
+					memcpy(bounce, hP.data(), 3 * sizeof(float));
+					memcpy(bounce + 3, nextDir.data(), 3 * sizeof(float));
+				}
+			}
+		}
+		cast += count;
+	});
+	return cast;
+}
+
+size_t CpuTracer::castSecondaryRays()
+{
+	atomic<size_t> cast(0);
+	_scheduler.parallelFor((size_t)_tilesX * _tilesY, [&](size_t tile) {
+		int x0, y0, x1, y1;
+		_tileBounds(tile, x0, y0, x1, y1);
+		size_t count = 0;
+
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				const float *bounce = &_bounceRays[((size_t)y * _width + x) * 6];
+				Vector3f dir = loadVec3(bounce + 3);
+				if (dir.isZero()) continue;
+				hit_info_t h;
+				_isIntersected(loadVec3(bounce) + dir * EPS, dir, h);
+				count++;
+			}
+		}
+		cast += count;
+	});
+	return cast;
+}
+
+size_t CpuTracer::castOcclusionRays()
+{
+	atomic<size_t> cast(0);
+	_scheduler.parallelFor((size_t)_tilesX * _tilesY, [&](size_t tile) {
+		int x0, y0, x1, y1;
+		_tileBounds(tile, x0, y0, x1, y1);
+		size_t count = 0;
+
+		for (int y = y0; y < y1; y++) {
+			for (int x = x0; x < x1; x++) {
+				const float *bounce = &_bounceRays[((size_t)y * _width + x) * 6];
+				Vector3f dir = loadVec3(bounce + 3);
+				if (dir.isZero()) continue;
+				_isOccluded(loadVec3(bounce), dir, 2 * EPS, MAX_SCENE_BOUNDS);
+				count++;
+			}
+		}
+		cast += count;
+	});
+	return cast;
+}
+
+bool CpuTracer::_shade(path_t &p) const
+{
+	const face_attr_t &attr = _attributes[p.hit.fptr];
+	const material_t &mat = _materials[attr.material];
+	Vector3f hP = p.origin + p.dir * p.hit.dist;
+	Vector3f hN = _normal(p.hit);
+	Vector3f Ka = loadVec3(mat.Ka);
+	if (!Ka.isZero()) {
+		// emission found by BSDF sampling, weighed against light sampling
+		float w = 1;
+		if (p.bsdfPdf > 0 && attr.emitterPdf > 0) {
+			w = powerHeuristic(p.bsdfPdf, _lightPdf(p.hit, p.dir));
+		}
+		p.radiance += p.throughput.cwiseProduct(Ka) * w;
+	}
+	if (p.depth + 1 >= _maxDepth) {
+		return false;
+	}
+
+	float choice, roulette;
+	sample2D(_sampler, p.pixel, p.sample, choiceDimension(p.depth), choice, roulette);
+	if (_emitterCount > 0 && !(loadVec3(mat.Kd).isZero() && loadVec3(mat.Ks).isZero())) {
+		float l0, l1;
+		sample2D(_sampler, p.pixel, p.sample, lightDimension(p.depth), l0, l1);
+		p.radiance += p.throughput.cwiseProduct(_sampleDirect(hP, hN, p.dir, mat, choice, l0, l1));
+	}
+
+	float s0, s1;
+	sample2D(_sampler, p.pixel, p.sample, bounceDimension(p.depth), s0, s1);
+	Vector3f nextDir = sampleHemisphere(hN, s0, s1);
+	float LdN = max(nextDir.dot(hN), 0.0f);
+	Vector3f R = (2 * LdN * hN - nextDir).normalized();
+	float sfactor = R.dot(-p.dir);
+	Vector3f weight = loadVec3(mat.Kd);
+	if (sfactor > 0) {
+		weight += loadVec3(mat.Ks) * powf(sfactor, mat.Ns);
+	}
+	p.throughput = p.throughput.cwiseProduct(weight);
+	p.bsdfPdf = LdN / PI;
+	p.origin = hP;
+	p.dir = nextDir;
+	p.depth++;
+
+	if (p.depth >= RR_DEPTH) {
+		float q = min(p.throughput.maxCoeff(), 0.95f);
+		if (roulette >= q) return false;
+		p.throughput /= q;
+	}
+	return true;
+}
+
+Vector3f CpuTracer::_normal(const hit_info_t &h) const
+{
+	Vector3f n = getNormal(h.u, h.v, _attributes[h.fptr]);
+	return _identity[h.instance] ? n : toWorldNormal(_instances[h.instance], n);
+}
+
+// Area density of the hit point under light sampling, as a solid angle
+// density seen from the ray origin.
+float CpuTracer::_lightPdf(const hit_info_t &h, const Vector3f &dir) const
+{
+	const triangle_t &t = _triangles[h.fptr];
+	const instance_t &inst = _instances[h.instance];
+	Vector3f c = toWorldVector(inst, loadVec3(t.e1)).cross(toWorldVector(inst, loadVec3(t.e2)));
+	float cosL = fabsf(c.dot(dir)) / max(c.norm(), EPS);
+	return _attributes[h.fptr].emitterPdf * h.dist * h.dist / max(cosL, EPS);
+}
+
+Vector3f CpuTracer::_sampleDirect(const Vector3f &P, const Vector3f &N, const Vector3f &dir,
+	const material_t &mat, float choice, float s0, float s1) const
+{
+	// first emitter whose cdf reaches `choice`
+	const emitter_t *end = _emitters + _emitterCount;
+	const emitter_t *e = lower_bound(_emitters, end - 1, choice,
+		[](const emitter_t &a, float u) { return a.cdf < u; });
+	const triangle_t &t = _triangles[e->face];
+	const instance_t &inst = _instances[e->instance];
+	Vector3f e1 = toWorldVector(inst, loadVec3(t.e1)), e2 = toWorldVector(inst, loadVec3(t.e2));
+	float su = sqrtf(s0);
+	Vector3f L = toWorldPoint(inst, loadVec3(t.v0)) + e1 * (su * (1 - s1)) + e2 * (su * s1);
+	Vector3f d = L - P;
+	float dist = d.norm();
+	Vector3f wi = d / dist;
+	float cosS = wi.dot(N);
+	float cosL = fabsf(e1.cross(e2).normalized().dot(wi));
+	if (cosS <= 0 || cosL < EPS) {
+		return Vector3f::Zero();
+	}
+
+	if (_isOccluded(P, wi, 2 * EPS, dist * (1 - SHADOW_EPS))) {
+		return Vector3f::Zero();
+	}
+
+	float pdf = _attributes[e->face].emitterPdf * dist * dist / cosL;
+	Vector3f Le = loadVec3(_materials[_attributes[e->face].material].Ka);
+	return evalBsdf(mat, N, dir, wi).cwiseProduct(Le) * (cosS * powerHeuristic(pdf, cosS / PI) / pdf);
+}
+
+// The top-level tree is walked like a mesh tree; at its leaves the ray moves
+// into the object space of each instance and descends into the mesh tree.
+// Identity instances, e.g. a whole OBJ file, skip the transform.
+bool CpuTracer::_isIntersected(const Vector3f &origin, const Vector3f &dir, hit_info_t &h) const
+{
+	const bvh_node_t *nodes = _topNodes;
+	Vector3f invDir = dir.cwiseInverse();
+	int stack[BVH::MaxDepth];
+	int sp = 0;
+	int node = 0;
+	SimdHit hit = { MAX_SCENE_BOUNDS, 0, 0, -1 };
+
+	h.dist = MAX_SCENE_BOUNDS;
+	if (intersectNode(origin, invDir, nodes[0], hit.dist) == MAX_SCENE_BOUNDS)
+		return false;
+
+	while (true) {
+		const bvh_node_t &n = nodes[node];
+		if (n.count > 0) {
+			for (int i = n.start; i < n.start + n.count; i++) {
+				const instance_t &inst = _instances[i];
+				bool found = _identity[i]
+					? _intersectMesh(inst.root, origin, dir, hit)
+					: _intersectMesh(inst.root, toObjectPoint(inst, origin), toObjectVector(inst, dir), hit);
+				if (found) h.instance = i;
+			}
+		}
+		else {
+			int nearChild = node + 1;
+			int farChild = n.start;
+			float dNear = intersectNode(origin, invDir, nodes[nearChild], hit.dist);
+			float dFar = intersectNode(origin, invDir, nodes[farChild], hit.dist);
+			if (dFar < dNear) {
+				swap(nearChild, farChild);
+				swap(dNear, dFar);
+			}
+			if (dNear != MAX_SCENE_BOUNDS) {
+				if (dFar != MAX_SCENE_BOUNDS) stack[sp++] = farChild;
+				node = nearChild;
+				continue;
+			}
+		}
+		if (sp == 0) break;
+		node = stack[--sp];
+	}
+	if (hit.index < 0) return false;
+	h.fptr = hit.index;
+	h.dist = hit.dist;
+	h.u = hit.u;
+	h.v = hit.v;
+	return true;
+}
+
+// Closest hit in the mesh tree at `root` for a ray in the mesh's object
+// space. hit.dist bounds the search; true when it found a closer hit.
+bool CpuTracer::_intersectMesh(int root, const Vector3f &origin, const Vector3f &dir, SimdHit &hit) const
+{
+	const bvh_node_t *nodes = _nodes;
+	Vector3f invDir = dir.cwiseInverse();
+	int stack[BVH::MaxDepth];
+	int sp = 0;
+	int node = root;
+	const size_t stride = _kernels->packStride();
+	const int width = _kernels->width;
+	SimdRay ray = { origin[0], origin[1], origin[2], dir[0], dir[1], dir[2] };
+	bool found = false;
+
+	if (intersectNode(origin, invDir, nodes[root], hit.dist) == MAX_SCENE_BOUNDS)
+		return false;
+
+	while (true) {
+		const bvh_node_t &n = nodes[node];
+		if (n.count > 0) {
+			const float *pack = &_packs[_leafPacks[node] * stride];
+			for (int j = 0; j < n.count; j += width, pack += stride) {
+				found |= _kernels->intersectPack(ray, pack, hit);
+			}
+		}
+		else {
+			// visit the nearer child first, defer the other one
+			int nearChild = node + 1;
+			int farChild = n.start;
+			float dNear = intersectNode(origin, invDir, nodes[nearChild], hit.dist);
+			float dFar = intersectNode(origin, invDir, nodes[farChild], hit.dist);
+			if (dFar < dNear) {
+				swap(nearChild, farChild);
+				swap(dNear, dFar);
+			}
+			if (dNear != MAX_SCENE_BOUNDS) {
+				if (dFar != MAX_SCENE_BOUNDS) stack[sp++] = farChild;
+				node = nearChild;
+				continue;
+			}
+		}
+		if (sp == 0) break;
+		node = stack[--sp];
+	}
+	return found;
+}
+
+// Any-hit query for shadow rays: true as soon as any triangle is hit in
+// (tmin, tmax). Children are taken in tree order and no hit data is kept.
+bool CpuTracer::_isOccluded(const Vector3f &origin, const Vector3f &dir, float tmin, float tmax) const
+{
+	const bvh_node_t *nodes = _topNodes;
+	Vector3f invDir = dir.cwiseInverse();
+	int stack[BVH::MaxDepth];
+	int sp = 0;
+	int node = 0;
+	// the pack kernels only accept hits past EPS, so shift the ray to match
+	Vector3f o = origin + dir * (tmin - EPS);
+	float range = tmax - (tmin - EPS);
+
+	if (intersectNode(o, invDir, nodes[0], range) == MAX_SCENE_BOUNDS)
+		return false;
+
+	while (true) {
+		const bvh_node_t &n = nodes[node];
+		if (n.count > 0) {
+			for (int i = n.start; i < n.start + n.count; i++) {
+				const instance_t &inst = _instances[i];
+				bool occluded = _identity[i]
+					? _isMeshOccluded(inst.root, o, dir, range)
+					: _isMeshOccluded(inst.root, toObjectPoint(inst, o), toObjectVector(inst, dir), range);
+				if (occluded) return true;
+			}
+		}
+		else {
+			int first = node + 1;
+			int second = n.start;
+			bool hitFirst = intersectNode(o, invDir, nodes[first], range) != MAX_SCENE_BOUNDS;
+			bool hitSecond = intersectNode(o, invDir, nodes[second], range) != MAX_SCENE_BOUNDS;
+			if (hitFirst || hitSecond) {
+				if (hitFirst && hitSecond) stack[sp++] = second;
+				node = hitFirst ? first : second;
+				continue;
+			}
+		}
+		if (sp == 0) break;
+		node = stack[--sp];
+	}
+	return false;
+}
+
+bool CpuTracer::_isMeshOccluded(int root, const Vector3f &origin, const Vector3f &dir, float range) const
+{
+	const bvh_node_t *nodes = _nodes;
+	Vector3f invDir = dir.cwiseInverse();
+	int stack[BVH::MaxDepth];
+	int sp = 0;
+	int node = root;
+	const size_t stride = _kernels->packStride();
+	const int width = _kernels->width;
+	SimdRay ray = { origin[0], origin[1], origin[2], dir[0], dir[1], dir[2] };
+
+	if (intersectNode(origin, invDir, nodes[root], range) == MAX_SCENE_BOUNDS)
+		return false;
+
+	while (true) {
+		const bvh_node_t &n = nodes[node];
+		if (n.count > 0) {
+			const float *pack = &_packs[_leafPacks[node] * stride];
+			for (int j = 0; j < n.count; j += width, pack += stride) {
+				SimdHit hit = { range, 0, 0, -1 };
+				if (_kernels->intersectPack(ray, pack, hit)) return true;
+			}
+		}
+		else {
+			int first = node + 1;
+			int second = n.start;
+			bool hitFirst = intersectNode(origin, invDir, nodes[first], range) != MAX_SCENE_BOUNDS;
+			bool hitSecond = intersectNode(origin, invDir, nodes[second], range) != MAX_SCENE_BOUNDS;
+			if (hitFirst || hitSecond) {
+				if (hitFirst && hitSecond) stack[sp++] = second;
+				node = hitFirst ? first : second;
+				continue;
+			}
+		}
+		if (sp == 0) break;
+		node = stack[--sp];
+	}
+	return false;
+}
+
+int CpuTracer::_intersectPacket(const RayPacket &in, int active, hit_info_t *h) const
+{
+	struct entry_t { int node; int mask; };
+	const bvh_node_t *nodes = _topNodes;
+	RayPacket rays = in;
+	SimdHit hits[RayPacket::Size];
+	int instances[RayPacket::Size];
+	float tNear[RayPacket::Size], tNear2[RayPacket::Size];
+	entry_t stack[BVH::MaxDepth];
+	int sp = 0;
+	int hitMask = 0;
+
+	for (int i = 0; i < RayPacket::Size; i++) {
+		rays.tmax[i] = MAX_SCENE_BOUNDS;
+		hits[i].dist = MAX_SCENE_BOUNDS;
+		hits[i].index = -1;
+	}
+
+	int node = 0;
+	int mask = _kernels->intersectBoxPacket(rays, active, nodes[0], tNear);
+	while (mask) {
+		const bvh_node_t &n = nodes[node];
+		if (n.count > 0) {
+			for (int k = n.start; k < n.start + n.count; k++) {
+				const instance_t &inst = _instances[k];
+				int found;
+				if (_identity[k]) {
+					found = _intersectPacketMesh(inst.root, rays, mask, hits);
+				}
+				else {
+					RayPacket local = rays;
+					for (int i = 0; i < RayPacket::Size; i++) {
+						if (!(mask & (1 << i))) continue;
+						Vector3f o = toObjectPoint(inst, Vector3f(rays.ox[i], rays.oy[i], rays.oz[i]));
+						Vector3f d = toObjectVector(inst, Vector3f(rays.dx[i], rays.dy[i], rays.dz[i]));
+						local.ox[i] = o[0], local.oy[i] = o[1], local.oz[i] = o[2];
+						local.dx[i] = d[0], local.dy[i] = d[1], local.dz[i] = d[2];
+						local.idx[i] = 1 / d[0], local.idy[i] = 1 / d[1], local.idz[i] = 1 / d[2];
+					}
+					found = _intersectPacketMesh(inst.root, local, mask, hits);
+					for (int i = 0; i < RayPacket::Size; i++) {
+						rays.tmax[i] = local.tmax[i];
+					}
+				}
+				for (int i = 0; i < RayPacket::Size; i++) {
+					if (found & (1 << i)) instances[i] = k;
+				}
+				hitMask |= found;
+			}
+			mask = 0;
+		}
+		else {
+			int nearChild = node + 1;
+			int farChild = n.start;
+			int nearMask = _kernels->intersectBoxPacket(rays, mask, nodes[nearChild], tNear);
+			int farMask = _kernels->intersectBoxPacket(rays, mask, nodes[farChild], tNear2);
+			int closer = 0, farther = 0;
+			for (int i = 0; i < RayPacket::Size; i++) {
+				if (!(nearMask & farMask & (1 << i))) continue;
+				if (tNear2[i] < tNear[i]) farther++;
+				else closer++;
+			}
+			if (farther > closer || !nearMask) {
+				swap(nearChild, farChild);
+				swap(nearMask, farMask);
+			}
+			if (nearMask) {
+				if (farMask) stack[sp++] = { farChild, farMask };
+				node = nearChild;
+				mask = nearMask;
+				continue;
+			}
+			mask = 0;
+		}
+		while (!mask && sp > 0) {
+			--sp;
+			node = stack[sp].node;
+			mask = _kernels->intersectBoxPacket(rays, stack[sp].mask, nodes[node], tNear);
+		}
+	}
+
+	for (int i = 0; i < RayPacket::Size; i++) {
+		if (!(hitMask & (1 << i))) continue;
+		h[i].fptr = hits[i].index;
+		h[i].dist = hits[i].dist;
+		h[i].u = hits[i].u;
+		h[i].v = hits[i].v;
+		h[i].instance = instances[i];
+	}
+	return hitMask;
+}
+
+// Packet traversal of the mesh tree at `root`. Lanes that find a closer hit
+// update `hits` and rays.tmax and are returned as a mask.
+int CpuTracer::_intersectPacketMesh(int root, RayPacket &rays, int active, SimdHit *hits) const
+{
+	struct entry_t { int node; int mask; };
+	const size_t stride = _kernels->packStride();
+	const int width = _kernels->width;
+	const bvh_node_t *nodes = _nodes;
+	float tNear[RayPacket::Size], tNear2[RayPacket::Size];
+	entry_t stack[BVH::MaxDepth];
+	int sp = 0;
+	int hitMask = 0;
+
+	int node = root;
+	int mask = _kernels->intersectBoxPacket(rays, active, nodes[root], tNear);
+	while (mask) {
+		const bvh_node_t &n = nodes[node];
+		if (n.count > 0) {
+			const float *first = &_packs[_leafPacks[node] * stride];
+			for (int i = 0; i < RayPacket::Size; i++) {
+				if (!(mask & (1 << i))) continue;
+				SimdRay ray = { rays.ox[i], rays.oy[i], rays.oz[i], rays.dx[i], rays.dy[i], rays.dz[i] };
+				const float *pack = first;
+				for (int j = 0; j < n.count; j += width, pack += stride) {
+					if (_kernels->intersectPack(ray, pack, hits[i])) {
+						rays.tmax[i] = hits[i].dist;
+						hitMask |= 1 << i;
+					}
+				}
+			}
+			mask = 0;
+		}
+		else {
+			// the packet descends into the child most of its rays reach first
+			int nearChild = node + 1;
+			int farChild = n.start;
+			int nearMask = _kernels->intersectBoxPacket(rays, mask, nodes[nearChild], tNear);
+			int farMask = _kernels->intersectBoxPacket(rays, mask, nodes[farChild], tNear2);
+			int closer = 0, farther = 0;
+			for (int i = 0; i < RayPacket::Size; i++) {
+				if (!(nearMask & farMask & (1 << i))) continue;
+				if (tNear2[i] < tNear[i]) farther++;
+				else closer++;
+			}
+			if (farther > closer || !nearMask) {
+				swap(nearChild, farChild);
+				swap(nearMask, farMask);
+			}
+			if (nearMask) {
+				if (farMask) stack[sp++] = { farChild, farMask };
+				node = nearChild;
+				mask = nearMask;
+				continue;
+			}
+			mask = 0;
+		}
+		// rays may have found closer hits since the entry was pushed
+		while (!mask && sp > 0) {
+			--sp;
+			node = stack[sp].node;
+			mask = _kernels->intersectBoxPacket(rays, stack[sp].mask, nodes[node], tNear);
+		}
+	}
+	return hitMask;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "Types.h"
+#include "SceneBuffers.h"
+#include "Camera.h"
+#include "TaskScheduler.h"
+#include "SimdKernels.h"
+#include "Sampler.h"
+
+#include <vector>
+
+// Software backend mirroring the wavefront stages of trace.glsl. The image is
+// split into tiles that are traced on all cores, and the accumulated canvas
+// can be written to disk without any window or GL context. Each tile runs
+// its paths as a queue through intersect and shade stages, one bounce at a
+// time. Primary rays are traced as 8-ray packets and leaf triangles are
+// tested in SoA packs with the widest SIMD kernel the CPU supports. Rays
+// walk the top-level tree over instances and continue into each instance's
+// mesh tree in its object space.
+class CpuTracer
+{
+public:
+	struct RenderStats
+	{
+		int samples;
+		double setupSeconds;
+		double renderSeconds;
+		double averageSamples;
+		bool timedOut;
+		bool converged;
+	};
+
+	CpuTracer(int width, int height, unsigned int threads = 0);
+
+	// Accumulates up to `samples` frames, or stops before the next frame
+	// would overrun `timeBudget` seconds (0 means no limit) or once every
+	// tile has converged. At least one frame is always rendered.
+	RenderStats render(const SceneBuffers &s, int samples, double timeBudget = 0);
+
+	void load(const SceneBuffers &s);
+	void renderFrame();
+	bool saveCanvas(const char *fileName) const;
+
+	// Restricts rendering to the tiles overlapping [x0, x1) x [y0, y1) and
+	// numbers samples from `firstSample`, so processes rendering disjoint
+	// sample ranges of the same pixels draw uncorrelated paths. Both reset
+	// the accumulation inside the region.
+	void setRegion(int x0, int y0, int x1, int y1);
+	void setFirstSample(int firstSample);
+	void reset();
+
+	// running mean RGBA per pixel, and the samples behind each pixel
+	const float *canvas() const { return _canvas.data(); }
+	int pixelSamples(int x, int y) const;
+
+	// Adaptive sampling: a tile stops receiving samples once it has at least
+	// `minSamples` and the mean relative standard error of its pixels'
+	// luminance drops below `threshold`. A threshold of 0 samples every tile
+	// every frame.
+	void setAdaptive(float threshold, int minSamples = 16);
+
+	// Longest path in intersections; paths past the first few bounces are
+	// ended by Russian roulette well before this.
+	void setMaxDepth(int depth);
+
+	// Sobol (default) or independent PCG samples, see Sampler.h
+	void setSampler(SamplerType type);
+	bool converged() const { return _activeTiles.empty(); }
+	size_t activeTileCount() const { return _activeTiles.size(); }
+	size_t tileCount() const { return (size_t)_tilesX * _tilesY; }
+	double averageSamples() const;
+
+	// Intersection-only passes for benchmarking: one coherent primary ray per
+	// pixel, then one incoherent diffuse bounce from every primary hit, traced
+	// for the closest hit or as an any-hit occlusion query. All return the
+	// number of rays cast.
+	size_t castPrimaryRays();
+	size_t castSecondaryRays();
+	size_t castOcclusionRays();
+
+	Camera &camera() { return _camera; }
+	int frames() const { return _frames; }
+	int width() const { return _width; }
+	int height() const { return _height; }
+	unsigned int threadCount() const { return _scheduler.threadCount(); }
+	const char *kernelName() const { return _kernels->name; }
+
+private:
+	struct hit_info_t;
+	struct path_t;
+
+	void _tileBounds(size_t tile, int &x0, int &y0, int &x1, int &y1) const;
+	int _primaryPacket(int bx, int by, int x1, int y1, int sample, RayPacket &rays) const;
+	void _resetTiles();
+	size_t _renderTile(size_t tile);
+	bool _shade(path_t &p) const;
+	Eigen::Vector3f _normal(const hit_info_t &h) const;
+	float _lightPdf(const hit_info_t &h, const Eigen::Vector3f &dir) const;
+	Eigen::Vector3f _sampleDirect(
+		const Eigen::Vector3f &P,
+		const Eigen::Vector3f &N,
+		const Eigen::Vector3f &dir,
+		const material_t &mat,
+		float choice, float s0, float s1) const;
+	bool _isIntersected(
+		const Eigen::Vector3f &origin,
+		const Eigen::Vector3f &dir,
+		hit_info_t &h) const;
+	bool _intersectMesh(
+		int root,
+		const Eigen::Vector3f &origin,
+		const Eigen::Vector3f &dir,
+		SimdHit &hit) const;
+	bool _isOccluded(
+		const Eigen::Vector3f &origin,
+		const Eigen::Vector3f &dir,
+		float tmin, float tmax) const;
+	bool _isMeshOccluded(
+		int root,
+		const Eigen::Vector3f &origin,
+		const Eigen::Vector3f &dir,
+		float range) const;
+	int _intersectPacket(
+		const RayPacket &rays,
+		int active,
+		hit_info_t *h) const;
+	int _intersectPacketMesh(
+		int root,
+		RayPacket &rays,
+		int active,
+		SimdHit *hits) const;
+
+private:
+	int _frames;
+	int _firstSample;
+	int _region[4];
+	int _width;
+	int _height;
+	int _tilesX, _tilesY;
+	std::vector<float> _canvas;
+	std::vector<float> _variance;
+	std::vector<float> _bounceRays;
+	Camera _camera;
+	TaskScheduler _scheduler;
+
+	// per-tile sample counts and convergence state
+	float _errorThreshold;
+	int _minSamples;
+	int _maxDepth;
+	SamplerType _sampler;
+	std::vector<int> _tileSamples;
+	std::vector<char> _tileActive;
+	std::vector<size_t> _activeTiles;
+
+	const triangle_t *_triangles;
+	const bvh_node_t *_nodes;
+	const face_attr_t *_attributes;
+	const material_t *_materials;
+	const emitter_t *_emitters;
+	size_t _emitterCount;
+	const bvh_node_t *_topNodes;
+	const instance_t *_instances;
+	std::vector<char> _identity;
+
+	const SimdKernels *_kernels;
+	std::vector<bvh_node_t> _packNodes;
+	std::vector<float> _packs;
+	std::vector<int> _leafPacks;
+
+private:
+	const int _tileSize = 32;
+	static const int PacketWidth = 4;
+	static const int PacketHeight = RayPacket::Size / PacketWidth;
+};
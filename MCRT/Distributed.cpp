@@ -0,0 +1,314 @@
+#include "Distributed.h"
+#include "SceneBuffers.h"
+#include "CpuTracer.h"
+#include "ImageWriter.h"
+#include "Stats.h"
+
+#include <iostream>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+using namespace std;
+using namespace Eigen;
+
+typedef chrono::steady_clock Clock;
+
+static double now()
+{
+	return chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+static size_t unitPixels(const work_unit_t &u)
+{
+	return (size_t)(u.x1 - u.x0) * (u.y1 - u.y0);
+}
+
+RenderCoordinator::RenderCoordinator(const render_job_t &job, int samples, int unitSize, int unitSamples)
+	: _job(job), _done(0), _duplicated(0), _requeued(0), _unitSeconds(0)
+{
+	unitSize = max(unitSize, 1);
+	unitSamples = unitSamples > 0 ? min(unitSamples, samples) : samples;
+	_accum.assign((size_t)job.width * job.height * 4, 0.0f);
+
+	// sample ranges outermost, so the whole image refines evenly
+	for (int first = 0; first < samples; first += unitSamples) {
+		for (int y = 0; y < job.height; y += unitSize) {
+			for (int x = 0; x < job.width; x += unitSize) {
+				Unit u;
+				u.unit.id = (uint32_t)_units.size();
+				u.unit.x0 = x;
+				u.unit.y0 = y;
+				u.unit.x1 = min(x + unitSize, (int)job.width);
+				u.unit.y1 = min(y + unitSize, (int)job.height);
+				u.unit.firstSample = first;
+				u.unit.samples = min(unitSamples, samples - first);
+				u.state = Pending;
+				u.copies = 0;
+				u.started = 0;
+				_units.push_back(u);
+			}
+		}
+	}
+}
+
+bool RenderCoordinator::run(const char *address)
+{
+	Socket listener;
+	if (!listener.listen(address)) {
+		return false;
+	}
+	cout << "Waiting for workers on " << address << ", " << _units.size() << " units" << endl;
+
+	vector<char> payload;
+	size_t reported = 0;
+	while (_done < _units.size()) {
+		vector<Socket *> sockets(1, &listener);
+		for (auto &w : _workers) sockets.push_back(w.socket.get());
+
+		for (size_t i : Socket::waitReadable(sockets, 0.5)) {
+			if (i == 0) {
+				Worker w;
+				w.socket.reset(new Socket());
+				w.ready = false;
+				w.unit = -1;
+				if (listener.accept(*w.socket)) _workers.push_back(move(w));
+				continue;
+			}
+
+			Worker &w = _workers[i - 1];
+			uint32_t type;
+			if (!w.socket->receiveMessage(type, payload)) {
+				_drop(w);
+				continue;
+			}
+			if (type == HelloMessage) {
+				uint32_t version = payload.size() == sizeof(uint32_t) ? *(const uint32_t *)payload.data() : 0;
+				if (version != ProtocolVersion || !w.socket->sendMessage(JobMessage, &_job, sizeof(_job))) {
+					cout << "Warn: dropping worker with protocol version " << version << endl;
+					_drop(w);
+					continue;
+				}
+				w.ready = true;
+				cout << "Worker connected, " << count_if(_workers.begin(), _workers.end(),
+					[](const Worker &other) { return other.ready; }) << " active" << endl;
+			}
+			else if (type == ResultMessage && w.unit >= 0 && payload.size() >= sizeof(work_unit_t)) {
+				work_unit_t u;
+				memcpy(&u, payload.data(), sizeof(u));
+				Unit &unit = _units[w.unit];
+				bool valid = u.id == unit.unit.id
+					&& payload.size() == sizeof(u) + unitPixels(unit.unit) * 4 * sizeof(float);
+				if (!valid) {
+					cout << "Warn: dropping worker with a malformed result" << endl;
+					_drop(w);
+					continue;
+				}
+				if (unit.state != Done) {
+					_merge(unit.unit, (const float *)(payload.data() + sizeof(u)));
+					unit.state = Done;
+					double seconds = now() - unit.started;
+					_unitSeconds += seconds;
+					Stats::shared().record("dist.unit", seconds * 1000);
+					Stats::shared().count("units", 1);
+					_done++;
+				}
+				unit.copies--;
+				w.unit = -1;
+			}
+		}
+
+		// sockets that failed were closed by _drop
+		_workers.erase(remove_if(_workers.begin(), _workers.end(),
+			[](const Worker &w) { return !w.socket->isOpen(); }), _workers.end());
+
+		double t = now();
+		for (auto &w : _workers) {
+			if (w.ready && w.unit < 0) _assign(w, t);
+		}
+
+		if (_done * 10 / _units.size() != reported) {
+			reported = _done * 10 / _units.size();
+			cout << "Merged " << _done << "/" << _units.size() << " units" << endl;
+		}
+		Stats::shared().poll();
+	}
+
+	for (auto &w : _workers) w.socket->sendMessage(DoneMessage, nullptr, 0);
+	_workers.clear();
+	return true;
+}
+
+void RenderCoordinator::_assign(Worker &w, double now)
+{
+	int i = _nextUnit(now);
+	if (i < 0) return;
+	Unit &u = _units[i];
+	if (!w.socket->sendMessage(UnitMessage, &u.unit, sizeof(u.unit))) {
+		_drop(w);
+		return;
+	}
+	if (u.state == Running) _duplicated++;
+	else u.started = now;
+	u.state = Running;
+	u.copies++;
+	w.unit = i;
+}
+
+int RenderCoordinator::_nextUnit(double now)
+{
+	int straggler = -1;
+	for (size_t i = 0; i < _units.size(); i++) {
+		const Unit &u = _units[i];
+		if (u.state == Pending) return (int)i;
+		if (u.state == Running && u.copies == 1
+				&& (straggler < 0 || u.started < _units[straggler].started)) {
+			straggler = (int)i;
+		}
+	}
+
+	// nothing left to hand out: back up the oldest unit once it overruns
+	if (straggler < 0 || _done == 0) return -1;
+	double average = _unitSeconds / _done;
+	return now - _units[straggler].started > StragglerFactor * average ? straggler : -1;
+}
+
+void RenderCoordinator::_merge(const work_unit_t &u, const float *pixels)
+{
+	for (int y = u.y0; y < u.y1; y++) {
+		for (int x = u.x0; x < u.x1; x++, pixels += 4) {
+			float *acc = &_accum[((size_t)y * _job.width + x) * 4];
+			float n = pixels[3];
+			acc[0] += pixels[0] * n;
+			acc[1] += pixels[1] * n;
+			acc[2] += pixels[2] * n;
+			acc[3] += n;
+		}
+	}
+}
+
+void RenderCoordinator::_drop(Worker &w)
+{
+	if (w.unit >= 0) {
+		Unit &u = _units[w.unit];
+		if (--u.copies == 0 && u.state == Running) {
+			u.state = Pending;
+			_requeued++;
+		}
+		w.unit = -1;
+	}
+	if (w.socket->isOpen()) cout << "Worker disconnected" << endl;
+	w.socket->close();
+	w.ready = false;
+}
+
+bool RenderCoordinator::saveImage(const char *fileName) const
+{
+	vector<float> image(_accum.size());
+	for (size_t i = 0; i < image.size(); i += 4) {
+		float n = _accum[i + 3];
+		float scale = n > 0 ? 1.0f / n : 0.0f;
+		image[i + 0] = _accum[i + 0] * scale;
+		image[i + 1] = _accum[i + 1] * scale;
+		image[i + 2] = _accum[i + 2] * scale;
+		image[i + 3] = n > 0 ? 1.0f : 0.0f;
+	}
+	return writeImage(fileName, image.data(), _job.width, _job.height);
+}
+
+static bool connectWithRetry(Socket &socket, const char *address)
+{
+	for (int attempt = 0; attempt < 50; attempt++) {
+		if (socket.connect(address)) return true;
+		this_thread::sleep_for(chrono::milliseconds(200));
+	}
+	return false;
+}
+
+int runWorker(const char *address, unsigned int threads, bool useCache)
+{
+	Socket socket;
+	if (!connectWithRetry(socket, address)) {
+		cout << "Error: cannot connect to coordinator at " << address << endl;
+		return 4;
+	}
+	uint32_t version = RenderCoordinator::ProtocolVersion;
+	if (!socket.sendMessage(HelloMessage, &version, sizeof(version))) {
+		cout << "Error: lost connection to coordinator" << endl;
+		return 4;
+	}
+
+	SceneBuffers scene;
+	unique_ptr<CpuTracer> tracer;
+	string sceneName;
+	vector<char> payload, result;
+	size_t units = 0;
+	for (;;) {
+		uint32_t type;
+		if (!socket.receiveMessage(type, payload)) {
+			cout << "Error: lost connection to coordinator" << endl;
+			return 4;
+		}
+
+		if (type == DoneMessage) {
+			break;
+		}
+		else if (type == JobMessage && payload.size() == sizeof(render_job_t)) {
+			render_job_t job;
+			memcpy(&job, payload.data(), sizeof(job));
+			job.scene[sizeof(job.scene) - 1] = 0;
+			if (sceneName != job.scene) {
+				sceneName = job.scene;
+				if (!scene.open(job.scene, useCache)) {
+					return 1;
+				}
+			}
+			tracer.reset(new CpuTracer(job.width, job.height, threads));
+			tracer->camera().setFrustum(job.fovy, float(job.width) / float(job.height), 1., 30.);
+			tracer->camera().setCamera(Vector3f(job.eye), Vector3f(job.at), Vector3f(job.up));
+			tracer->camera().computeInvMatrix();
+			tracer->setAdaptive(job.adaptiveThreshold, job.minSamples);
+			tracer->setMaxDepth(job.maxDepth);
+			tracer->setSampler((SamplerType)job.sampler);
+			tracer->load(scene);
+			cout << "Worker (" << tracer->threadCount() << " threads, " << tracer->kernelName()
+				<< ") rendering " << job.scene << " at " << job.width << "x" << job.height << endl;
+		}
+		else if (type == UnitMessage && tracer && payload.size() == sizeof(work_unit_t)) {
+			work_unit_t u;
+			memcpy(&u, payload.data(), sizeof(u));
+			tracer->setFirstSample(u.firstSample);
+			tracer->setRegion(u.x0, u.y0, u.x1, u.y1);
+			while (tracer->frames() < u.samples && !tracer->converged()) {
+				tracer->renderFrame();
+			}
+
+			result.resize(sizeof(u) + unitPixels(u) * 4 * sizeof(float));
+			memcpy(result.data(), &u, sizeof(u));
+			float *pixels = (float *)(result.data() + sizeof(u));
+			const float *canvas = tracer->canvas();
+			for (int y = u.y0; y < u.y1; y++) {
+				for (int x = u.x0; x < u.x1; x++, pixels += 4) {
+					const float *pix = &canvas[((size_t)y * tracer->width() + x) * 4];
+					pixels[0] = pix[0];
+					pixels[1] = pix[1];
+					pixels[2] = pix[2];
+					pixels[3] = (float)tracer->pixelSamples(x, y);
+				}
+			}
+			if (!socket.sendMessage(ResultMessage, result.data(), result.size())) {
+				cout << "Error: lost connection to coordinator" << endl;
+				return 4;
+			}
+			units++;
+			Stats::shared().poll();
+		}
+		else {
+			cout << "Error: unexpected message " << type << " from coordinator" << endl;
+			return 4;
+		}
+	}
+	cout << "Worker finished after " << units << " units" << endl;
+	return 0;
+}
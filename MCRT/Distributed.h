@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Socket.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Distributed final-frame rendering. A coordinator splits the image into
+// square regions and the sample count into ranges, and hands these work
+// units to worker processes running CpuTracer, one unit per worker at a
+// time. Results are merged weighted by each pixel's sample count. Units of
+// lost workers go back into the queue, and once the queue is empty idle
+// workers duplicate units that run much longer than average; the first copy
+// to finish wins. Workers load the scene by path, so it has to resolve on
+// every node.
+//
+// Protocol, one Socket message each:
+//   worker -> coordinator  HelloMessage   uint32_t ProtocolVersion
+//   coordinator -> worker  JobMessage     render_job_t
+//   coordinator -> worker  UnitMessage    work_unit_t
+//   worker -> coordinator  ResultMessage  work_unit_t, then per pixel of the
+//                                         region mean RGB and sample count
+//   coordinator -> worker  DoneMessage    empty, the worker exits
+//
+// Payloads are the raw structs below in host byte order, see Socket. Their
+// layout is the wire format: changing it means bumping ProtocolVersion.
+
+enum MessageType : uint32_t {
+	HelloMessage = 1,
+	JobMessage,
+	UnitMessage,
+	ResultMessage,
+	DoneMessage
+};
+
+struct render_job_t {
+	int32_t width;
+	int32_t height;
+	int32_t maxDepth;
+	int32_t minSamples;
+	int32_t sampler;	// SamplerType
+	float adaptiveThreshold;
+	float fovy;
+	float eye[3];
+	float at[3];
+	float up[3];
+	char scene[256];
+};
+
+// pixels [x0, x1) x [y0, y1), samples [firstSample, firstSample + samples)
+struct work_unit_t {
+	uint32_t id;
+	int32_t x0, y0, x1, y1;
+	int32_t firstSample;
+	int32_t samples;
+};
+
+static_assert(sizeof(render_job_t) == 320, "render_job_t is sent as is, bump ProtocolVersion");
+static_assert(sizeof(work_unit_t) == 28, "work_unit_t is sent as is, bump ProtocolVersion");
+
+class RenderCoordinator
+{
+public:
+	// `unitSize` pixels square regions, `unitSamples` samples per unit
+	// (0 renders all samples of a region in one unit)
+	RenderCoordinator(const render_job_t &job, int samples, int unitSize = 128, int unitSamples = 0);
+
+	// Serves workers on `address` until every unit is merged.
+	bool run(const char *address);
+	bool saveImage(const char *fileName) const;
+
+	size_t unitCount() const { return _units.size(); }
+	size_t duplicatedUnits() const { return _duplicated; }
+	size_t requeuedUnits() const { return _requeued; }
+
+	static const uint32_t ProtocolVersion = 2;
+
+private:
+	enum UnitState { Pending, Running, Done };
+
+	struct Unit {
+		work_unit_t unit;
+		UnitState state;
+		int copies;
+		double started;
+	};
+
+	struct Worker {
+		std::unique_ptr<Socket> socket;
+		bool ready;
+		int unit;	// index into _units, -1 when idle
+	};
+
+	void _assign(Worker &w, double now);
+	int _nextUnit(double now);
+	void _merge(const work_unit_t &u, const float *pixels);
+	void _drop(Worker &w);
+
+private:
+	render_job_t _job;
+	std::vector<Unit> _units;
+	std::vector<Worker> _workers;
+	std::vector<float> _accum;	// weighted RGB sum and weight per pixel
+	size_t _done;
+	size_t _duplicated;
+	size_t _requeued;
+	double _unitSeconds;	// sum over completed units
+
+	static constexpr double StragglerFactor = 2.0;
+};
+
+// Connects to a coordinator (retrying for a while so workers can start
+// first) and renders units until told to stop. Exit codes as mcrt --batch,
+// plus 4 when the coordinator cannot be reached.
+int runWorker(const char *address, unsigned int threads, bool useCache);
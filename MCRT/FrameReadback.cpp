@@ -0,0 +1,114 @@
+#include "FrameReadback.h"
+#include "Stats.h"
+
+#include <GL/glew.h>
+
+using namespace std;
+
+FrameReadback::FrameReadback() : _format(ReadbackSrgb8), _next(0), _created(false)
+{
+	for (int i = 0; i < Depth; i++) {
+		_buffers[i] = 0;
+		_capacity[i] = 0;
+		_fences[i] = nullptr;
+		_frames[i] = ReadbackFrame();
+	}
+}
+
+FrameReadback::~FrameReadback()
+{
+	if (!_created) return;
+	for (int i = 0; i < Depth; i++) {
+		if (_fences[i]) glDeleteSync(_fences[i]);
+	}
+	glDeleteBuffers(Depth, _buffers);
+}
+
+void FrameReadback::setConsumer(ReadbackFormat format, const Consumer &consumer)
+{
+	_format = format;
+	_consumer = consumer;
+}
+
+size_t FrameReadback::bytesPerPixel(ReadbackFormat format)
+{
+	switch (format) {
+	case ReadbackFloat: return 16;
+	case ReadbackHalf: return 8;
+	default: return 4;
+	}
+}
+
+unsigned int FrameReadback::begin(int width, int height, int frame)
+{
+	if (!_consumer) return 0;
+	if (!_created) {
+		glGenBuffers(Depth, _buffers);
+		_created = true;
+	}
+	if (_fences[_next]) {
+		if (!_isSignalled(_next)) {
+			Stats::shared().count("readback.dropped", 1);
+			return 0;
+		}
+		_deliver(_next);
+	}
+
+	ReadbackFrame &f = _frames[_next];
+	f.width = width;
+	f.height = height;
+	f.frame = frame;
+	f.format = _format;
+	f.data = nullptr;
+	f.size = (size_t)width * height * bytesPerPixel(_format);
+
+	// GL_STREAM_READ asks for memory the CPU can map cheaply
+	GLuint buffer = _buffers[_next];
+	if (_capacity[_next] < f.size) {
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glBufferData(GL_COPY_READ_BUFFER, f.size, NULL, GL_STREAM_READ);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		_capacity[_next] = f.size;
+	}
+	return buffer;
+}
+
+void FrameReadback::end()
+{
+	_fences[_next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	_next = (_next + 1) % Depth;
+}
+
+void FrameReadback::collect()
+{
+	for (int i = 0; i < Depth; i++) {
+		int slot = (_next + i) % Depth;
+		if (!_fences[slot]) continue;
+		if (!_isSignalled(slot)) break;
+		_deliver(slot);
+	}
+}
+
+bool FrameReadback::_isSignalled(int slot)
+{
+	// a zero timeout only polls; the flush makes sure the fence is submitted
+	GLenum status = glClientWaitSync(_fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
+
+void FrameReadback::_deliver(int slot)
+{
+	glDeleteSync(_fences[slot]);
+	_fences[slot] = nullptr;
+
+	ReadbackFrame &f = _frames[slot];
+	glBindBuffer(GL_COPY_READ_BUFFER, _buffers[slot]);
+	f.data = glMapBufferRange(GL_COPY_READ_BUFFER, 0, f.size, GL_MAP_READ_BIT);
+	if (f.data) {
+		if (_consumer) _consumer(f);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+		Stats::shared().count("readback.frames", 1);
+	}
+	f.data = nullptr;
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
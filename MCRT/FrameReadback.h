@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+typedef struct __GLsync *GLsync;
+
+// Pixel layout of streamed frames; rows run top to bottom and alpha is 1.
+enum ReadbackFormat {
+	ReadbackFloat = 0,	// RGBA32F, linear
+	ReadbackHalf = 1,	// RGBA16F, linear
+	ReadbackSrgb8 = 2	// RGBA8, sRGB encoded
+};
+
+// One finished frame. `data` is mapped GPU memory and only valid during the
+// consumer call; `frame` is the number of samples accumulated in it.
+struct ReadbackFrame {
+	int width;
+	int height;
+	int frame;
+	ReadbackFormat format;
+	const void *data;
+	size_t size;
+};
+
+// Streams frames off the GPU without stalling it. The caller converts a
+// frame into the buffer returned by begin() (readback.comp) and closes it
+// with end(), which fences the copy. Buffers rotate through a ring of
+// `Depth`, and a buffer is only mapped once its fence has signalled, so the
+// next frame's dispatches queue up behind the copy instead of waiting for
+// it. When the consumer falls behind and every buffer is still in flight,
+// begin() drops the new frame ("readback.dropped") rather than block.
+class FrameReadback
+{
+public:
+	typedef std::function<void(const ReadbackFrame &)> Consumer;
+
+	FrameReadback();
+	~FrameReadback();
+
+	FrameReadback(const FrameReadback &) = delete;
+	FrameReadback &operator=(const FrameReadback &) = delete;
+
+	// An empty consumer turns streaming off.
+	void setConsumer(ReadbackFormat format, const Consumer &consumer);
+	bool enabled() const { return (bool)_consumer; }
+	ReadbackFormat format() const { return _format; }
+
+	// Buffer to write a width x height frame into, or 0 to skip the frame.
+	unsigned int begin(int width, int height, int frame);
+	void end();
+
+	// Hands every finished frame to the consumer, oldest first; called once
+	// per frame.
+	void collect();
+
+	static size_t bytesPerPixel(ReadbackFormat format);
+
+private:
+	bool _isSignalled(int slot);
+	void _deliver(int slot);
+
+private:
+	static const int Depth = 3;
+
+	ReadbackFormat _format;
+	Consumer _consumer;
+	unsigned int _buffers[Depth];
+	size_t _capacity[Depth];
+	GLsync _fences[Depth];
+	ReadbackFrame _frames[Depth];
+	int _next;
+	bool _created;
+};
@@ -0,0 +1,58 @@
+#include "GpuTimer.h"
+#include "Stats.h"
+
+#include <GL/glew.h>
+
+using namespace std;
+
+GpuTimer::GpuTimer(const char *stage) : _stage(stage), _next(0), _created(false)
+{
+	for (int i = 0; i < Latency; i++) {
+		_queries[i] = 0;
+		_pending[i] = false;
+	}
+}
+
+GpuTimer::~GpuTimer()
+{
+	if (_created) glDeleteQueries(Latency, _queries);
+}
+
+void GpuTimer::begin()
+{
+	if (!_created) {
+		glGenQueries(Latency, _queries);
+		_created = true;
+	}
+	// the ring is full when the GPU lags `Latency` frames behind; only then
+	// does reading the oldest result block
+	if (_pending[_next]) _record(_next);
+	glBeginQuery(GL_TIME_ELAPSED, _queries[_next]);
+}
+
+void GpuTimer::end()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	_pending[_next] = true;
+	_next = (_next + 1) % Latency;
+}
+
+void GpuTimer::collect()
+{
+	for (int i = 0; i < Latency; i++) {
+		int slot = (_next + i) % Latency;
+		if (!_pending[slot]) continue;
+		GLint available = 0;
+		glGetQueryObjectiv(_queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) break;
+		_record(slot);
+	}
+}
+
+void GpuTimer::_record(int slot)
+{
+	GLuint64 ns = 0;
+	glGetQueryObjectui64v(_queries[slot], GL_QUERY_RESULT, &ns);
+	_pending[slot] = false;
+	Stats::shared().record(_stage, ns / 1e6);
+}
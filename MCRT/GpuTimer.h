@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+
+// GL_TIME_ELAPSED queries around one GPU stage. Queries live in a small ring
+// and are read a few frames later, once the driver reports them available,
+// so timing never stalls the pipeline. Results go to Stats under `stage`.
+// Only one timer may be running at a time (GL does not nest these queries).
+class GpuTimer
+{
+public:
+	explicit GpuTimer(const char *stage);
+	~GpuTimer();
+
+	void begin();
+	void end();
+
+	// Records every finished query; called once per frame.
+	void collect();
+
+private:
+	void _record(int slot);
+
+private:
+	static const int Latency = 4;
+
+	std::string _stage;
+	unsigned int _queries[Latency];
+	bool _pending[Latency];
+	int _next;
+	bool _created;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// Fast non-cryptographic 64-bit hash used to fingerprint source files and
+// shader sources. Four independent lanes keep the multiplier pipeline busy
+// on large inputs.
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0)
+{
+	const uint64_t k1 = 0x87c37b91114253d5ULL;
+	const uint64_t k2 = 0x4cf5ad432745937fULL;
+	auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+	auto mix = [&](uint64_t h, uint64_t w) { return rotl(h ^ (w * k1), 31) * k2; };
+	auto fmix = [](uint64_t h) {
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	};
+
+	const unsigned char *p = (const unsigned char *)data;
+	uint64_t h[4] = { seed, seed ^ k1, seed ^ k2, seed ^ (k1 + k2) };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		uint64_t w[4];
+		memcpy(w, p + i, 32);
+		h[0] = mix(h[0], w[0]);
+		h[1] = mix(h[1], w[1]);
+		h[2] = mix(h[2], w[2]);
+		h[3] = mix(h[3], w[3]);
+	}
+	uint64_t r = h[0] ^ rotl(h[1], 17) ^ rotl(h[2], 29) ^ rotl(h[3], 43);
+	for (; i + 8 <= size; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+		r = mix(r, w);
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, p + i, size - i);
+	r = mix(r, tail ^ (uint64_t)size);
+	return fmix(r);
+}
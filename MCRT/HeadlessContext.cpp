@@ -0,0 +1,115 @@
+#include "HeadlessContext.h"
+
+#include <iostream>
+
+#ifdef _WIN32
+#include <GL/freeglut.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+using namespace std;
+
+HeadlessContext::HeadlessContext() : _display(nullptr), _context(nullptr), _window(0)
+{
+}
+
+HeadlessContext::~HeadlessContext()
+{
+	destroy();
+}
+
+#ifdef _WIN32
+
+bool HeadlessContext::create()
+{
+	int argc = 1;
+	char name[] = "mcrt";
+	char *argv[] = { name, nullptr };
+	glutInit(&argc, argv);
+	glutInitDisplayMode(GLUT_RGB);
+	glutInitWindowSize(1, 1);
+	glutInitContextVersion(4, 3);
+	glutInitContextFlags(GLUT_CORE_PROFILE);
+	_window = glutCreateWindow("MCRT");
+	if (_window <= 0) {
+		cout << "Error: unable to create a hidden window" << endl;
+		_window = 0;
+		return false;
+	}
+	glutHideWindow();
+	return true;
+}
+
+void HeadlessContext::destroy()
+{
+	if (_window) glutDestroyWindow(_window);
+	_window = 0;
+}
+
+#else
+
+bool HeadlessContext::create()
+{
+	// the surfaceless platform needs no display server; plain EGL displays
+	// work as well when they support surfaceless contexts
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay) {
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (display == EGL_NO_DISPLAY) {
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+	EGLint major, minor;
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+		cout << "Error: unable to initialize EGL" << endl;
+		return false;
+	}
+	_display = display;
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		cout << "Error: EGL does not support desktop OpenGL" << endl;
+		destroy();
+		return false;
+	}
+
+	const EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_SURFACE_TYPE, 0, EGL_NONE };
+	EGLConfig config = EGL_NO_CONFIG_KHR;
+	EGLint configs = 0;
+	eglChooseConfig(display, configAttributes, &config, 1, &configs);
+	if (configs == 0) config = EGL_NO_CONFIG_KHR;
+
+	const EGLint contextAttributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+	if (context == EGL_NO_CONTEXT) {
+		cout << "Error: unable to create an OpenGL 4.3 context, EGL error " << hex << eglGetError() << dec << endl;
+		destroy();
+		return false;
+	}
+	_context = context;
+	if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		cout << "Error: unable to make a surfaceless context current" << endl;
+		destroy();
+		return false;
+	}
+	return true;
+}
+
+void HeadlessContext::destroy()
+{
+	if (!_display) return;
+	eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (_context) eglDestroyContext(_display, _context);
+	eglTerminate(_display);
+	_display = nullptr;
+	_context = nullptr;
+}
+
+#endif
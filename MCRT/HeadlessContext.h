@@ -0,0 +1,24 @@
+#pragma once
+
+// A current OpenGL 4.3 core context with no window to draw to, for running
+// the compute pipeline in containers and CI. On Linux and other EGL systems
+// it is an EGL surfaceless context; Mesa's llvmpipe provides one without
+// any GPU (LIBGL_ALWAYS_SOFTWARE=1). Windows has no surfaceless EGL, so
+// there it is a hidden GLUT window.
+class HeadlessContext
+{
+public:
+	HeadlessContext();
+	~HeadlessContext();
+
+	HeadlessContext(const HeadlessContext &) = delete;
+	HeadlessContext &operator=(const HeadlessContext &) = delete;
+
+	bool create();
+	void destroy();
+
+private:
+	void *_display;
+	void *_context;
+	int _window;
+};
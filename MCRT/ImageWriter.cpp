@@ -0,0 +1,287 @@
+#include "ImageWriter.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+static const char *getExtension(const char *fileName)
+{
+	const char *dot = strrchr(fileName, '.');
+	return dot ? dot + 1 : "";
+}
+
+static bool extensionIs(const char *fileName, const char *ext)
+{
+	const char *e = getExtension(fileName);
+	while (*e && *ext) {
+		if (tolower(*e++) != *ext++) return false;
+	}
+	return *e == 0 && *ext == 0;
+}
+
+bool writeImage(const char *fileName, const float *rgba, int width, int height)
+{
+	if (extensionIs(fileName, "png")) {
+		return writePNG(fileName, rgba, width, height);
+	}
+	else if (extensionIs(fileName, "exr")) {
+		return writeEXR(fileName, rgba, width, height);
+	}
+	else if (extensionIs(fileName, "pfm")) {
+		return writePFM(fileName, rgba, width, height);
+	}
+	else if (extensionIs(fileName, "ppm")) {
+		return writePPM(fileName, rgba, width, height);
+	}
+	cout << "Error: unsupported image format: " << fileName << endl;
+	return false;
+}
+
+static unsigned char toByte(float c)
+{
+	return (unsigned char)(min(max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+static unsigned int crc32(unsigned int crc, const unsigned char *data, size_t size)
+{
+	static unsigned int table[256];
+	static bool ready = false;
+	if (!ready) {
+		for (unsigned int n = 0; n < 256; n++) {
+			unsigned int c = n;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+		ready = true;
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void putBE32(vector<unsigned char> &out, unsigned int v)
+{
+	out.push_back((unsigned char)(v >> 24));
+	out.push_back((unsigned char)(v >> 16));
+	out.push_back((unsigned char)(v >> 8));
+	out.push_back((unsigned char)v);
+}
+
+static void writeChunk(FILE *fp, const char *type, const vector<unsigned char> &data)
+{
+	vector<unsigned char> chunk;
+	chunk.reserve(data.size() + 12);
+	putBE32(chunk, (unsigned int)data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	putBE32(chunk, crc32(0, &chunk[4], chunk.size() - 4));
+	fwrite(chunk.data(), 1, chunk.size(), fp);
+}
+
+bool writePNG(const char *fileName, const float *rgba, int width, int height)
+{
+	FILE *fp = fopen(fileName, "wb");
+	if (fp == NULL) {
+		cout << "Error: cannot open image for writing: " << fileName << endl;
+		return false;
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	fwrite(signature, 1, sizeof(signature), fp);
+
+	vector<unsigned char> header;
+	putBE32(header, width);
+	putBE32(header, height);
+	header.push_back(8);	// bit depth
+	header.push_back(2);	// RGB
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	writeChunk(fp, "IHDR", header);
+
+	// filter-less scanlines, top to bottom
+	size_t stride = (size_t)width * 3 + 1;
+	vector<unsigned char> raw(stride * height);
+	for (int y = 0; y < height; y++) {
+		const float *src = rgba + (size_t)(height - 1 - y) * width * 4;
+		unsigned char *dst = &raw[y * stride];
+		*dst++ = 0;
+		for (int x = 0; x < width; x++) {
+			*dst++ = toByte(src[x * 4 + 0]);
+			*dst++ = toByte(src[x * 4 + 1]);
+			*dst++ = toByte(src[x * 4 + 2]);
+		}
+	}
+
+	// zlib stream of stored (uncompressed) deflate blocks, so no zlib needed
+	vector<unsigned char> z;
+	z.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	z.push_back(0x78);
+	z.push_back(0x01);
+	size_t pos = 0;
+	do {
+		size_t len = min(raw.size() - pos, (size_t)65535);
+		z.push_back(pos + len == raw.size() ? 1 : 0);
+		z.push_back((unsigned char)len);
+		z.push_back((unsigned char)(len >> 8));
+		z.push_back((unsigned char)~len);
+		z.push_back((unsigned char)(~len >> 8));
+		z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + len);
+		pos += len;
+	} while (pos < raw.size());
+
+	unsigned int a = 1, b = 0;
+	for (size_t i = 0; i < raw.size(); i++) {
+		a = (a + raw[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	putBE32(z, (b << 16) | a);
+	writeChunk(fp, "IDAT", z);
+	writeChunk(fp, "IEND", vector<unsigned char>());
+
+	bool ok = ferror(fp) == 0;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok) cout << "Error: failed to write image: " << fileName << endl;
+	return ok;
+}
+
+template <typename T>
+static void putLE(vector<unsigned char> &out, T v)
+{
+	const unsigned char *p = (const unsigned char *)&v;
+	out.insert(out.end(), p, p + sizeof(T));
+}
+
+static void putAttribute(vector<unsigned char> &out, const char *name, const char *type, const vector<unsigned char> &value)
+{
+	out.insert(out.end(), name, name + strlen(name) + 1);
+	out.insert(out.end(), type, type + strlen(type) + 1);
+	putLE<int>(out, (int)value.size());
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+bool writeEXR(const char *fileName, const float *rgba, int width, int height)
+{
+	FILE *fp = fopen(fileName, "wb");
+	if (fp == NULL) {
+		cout << "Error: cannot open image for writing: " << fileName << endl;
+		return false;
+	}
+
+	// single-part scanline file, uncompressed 32-bit float B, G, R channels
+	vector<unsigned char> header, value;
+	putLE<int>(header, 20000630);
+	putLE<int>(header, 2);
+
+	for (const char *channel : { "B", "G", "R" }) {
+		value.insert(value.end(), channel, channel + 2);
+		putLE<int>(value, 2);		// FLOAT
+		putLE<int>(value, 0);		// pLinear + reserved
+		putLE<int>(value, 1);		// xSampling
+		putLE<int>(value, 1);		// ySampling
+	}
+	value.push_back(0);
+	putAttribute(header, "channels", "chlist", value);
+
+	value.assign(1, 0);
+	putAttribute(header, "compression", "compression", value);
+
+	value.clear();
+	putLE<int>(value, 0);
+	putLE<int>(value, 0);
+	putLE<int>(value, width - 1);
+	putLE<int>(value, height - 1);
+	putAttribute(header, "dataWindow", "box2i", value);
+	putAttribute(header, "displayWindow", "box2i", value);
+
+	value.assign(1, 0);
+	putAttribute(header, "lineOrder", "lineOrder", value);
+
+	value.clear();
+	putLE<float>(value, 1.0f);
+	putAttribute(header, "pixelAspectRatio", "float", value);
+	putAttribute(header, "screenWindowWidth", "float", value);
+
+	value.clear();
+	putLE<float>(value, 0.0f);
+	putLE<float>(value, 0.0f);
+	putAttribute(header, "screenWindowCenter", "v2f", value);
+	header.push_back(0);
+
+	size_t lineSize = (size_t)width * 3 * sizeof(float) + 8;
+	unsigned long long offset = header.size() + (size_t)height * 8;
+	for (int y = 0; y < height; y++, offset += lineSize) {
+		putLE<unsigned long long>(header, offset);
+	}
+	fwrite(header.data(), 1, header.size(), fp);
+
+	vector<unsigned char> line;
+	line.reserve(lineSize);
+	for (int y = 0; y < height; y++) {
+		const float *src = rgba + (size_t)(height - 1 - y) * width * 4;
+		line.clear();
+		putLE<int>(line, y);
+		putLE<int>(line, (int)(lineSize - 8));
+		for (int c = 2; c >= 0; c--) {
+			for (int x = 0; x < width; x++) putLE<float>(line, src[x * 4 + c]);
+		}
+		fwrite(line.data(), 1, line.size(), fp);
+	}
+
+	bool ok = ferror(fp) == 0;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok) cout << "Error: failed to write image: " << fileName << endl;
+	return ok;
+}
+
+bool writePFM(const char *fileName, const float *rgba, int width, int height)
+{
+	FILE *fp = fopen(fileName, "wb");
+	if (fp == NULL) {
+		cout << "Error: cannot open image for writing: " << fileName << endl;
+		return false;
+	}
+
+	// negative scale marks little-endian data, rows are stored bottom to top
+	fprintf(fp, "PF\n%d %d\n-1.0\n", width, height);
+	vector<float> row(width * 3);
+	for (int y = 0; y < height; y++) {
+		const float *src = rgba + (size_t)y * width * 4;
+		for (int x = 0; x < width; x++) {
+			row[x * 3 + 0] = src[x * 4 + 0];
+			row[x * 3 + 1] = src[x * 4 + 1];
+			row[x * 3 + 2] = src[x * 4 + 2];
+		}
+		fwrite(row.data(), sizeof(float), row.size(), fp);
+	}
+	bool ok = ferror(fp) == 0;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok) cout << "Error: failed to write image: " << fileName << endl;
+	return ok;
+}
+
+bool writePPM(const char *fileName, const float *rgba, int width, int height)
+{
+	FILE *fp = fopen(fileName, "wb");
+	if (fp == NULL) {
+		cout << "Error: cannot open image for writing: " << fileName << endl;
+		return false;
+	}
+
+	fprintf(fp, "P6\n%d %d\n255\n", width, height);
+	vector<unsigned char> row(width * 3);
+	for (int y = height - 1; y >= 0; y--) {
+		const float *src = rgba + (size_t)y * width * 4;
+		for (int x = 0; x < width * 3; x++) {
+			row[x] = toByte(src[x / 3 * 4 + x % 3]);
+		}
+		fwrite(row.data(), 1, row.size(), fp);
+	}
+	bool ok = ferror(fp) == 0;
+	ok = fclose(fp) == 0 && ok;
+	if (!ok) cout << "Error: failed to write image: " << fileName << endl;
+	return ok;
+}
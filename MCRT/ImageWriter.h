@@ -0,0 +1,13 @@
+#pragma once
+
+#include <vector>
+
+// Writes an RGBA float framebuffer (rows bottom to top, like the GL canvas)
+// to disk. The format is picked from the file extension: .png, .exr, .pfm or
+// .ppm. PNG and PPM store clamped 8-bit values, EXR and PFM keep the floats.
+bool writeImage(const char *fileName, const float *rgba, int width, int height);
+
+bool writePNG(const char *fileName, const float *rgba, int width, int height);
+bool writeEXR(const char *fileName, const float *rgba, int width, int height);
+bool writePFM(const char *fileName, const float *rgba, int width, int height);
+bool writePPM(const char *fileName, const float *rgba, int width, int height);
@@ -0,0 +1,171 @@
+#include "MappedFile.h"
+
+#include <cstdint>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// mapping an empty file fails, so empty files point here instead
+static char EmptyFile[1] = { 0 };
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : _data(nullptr), _size(0), _writable(false), _file(INVALID_HANDLE_VALUE), _mapping(NULL) {}
+
+bool MappedFile::open(const char *fileName)
+{
+	close();
+	_file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (_file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(_file, &size)) {
+		close();
+		return false;
+	}
+	_size = (size_t)size.QuadPart;
+	if (_size == 0) {
+		_data = EmptyFile;
+		return true;
+	}
+
+	_mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (_mapping == NULL) {
+		close();
+		return false;
+	}
+	_data = (char *)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (_data == nullptr) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool MappedFile::create(const char *fileName, size_t size)
+{
+	close();
+	_file = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (_file == INVALID_HANDLE_VALUE) return false;
+
+	_size = size;
+	_writable = true;
+	if (_size == 0) {
+		_data = EmptyFile;
+		return true;
+	}
+
+	_mapping = CreateFileMappingA(_file, NULL, PAGE_READWRITE,
+		(DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+	if (_mapping == NULL) {
+		close();
+		return false;
+	}
+	_data = (char *)MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, 0);
+	if (_data == nullptr) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (_data && _data != EmptyFile) UnmapViewOfFile(_data);
+	if (_mapping != NULL) CloseHandle(_mapping);
+	if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+	_data = nullptr;
+	_size = 0;
+	_writable = false;
+	_mapping = NULL;
+	_file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+MappedFile::MappedFile() : _data(nullptr), _size(0), _writable(false), _fd(-1) {}
+
+bool MappedFile::open(const char *fileName)
+{
+	close();
+	_fd = ::open(fileName, O_RDONLY);
+	if (_fd < 0) return false;
+
+	struct stat st;
+	if (fstat(_fd, &st) != 0) {
+		close();
+		return false;
+	}
+	_size = (size_t)st.st_size;
+	if (_size == 0) {
+		_data = EmptyFile;
+		return true;
+	}
+
+	void *p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+	if (p == MAP_FAILED) {
+		close();
+		return false;
+	}
+	madvise(p, _size, MADV_SEQUENTIAL);
+	_data = (char *)p;
+	return true;
+}
+
+bool MappedFile::create(const char *fileName, size_t size)
+{
+	close();
+	_fd = ::open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (_fd < 0) return false;
+	if (ftruncate(_fd, (off_t)size) != 0) {
+		close();
+		return false;
+	}
+
+	_size = size;
+	_writable = true;
+	if (_size == 0) {
+		_data = EmptyFile;
+		return true;
+	}
+
+	void *p = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (p == MAP_FAILED) {
+		close();
+		return false;
+	}
+	_data = (char *)p;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (_data && _data != EmptyFile) munmap(_data, _size);
+	if (_fd >= 0) ::close(_fd);
+	_data = nullptr;
+	_size = 0;
+	_writable = false;
+	_fd = -1;
+}
+
+#endif
+
+MappedFile::MappedFile(const char *fileName) : MappedFile()
+{
+	open(fileName);
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
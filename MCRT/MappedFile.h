@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+
+// Memory mapping of a whole file: read-only for open(), read-write for
+// create(), which sizes a new file up front so it can be filled in place.
+class MappedFile
+{
+public:
+	MappedFile();
+	MappedFile(const char *fileName);
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	bool open(const char *fileName);
+	bool create(const char *fileName, size_t size);
+	void close();
+
+	bool isOpen() const { return _data != nullptr; }
+	const char *data() const { return _data; }
+	char *writableData() const { return _writable ? _data : nullptr; }
+	size_t size() const { return _size; }
+
+private:
+	char *_data;
+	size_t _size;
+	bool _writable;
+#ifdef _WIN32
+	void *_file;
+	void *_mapping;
+#else
+	int _fd;
+#endif
+};
@@ -92,3 +92,15 @@ Material * MaterialLibrary::getMaterialByName(const char * mtlName)
 	auto it = _index.find(mtlName);
 	return it == _index.end() ? nullptr : it->second;
 }
+
+Material *MaterialLibrary::addMaterial(const Material &m)
+{
+	auto it = _index.find(m.name);
+	if (it != _index.end()) {
+		return it->second;
+	}
+	Material *copy = new Material(m);
+	_mats.push_back(copy);
+	_index[copy->name] = copy;
+	return copy;
+}
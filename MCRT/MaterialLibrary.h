@@ -35,4 +35,6 @@ public:
 	void clear();
 	bool readFromMtlFile(const char *mtlFileName);
 	Material *getMaterialByName(const char *mtlName);
+	// the material called m.name, copied from `m` unless there is one already
+	Material *addMaterial(const Material &m);
 };
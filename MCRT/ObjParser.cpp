@@ -0,0 +1,226 @@
+#include "ObjParser.h"
+
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+using namespace std;
+using namespace Eigen;
+
+static const double Pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline const char *skipSpaces(const char *p, const char *end)
+{
+	while (p < end && isSpace(*p)) p++;
+	return p;
+}
+
+static inline const char *skipToken(const char *p, const char *end)
+{
+	while (p < end && !isSpace(*p)) p++;
+	return p;
+}
+
+static inline bool tokenIs(const char *p, const char *end, const char *s)
+{
+	size_t n = strlen(s);
+	return (size_t)(end - p) == n && memcmp(p, s, n) == 0;
+}
+
+static const char *parseInt(const char *p, const char *end, int &out)
+{
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+	int v = 0;
+	while (p < end && isDigit(*p)) v = v * 10 + (*p++ - '0');
+	out = neg ? -v : v;
+	return p;
+}
+
+static const char *parseFloat(const char *p, const char *end, float &out)
+{
+	bool neg = false;
+	if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0;
+	while (p < end && isDigit(*p)) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa) digits++;
+		}
+		else {
+			exponent++;
+		}
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isDigit(*p)) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa) digits++;
+				exponent--;
+			}
+			p++;
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int e;
+		p = parseInt(p + 1, end, e);
+		exponent += e;
+	}
+
+	double v = (double)mantissa;
+	if (exponent < 0) {
+		v = -exponent <= 22 ? v / Pow10[-exponent] : v * pow(10.0, exponent);
+	}
+	else if (exponent > 0) {
+		v = exponent <= 22 ? v * Pow10[exponent] : v * pow(10.0, exponent);
+	}
+	out = (float)(neg ? -v : v);
+	return p;
+}
+
+// converts a 1-based (or negative, relative) obj index to 0-based
+static inline int convertIndex(int index, size_t localCount, bool &relative)
+{
+	relative = index < 0;
+	if (index < 0) return (int)localCount + index;
+	return index - 1;
+}
+
+vector<pair<const char *, const char *>> splitObjChunks(
+	const char *data, size_t size, size_t count)
+{
+	vector<pair<const char *, const char *>> chunks;
+	const char *end = data + size;
+	const char *p = data;
+	if (count == 0) count = 1;
+
+	for (size_t i = 1; i <= count && p < end; i++) {
+		const char *q = i == count ? end : data + size * i / count;
+		if (q < p) q = p;
+		if (q < end) {
+			const char *eol = (const char *)memchr(q, '\n', end - q);
+			q = eol ? eol + 1 : end;
+		}
+		chunks.push_back(make_pair(p, q));
+		p = q;
+	}
+	return chunks;
+}
+
+void parseObjChunk(const char *begin, const char *end, ObjChunk &chunk)
+{
+	struct Corner {
+		int v, vt, vn;
+		unsigned short relative;
+	};
+
+	const char *p = begin;
+	float x, y, z;
+	vector<Corner> corners;
+
+	while (p < end) {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		const char *op = skipSpaces(p, eol);
+		const char *opEnd = skipToken(op, eol);
+		const char *args = skipSpaces(opEnd, eol);
+		p = eol + 1;
+
+		if (op == opEnd || *op == '#') continue;
+
+		if (tokenIs(op, opEnd, "v")) {
+			args = skipSpaces(parseFloat(args, eol, x), eol);
+			args = skipSpaces(parseFloat(args, eol, y), eol);
+			parseFloat(args, eol, z);
+			chunk.vertices.emplace_back(x, y, z);
+		}
+		else if (tokenIs(op, opEnd, "vn")) {
+			args = skipSpaces(parseFloat(args, eol, x), eol);
+			args = skipSpaces(parseFloat(args, eol, y), eol);
+			parseFloat(args, eol, z);
+			chunk.normals.emplace_back(x, y, z);
+		}
+		else if (tokenIs(op, opEnd, "vt")) {
+			args = skipSpaces(parseFloat(args, eol, x), eol);
+			parseFloat(args, eol, y);
+			chunk.textureCoords.emplace_back(x, y);
+		}
+		else if (tokenIs(op, opEnd, "f")) {
+			corners.clear();
+			while (args < eol) {
+				int v, vt = 0, vn = 0;
+				Corner k;
+				args = parseInt(args, eol, v);
+				if (args < eol && *args == '/') {
+					args++;
+					if (args < eol && *args != '/') args = parseInt(args, eol, vt);
+					if (args < eol && *args == '/') args = parseInt(args + 1, eol, vn);
+				}
+				args = skipSpaces(skipToken(args, eol), eol);
+
+				bool rv, rvt = false, rvn = false;
+				k.v = convertIndex(v, chunk.vertices.size(), rv);
+				k.vt = vt ? convertIndex(vt, chunk.textureCoords.size(), rvt) : -1;
+				k.vn = vn ? convertIndex(vn, chunk.normals.size(), rvn) : -1;
+				k.relative = (rv ? 1 : 0) | (rvt ? 8 : 0) | (rvn ? 64 : 0);
+				corners.push_back(k);
+			}
+			if (corners.size() < 3) {
+				chunk.warnings.push_back("invalid face description");
+				continue;
+			}
+
+			// fan-triangulate, relative bits are v << slot, vt << 3 + slot, vn << 6 + slot
+			for (size_t i = 1; i + 1 < corners.size(); i++) {
+				const Corner *k[3] = { &corners[0], &corners[i], &corners[i + 1] };
+				ObjFace f;
+				f.relative = 0;
+				for (int slot = 0; slot < 3; slot++) {
+					f.v[slot] = k[slot]->v;
+					f.vt[slot] = k[slot]->vt;
+					f.vn[slot] = k[slot]->vn;
+					f.relative |= k[slot]->relative << slot;
+				}
+				chunk.faces.push_back(f);
+			}
+		}
+		else if (tokenIs(op, opEnd, "g")) {
+			const char *nameEnd = skipToken(args, eol);
+			chunk.commands.push_back({ ObjCommand::Group, chunk.faces.size(),
+				args == nameEnd ? string("default") : string(args, nameEnd) });
+		}
+		else if (tokenIs(op, opEnd, "s")) {
+			chunk.commands.push_back({ ObjCommand::Smooth, chunk.faces.size(),
+				string(args, skipToken(args, eol)) });
+		}
+		else if (tokenIs(op, opEnd, "usemtl")) {
+			chunk.commands.push_back({ ObjCommand::UseMtl, chunk.faces.size(),
+				string(args, skipToken(args, eol)) });
+		}
+		else if (tokenIs(op, opEnd, "mtllib")) {
+			chunk.commands.push_back({ ObjCommand::MtlLib, chunk.faces.size(),
+				string(args, skipToken(args, eol)) });
+		}
+		else {
+			chunk.warnings.push_back("unrecognized obj file operator: " + string(op, opEnd));
+		}
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Types.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+
+// Triangle with 0-based indices, -1 when a component is absent. Bits in
+// `relative` (v << slot, vt << 3 + slot, vn << 6 + slot) mark indices that
+// were given as negative numbers and were resolved against the chunk only,
+// so they still need the counts of all preceding chunks added.
+struct ObjFace
+{
+	int v[3];
+	int vt[3];
+	int vn[3];
+	unsigned short relative;
+};
+
+// State changes are recorded with the index of the first face they apply to,
+// so chunks parsed out of order can be replayed in file order.
+struct ObjCommand
+{
+	enum Type { Group, UseMtl, MtlLib, Smooth };
+
+	Type type;
+	size_t face;
+	std::string arg;
+};
+
+struct ObjChunk
+{
+	std::vector<Eigen::Vector3f> vertices;
+	std::vector<Eigen::Vector2f> textureCoords;
+	std::vector<Eigen::Vector3f> normals;
+	std::vector<ObjFace> faces;
+	std::vector<ObjCommand> commands;
+	std::vector<std::string> warnings;
+};
+
+// Splits [data, data + size) into at most `count` pieces ending at line
+// boundaries.
+std::vector<std::pair<const char *, const char *>> splitObjChunks(
+	const char *data, size_t size, size_t count);
+
+// Parses one piece of an obj file in place, without per-token allocation.
+void parseObjChunk(const char *begin, const char *end, ObjChunk &chunk);
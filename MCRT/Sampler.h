@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+
+// Per-pixel sample generation, mirrored line by line in sampler.glsl so the
+// CPU and GPU backends draw the same numbers. Samples are addressed by
+// (pixel, sample index, dimension); every dimension is a 2D pair.
+//
+// SobolSampler: the first two Sobol dimensions, Owen scrambled with a
+// per-pixel, per-dimension seed, and with the sample index shuffled
+// per dimension as well so that the pairs do not correlate with each other
+// (Burley, "Practical Hash-based Owen Scrambling", 2020). Each pixel keeps
+// its own well-stratified sequence.
+// RandomSampler: independent PCG output hashed from the same coordinates,
+// kept for comparison and for anything that needs plain white noise.
+enum SamplerType {
+	SobolSampler = 0,
+	RandomSampler = 1
+};
+
+// Dimension 0 jitters the pixel. The vertex at `depth` samples its next
+// direction from 1 + 3 depth and a point on a light from 2 + 3 depth;
+// 3 + 3 depth picks the light (first) and decides Russian roulette (second).
+inline uint32_t bounceDimension(int depth) { return 1 + 3 * (uint32_t)depth; }
+inline uint32_t lightDimension(int depth) { return 2 + 3 * (uint32_t)depth; }
+inline uint32_t choiceDimension(int depth) { return 3 + 3 * (uint32_t)depth; }
+
+// PCG RXS-M-XS, one step from `v`
+inline uint32_t pcgHash(uint32_t v)
+{
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+inline uint32_t pixelSeed(int x, int y, int width)
+{
+	return pcgHash((uint32_t)(y * width + x));
+}
+
+inline uint32_t reverseBits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+inline uint32_t owenScramble(uint32_t x, uint32_t seed)
+{
+	// Laine-Karras permutation on the reversed bits
+	x = reverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits(x);
+}
+
+// second Sobol dimension, direction numbers v_k = v_{k-1} ^ (v_{k-1} >> 1)
+inline uint32_t sobol1(uint32_t index)
+{
+	uint32_t result = 0;
+	for (uint32_t v = 0x80000000u; index != 0; index >>= 1, v ^= v >> 1) {
+		if (index & 1u) result ^= v;
+	}
+	return result;
+}
+
+inline float toUnitFloat(uint32_t x)
+{
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+inline void sample2D(int type, uint32_t pixel, uint32_t index, uint32_t dimension, float &u, float &v)
+{
+	uint32_t seed = pcgHash(pixel ^ pcgHash(dimension));
+	if (type == RandomSampler) {
+		uint32_t state = pcgHash(seed ^ pcgHash(index));
+		u = toUnitFloat(state);
+		v = toUnitFloat(pcgHash(state));
+		return;
+	}
+	uint32_t i = owenScramble(index, seed);
+	u = toUnitFloat(owenScramble(reverseBits(i), pcgHash(seed + 1u)));
+	v = toUnitFloat(owenScramble(sobol1(i), pcgHash(seed + 2u)));
+}
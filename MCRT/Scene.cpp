@@ -1,270 +1,761 @@
 #include "Scene.h"
+#include "MappedFile.h"
+#include "ObjParser.h"
+#include "TaskScheduler.h"
+#include "Stats.h"
 
 #include <iostream>
-#include <fstream>
 #include <string>
+#include <algorithm>
+#include <map>
+#include <cstring>
+#include <cmath>
+#include <functional>
+#include <unordered_map>
+#include <fstream>
 #include <sstream>
-#include <iterator>
-#include <algorithm> 
-#include <functional> 
-#include <cctype>
-#include <locale>
+#include <memory>
 
 using namespace std;
 using namespace Eigen;
 
-template<typename Out>
-inline void split(const string &s, char delim, Out result, bool skipEmpty)
+Scene::Scene(const char * objFileName) : _hasSmoothingGroups(false)
 {
-	stringstream ss;
-	ss.str(s);
-	string item;
-	while (getline(ss, item, delim)) {
-		if (!skipEmpty || item.length() != 0) {
-			*(result++) = item;
-		}
+	if (!readFromObjFile(objFileName)) {
+		clear();
 	}
 }
 
-inline vector<string> split(const string &s, char delim, bool skipEmpty = true)
+void Scene::clear()
 {
-	vector<string> elems;
-	split(s, delim, back_inserter(elems), skipEmpty);
-	return elems;
+	vector<SceneGroup>().swap(_groups);
+	vector<Vector3f>().swap(_vertices);
+	vector<Vector2f>().swap(_textureCoords);
+	vector<Vector3f>().swap(_normals);
+	vector<TriangleFace>().swap(_faces);
+	vector<SceneMesh>().swap(_meshes);
+	SceneInstanceList().swap(_instances);
+
+	_matLib.clear();
+	_sourceFiles.clear();
+	_hasSmoothingGroups = false;
 }
 
-inline std::string &ltrim(std::string &s) {
-	s.erase(s.begin(), std::find_if(s.begin(), s.end(),
-		std::not1(std::ptr_fun<int, int>(std::isspace))));
-	return s;
+// The directory part of `path` including its separator, empty for a bare name.
+static string directoryOf(const string &path)
+{
+	size_t slash = path.find_last_of("/\\");
+	return slash == string::npos ? string() : path.substr(0, slash + 1);
 }
 
-inline vector<vector<string>> processFaceArgs(string &faceArgs)
+// `name` as written in a file from `dir`; absolute paths stay as they are.
+static string resolvePath(const string &dir, const string &name)
 {
-	vector<string> vertices = split(faceArgs, ' ');
-	vector<vector<string>> result;
-	
-	for (auto &v : vertices) {
-		result.push_back(split(v, '/', false));
-	}
-	return result;
+	bool absolute = !name.empty() && (name[0] == '/' || name[0] == '\\'
+		|| (name.size() > 1 && name[1] == ':'));
+	return absolute ? name : dir + name;
 }
 
-inline int convertStringToIndex(const string &s)
+bool Scene::readFromObjFile(const char * objFileName, bool parallel)
 {
-	if (s.length() == 0) return -1;
-	return atoi(s.c_str()) - 1;
+	ScopedTimer timer("scene.parse");
+	MappedFile file(objFileName);
+	if (!file.isOpen()) {
+		cout << "Error: unable to open obj file: "
+			<< objFileName << endl;
+		return false;
+	}
+	_sourceFiles.push_back(objFileName);
+
+	// parse line-aligned pieces independently, then replay them in order
+	TaskScheduler &scheduler = TaskScheduler::shared();
+	size_t chunkCount = parallel ? scheduler.threadCount() * 4 : 1;
+	auto ranges = splitObjChunks(file.data(), file.size(), chunkCount);
+	vector<ObjChunk> chunks(ranges.size());
+	if (chunks.size() > 1) {
+		scheduler.parallelFor(chunks.size(), [&](size_t i) {
+			parseObjChunk(ranges[i].first, ranges[i].second, chunks[i]);
+		});
+	}
+	else if (chunks.size() == 1) {
+		parseObjChunk(ranges[0].first, ranges[0].second, chunks[0]);
+	}
+
+	size_t vertexCount = _vertices.size(), textureCoordCount = _textureCoords.size();
+	size_t normalCount = _normals.size(), faceCount = _faces.size();
+	for (auto &chunk : chunks) {
+		vertexCount += chunk.vertices.size();
+		textureCoordCount += chunk.textureCoords.size();
+		normalCount += chunk.normals.size();
+		faceCount += chunk.faces.size();
+	}
+	_vertices.reserve(vertexCount);
+	_textureCoords.reserve(textureCoordCount);
+	_normals.reserve(normalCount);
+	_faces.reserve(faceCount);
+
+	_groups.emplace_back();
+	_groups.back().name = "default";
+	_groups.back().first = _faces.size();
+
+	unsigned int smoothGroup = 0;
+	Material *mat = nullptr;
+
+	for (auto &chunk : chunks) {
+		int vbase = (int)_vertices.size();
+		int vtbase = (int)_textureCoords.size();
+		int vnbase = (int)_normals.size();
+		_vertices.insert(_vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+		_textureCoords.insert(_textureCoords.end(), chunk.textureCoords.begin(), chunk.textureCoords.end());
+		_normals.insert(_normals.end(), chunk.normals.begin(), chunk.normals.end());
+
+		size_t cmd = 0;
+		for (size_t i = 0; i <= chunk.faces.size(); i++) {
+			for (; cmd < chunk.commands.size() && chunk.commands[cmd].face == i; cmd++) {
+				const ObjCommand &c = chunk.commands[cmd];
+				if (c.type == ObjCommand::MtlLib) {
+					string mtlFileName = resolvePath(directoryOf(objFileName), c.arg);
+					_matLib.readFromMtlFile(mtlFileName.c_str());
+					_sourceFiles.push_back(mtlFileName);
+				}
+				else if (c.type == ObjCommand::Group) {
+					if (_groups.back().name != c.arg) {
+						_groups.emplace_back();
+						_groups.back().name = c.arg;
+						_groups.back().first = _faces.size();
+					}
+				}
+				else if (c.type == ObjCommand::Smooth) {
+					smoothGroup = c.arg == "off" ? 0 : (unsigned int)atoi(c.arg.c_str());
+					_hasSmoothingGroups = true;
+				}
+				else if (c.type == ObjCommand::UseMtl) {
+					mat = _matLib.getMaterialByName(c.arg.c_str());
+					if (mat == nullptr) {
+						cout << "Warn: material not found: " << c.arg << endl;
+					}
+				}
+			}
+			if (i == chunk.faces.size()) break;
+
+			const ObjFace &of = chunk.faces[i];
+			int *dst[3][3];
+			_faces.emplace_back();
+			TriangleFace &f = _faces.back();
+			dst[0][0] = &f.v1, dst[0][1] = &f.v2, dst[0][2] = &f.v3;
+			dst[1][0] = &f.vt1, dst[1][1] = &f.vt2, dst[1][2] = &f.vt3;
+			dst[2][0] = &f.vn1, dst[2][1] = &f.vn2, dst[2][2] = &f.vn3;
+			const int *src[3] = { of.v, of.vt, of.vn };
+			int base[3] = { vbase, vtbase, vnbase };
+			for (int k = 0; k < 3; k++) {
+				for (int slot = 0; slot < 3; slot++) {
+					bool relative = (of.relative >> (k * 3 + slot)) & 1;
+					*dst[k][slot] = src[k][slot] + (relative ? base[k] : 0);
+				}
+			}
+			f.smoothGroup = smoothGroup;
+			f.mat = mat;
+			_groups.back().count++;
+		}
+
+		for (auto &w : chunk.warnings) {
+			cout << "Warn: " << w << endl;
+		}
+		// appended, so the parsed copy goes before the next one grows the scene
+		chunk = ObjChunk();
+	}
+
+	return true;
 }
 
-Scene::Scene(const char * objFileName)
+static bool parseNumbers(const vector<string> &tokens, size_t &i, float *values, int count)
 {
-	if (!readFromObjFile(objFileName)) {
-		clear();
+	for (int k = 0; k < count; k++, i++) {
+		char *end = nullptr;
+		if (i >= tokens.size()) return false;
+		values[k] = strtof(tokens[i].c_str(), &end);
+		if (*end != '\0') return false;
 	}
+	return true;
 }
 
-void Scene::clear()
+static bool isNumber(const vector<string> &tokens, size_t i)
 {
-	for (auto g : _groups) delete g;
-	_groups.clear();
-	for (auto v : _vertices) delete v;
-	_vertices.clear();
-	for (auto c : _textureCoords) delete c;
-	_textureCoords.clear();
-	for (auto n : _normals) delete n;
-	_normals.clear();
-	for (auto f : _faces) delete f;
-	_faces.clear();
+	char *end = nullptr;
+	return i < tokens.size() && (strtof(tokens[i].c_str(), &end), *end == '\0');
+}
 
-	_matLib.clear();
+// Instance transform from the words after "instance <mesh>", false on
+// anything it does not understand.
+static bool parseTransform(const vector<string> &tokens, size_t i, Affine3f &transform)
+{
+	transform = Affine3f::Identity();
+	while (i < tokens.size()) {
+		const string &op = tokens[i++];
+		float v[12];
+		if (op == "translate" && parseNumbers(tokens, i, v, 3)) {
+			transform = Translation3f(v[0], v[1], v[2]) * transform;
+		}
+		else if (op == "rotate" && parseNumbers(tokens, i, v, 4)) {
+			Vector3f axis(v[0], v[1], v[2]);
+			if (axis.norm() == 0) return false;
+			transform = AngleAxisf(v[3] * 3.14159265f / 180, axis.normalized()) * transform;
+		}
+		else if (op == "scale" && isNumber(tokens, i + 1)) {
+			if (!parseNumbers(tokens, i, v, 3)) return false;
+			transform = Scaling(v[0], v[1], v[2]) * transform;
+		}
+		else if (op == "scale" && parseNumbers(tokens, i, v, 1)) {
+			transform = Scaling(v[0]) * transform;
+		}
+		else if (op == "matrix" && parseNumbers(tokens, i, v, 12)) {
+			Affine3f m;
+			m.matrix().topRows<3>() = Map<Matrix<float, 3, 4, RowMajor>>(v);
+			m.matrix().row(3) << 0, 0, 0, 1;
+			transform = m * transform;
+		}
+		else {
+			return false;
+		}
+	}
+	return transform.linear().determinant() != 0;
 }
 
-bool Scene::readFromObjFile(const char * objFileName)
+bool Scene::readFromSceneFile(const char *sceneFileName)
 {
-	fstream fin(objFileName);
+	ifstream fin(sceneFileName);
 	if (!fin.is_open()) {
-		cout << "Error: unable to open obj file: "
-			<< objFileName << endl;
+		cout << "Error: unable to open scene file: " << sceneFileName << endl;
 		return false;
 	}
+	_sourceFiles.push_back(sceneFileName);
 
-	SceneGroup *currentGroup = new SceneGroup;
-	currentGroup->name = "default";
-	_groups.push_back(currentGroup);
-
-	float x, y, z;
-	Vector2f c;
-	bool smoothMode = false;
-	Material *mat = nullptr;
-	string op, arg;
-	vector<vector<string>> faceArgs;
+	string dir = directoryOf(sceneFileName);
 
-	while (fin >> op) {
-		if (op.length() == 0) break;
-		if (op[0] == '#') {
-			getline(fin, op);
-		}
-		else if (op == "mtllib") {
-			fin >> arg;
-			_matLib.readFromMtlFile(arg.c_str());
+	// every OBJ file is read and gets its normals once, however many meshes
+	// come from it
+	map<string, unique_ptr<Scene>> sources;
+	map<string, size_t> meshIds;
+	string line;
+	for (int lineNumber = 1; getline(fin, line); lineNumber++) {
+		line = line.substr(0, line.find('#'));
+		istringstream words(line);
+		vector<string> tokens;
+		for (string w; words >> w;) {
+			tokens.push_back(w);
 		}
-		else if (op == "g") {
-			fin >> arg;
-			if (!currentGroup || currentGroup->name != arg) {
-				currentGroup = new SceneGroup;
-				currentGroup->name = arg;
-				_groups.push_back(currentGroup);
+		if (tokens.empty()) continue;
+
+		string where = string(sceneFileName) + ":" + to_string(lineNumber);
+		if (tokens[0] == "mesh" && tokens.size() >= 3) {
+			const string &name = tokens[1];
+			if (meshIds.count(name)) {
+				cout << "Error: " << where << ": mesh " << name << " is already defined" << endl;
+				return false;
 			}
-		}
-		else if (op == "v") {
-			fin >> x >> y >> z;
-			Vector3f *pvec3 = new Vector3f(x, y, z);
-			_vertices.push_back(pvec3);
-			if (currentGroup) {
-				currentGroup->vertices.push_back(pvec3);
+			unique_ptr<Scene> &source = sources[tokens[2]];
+			if (!source) {
+				source.reset(new Scene);
+				if (!source->readFromObjFile(resolvePath(dir, tokens[2]).c_str())) {
+					return false;
+				}
+				source->computeNormals();
+				_sourceFiles.insert(_sourceFiles.end(), source->_sourceFiles.begin(), source->_sourceFiles.end());
 			}
-		}
-		else if (op == "vt") {
-			fin >> c[0] >> c[1];
-			Vector2f *pvec2 = new Vector2f(x, y);
-			_textureCoords.push_back(pvec2);
-			if (currentGroup) {
-				currentGroup->textureCoords.push_back(pvec2);
+			int mesh = _appendMesh(name, *source, vector<string>(tokens.begin() + 3, tokens.end()));
+			if (mesh < 0) {
+				cout << "Error: " << where << ": mesh " << name << " has no faces" << endl;
+				return false;
 			}
+			meshIds[name] = mesh;
 		}
-		else if (op == "vn") {
-			fin >> x >> y >> z;
-			Vector3f *pvec3 = new Vector3f(x, y, z);
-			_normals.push_back(pvec3);
-			if (currentGroup) {
-				currentGroup->normals.push_back(pvec3);
+		else if (tokens[0] == "instance" && tokens.size() >= 2) {
+			auto it = meshIds.find(tokens[1]);
+			if (it == meshIds.end()) {
+				cout << "Error: " << where << ": unknown mesh " << tokens[1] << endl;
+				return false;
 			}
-		}
-		else if (op == "s") {
-			fin >> arg;
-			if (arg == "1") {
-				smoothMode = true;
-			} else {
-				smoothMode = false;
+			Affine3f transform;
+			if (!parseTransform(tokens, 2, transform)) {
+				cout << "Error: " << where << ": invalid transform" << endl;
+				return false;
 			}
+			addInstance(it->second, transform);
 		}
-		else if (op == "usemtl") {
-			fin >> arg;
-			mat = _matLib.getMaterialByName(arg.c_str());
-			if (mat == nullptr) {
-				cout << "Warn: material not found: " << arg << endl;
-			}
+		else {
+			cout << "Error: " << where << ": cannot parse \"" << line << "\"" << endl;
+			return false;
 		}
-		else if (op == "f") {
-			getline(fin, arg);
-			faceArgs = processFaceArgs(arg);
-			size_t faceNum = faceArgs.size();
-			size_t compNum = faceArgs[0].size();
-			assert(faceNum >= 3 && compNum >= 1 && "invalid face description");
-			for (size_t i = 1; i + 1 < faceArgs.size(); i++) {
-				assert(faceArgs[i].size() == compNum &&
-					faceArgs[i + 1].size() == compNum &&
-					"invalid face description");
-				TriangleFace *f = new TriangleFace;
-				f->v1 = convertStringToIndex(faceArgs[0][0]);
-				f->v2 = convertStringToIndex(faceArgs[i][0]);
-				f->v3 = convertStringToIndex(faceArgs[i + 1][0]);
-				f->vt1 = compNum < 2 ? -1 : convertStringToIndex(faceArgs[0][1]);
-				f->vt2 = compNum < 2 ? -1 : convertStringToIndex(faceArgs[i][1]);
-				f->vt3 = compNum < 2 ? -1 : convertStringToIndex(faceArgs[i + 1][1]);
-				f->vn1 = compNum < 3 ? -1 : convertStringToIndex(faceArgs[0][2]);
-				f->vn2 = compNum < 3 ? -1 : convertStringToIndex(faceArgs[i][2]);
-				f->vn3 = compNum < 3 ? -1 : convertStringToIndex(faceArgs[i + 1][2]);
-				f->smooth = smoothMode;
-				f->mat = mat;
-				_faces.push_back(f);
-				if (currentGroup) {
-					currentGroup->faces.push_back(f);
+	}
+	if (_instances.empty()) {
+		cout << "Error: scene file has no instances: " << sceneFileName << endl;
+		return false;
+	}
+	_edits.clear();
+	return true;
+}
+
+int Scene::_appendMesh(const string &name, const Scene &source, const vector<string> &groups)
+{
+	vector<int> vertices(source._vertices.size(), -1), normals(source._normals.size(), -1);
+	map<const Material *, Material *> materials;
+	SceneMesh mesh = { name, _faces.size(), 0 };
+	for (auto &g : source._groups) {
+		if (!groups.empty() && find(groups.begin(), groups.end(), g.name) == groups.end()) continue;
+		if (g.count == 0) continue;
+
+		SceneGroup copy;
+		copy.name = g.name;
+		copy.first = _faces.size();
+		copy.count = g.count;
+		_groups.push_back(copy);
+		for (size_t i = g.first; i < g.first + g.count; i++) {
+			TriangleFace f = source._faces[i];
+			for (int *v : { &f.v1, &f.v2, &f.v3 }) {
+				if (vertices[*v] < 0) {
+					vertices[*v] = (int)_vertices.size();
+					_vertices.push_back(source._vertices[*v]);
 				}
+				*v = vertices[*v];
 			}
-		}
-		else {
-			cout << "Warn: unrecognized obj file operator: "
-				<< op << endl;
-			getline(fin, op);
+			for (int *vn : { &f.vn1, &f.vn2, &f.vn3 }) {
+				if (*vn < 0) continue;
+				if (normals[*vn] < 0) {
+					normals[*vn] = (int)_normals.size();
+					_normals.push_back(source._normals[*vn]);
+				}
+				*vn = normals[*vn];
+			}
+			f.vt1 = f.vt2 = f.vt3 = -1;
+			if (f.mat) {
+				Material *&m = materials[f.mat];
+				if (!m) m = _matLib.addMaterial(*f.mat);
+				f.mat = m;
+			}
+			_faces.push_back(f);
 		}
 	}
+	mesh.count = _faces.size() - mesh.first;
+	if (mesh.count == 0) return -1;
+	_meshes.push_back(mesh);
+	return (int)_meshes.size() - 1;
+}
 
-	return true;
+int Scene::addInstance(size_t mesh, const Affine3f &transform)
+{
+	if (mesh >= _meshes.size()) {
+		cout << "Error: no mesh " << mesh << " to instance" << endl;
+		return -1;
+	}
+	_instances.emplace_back();
+	_instances.back().mesh = mesh;
+	_instances.back().transform = transform;
+	_edits.added = true;
+	return (int)_instances.size() - 1;
 }
 
-void Scene::computeNormals()
+void Scene::computeNormals(NormalWeighting weighting, float creaseAngle)
 {
+	ScopedTimer timer("scene.normals");
 	if (_normals.size()) return;
 
-	for (auto &v : _vertices) {
-		_normals.push_back(new Vector3f(0, 0, 0));
-	}
+	TaskScheduler &scheduler = TaskScheduler::shared();
+	const size_t faceCount = _faces.size(), vertexCount = _vertices.size();
+	const size_t grain = 4096;
+	auto forBlocks = [&](size_t count, const function<void(size_t, size_t)> &fn) {
+		scheduler.parallelFor((count + grain - 1) / grain, [&](size_t block) {
+			fn(block * grain, min(count, (block + 1) * grain));
+		});
+	};
 
-	int *count = new int[_normals.size()];
-	memset(count, 0, sizeof(int) * _normals.size());
+	// unit face normals and the weight each face gives to its three corners
+	vector<Vector3f> faceNormals(faceCount);
+	vector<float> cornerWeights(faceCount * 3);
+	forBlocks(faceCount, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const TriangleFace &f = _faces[i];
+			const Vector3f *p[3] = { &_vertices[f.v1], &_vertices[f.v2], &_vertices[f.v3] };
+			Vector3f edges[3] = { *p[1] - *p[0], *p[2] - *p[1], *p[0] - *p[2] };
+			Vector3f n = edges[0].cross(-edges[2]);
+			float area = n.norm();
+			faceNormals[i] = area > 0 ? Vector3f(n / area) : Vector3f(0, 0, 0);
+			if (weighting == AngleWeights) {
+				// corner k sits between the incoming edge k + 2 and outgoing edge k
+				for (auto &e : edges) {
+					float len = e.norm();
+					if (len > 0) e /= len;
+				}
+				for (int k = 0; k < 3; k++) {
+					float c = -edges[k].dot(edges[(k + 2) % 3]);
+					cornerWeights[i * 3 + k] = acosf(max(-1.0f, min(1.0f, c)));
+				}
+			}
+			else {
+				float w = weighting == AreaWeights ? area : 1.0f;
+				cornerWeights[i * 3] = cornerWeights[i * 3 + 1] = cornerWeights[i * 3 + 2] = w;
+			}
+		}
+	});
 
+	// vertex -> corner adjacency in CSR form, corner c is vertex c % 3 of
+	// face c / 3
+	vector<int> offsets(vertexCount + 1, 0);
 	for (auto &f : _faces) {
-		Vector3f u = *_vertices[f->v2] - *_vertices[f->v1];
-		Vector3f v = *_vertices[f->v3] - *_vertices[f->v1];
-		Vector3f n = u.cross(v).normalized();
-		*_normals[f->v1] += n;
-		*_normals[f->v2] += n;
-		*_normals[f->v3] += n;
-		count[f->v1]++;
-		count[f->v2]++;
-		count[f->v3]++;
-		f->vn1 = f->v1;
-		f->vn2 = f->v2;
-		f->vn3 = f->v3;
-	}
-	for (size_t i = 0; i < _normals.size(); i++) {
-		if (count[i]) *_normals[i] /= (float)count[i];
-	}
-	delete count;
+		offsets[f.v1 + 1]++;
+		offsets[f.v2 + 1]++;
+		offsets[f.v3 + 1]++;
+	}
+	for (size_t v = 0; v < vertexCount; v++) offsets[v + 1] += offsets[v];
+	vector<int> corners(faceCount * 3);
+	{
+		vector<int> cursor(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < faceCount; i++) {
+			corners[cursor[_faces[i].v1]++] = (int)i * 3;
+			corners[cursor[_faces[i].v2]++] = (int)i * 3 + 1;
+			corners[cursor[_faces[i].v3]++] = (int)i * 3 + 2;
+		}
+	}
+
+	bool useGroups = _hasSmoothingGroups;
+	auto groupOf = [&](size_t face) { return useGroups ? _faces[face].smoothGroup : 1u; };
+	float cosCrease = creaseAngle < 180 ? cosf(creaseAngle * 3.14159265f / 180) : -2.0f;
+	auto cornerVertex = [&](size_t face, int k) { return k == 0 ? _faces[face].v1 : k == 1 ? _faces[face].v2 : _faces[face].v3; };
+
+	auto shares = [&](size_t face, size_t other) {
+		return groupOf(other) == groupOf(face) && faceNormals[face].dot(faceNormals[other]) >= cosCrease;
+	};
+	auto gather = [&](size_t face, int v) {
+		Vector3f n(0, 0, 0);
+		for (int j = offsets[v]; j < offsets[v + 1]; j++) {
+			if (shares(face, corners[j] / 3)) n += cornerWeights[corners[j]] * faceNormals[corners[j] / 3];
+		}
+		float len = n.norm();
+		return len > 0 ? Vector3f(n / len) : faceNormals[face];
+	};
+
+	// shared vertex normals sum every smoothed face around the vertex; they
+	// are only valid for corners of a vertex that sees a single group
+	_normals.assign(vertexCount, Vector3f(0, 0, 0));
+	vector<char> mixed(vertexCount, 0);
+	forBlocks(vertexCount, [&](size_t begin, size_t end) {
+		for (size_t v = begin; v < end; v++) {
+			Vector3f n(0, 0, 0);
+			unsigned int group = 0;
+			for (int j = offsets[v]; j < offsets[v + 1]; j++) {
+				unsigned int other = groupOf(corners[j] / 3);
+				if (other == 0) continue;
+				if (group != 0 && other != group) mixed[v] = 1;
+				group = other;
+				n += cornerWeights[corners[j]] * faceNormals[corners[j] / 3];
+			}
+			float len = n.norm();
+			_normals[v] = len > 0 ? Vector3f(n / len) : n;
+		}
+	});
+
+	// corners that cannot use the shared vertex normal get one of their own,
+	// flat faces one per face
+	enum { Shared, Split, Flat };
+	vector<char> kinds(faceCount * 3, Shared);
+	forBlocks(faceCount, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			for (int k = 0; k < 3; k++) {
+				int v = cornerVertex(i, k);
+				char &kind = kinds[i * 3 + k];
+				if (groupOf(i) == 0) kind = Flat;
+				else if (mixed[v]) kind = Split;
+				else if (creaseAngle < 180) {
+					for (int j = offsets[v]; j < offsets[v + 1] && kind == Shared; j++) {
+						size_t other = corners[j] / 3;
+						if (groupOf(other) != 0 && !shares(i, other)) kind = Split;
+					}
+				}
+			}
+		}
+	});
+
+	size_t normalCount = vertexCount;
+	for (size_t i = 0; i < faceCount; i++) {
+		TriangleFace &f = _faces[i];
+		int *vn[3] = { &f.vn1, &f.vn2, &f.vn3 };
+		int flat = kinds[i * 3] == Flat ? (int)normalCount++ : -1;
+		for (int k = 0; k < 3; k++) {
+			char kind = kinds[i * 3 + k];
+			*vn[k] = kind == Shared ? cornerVertex(i, k) : kind == Flat ? flat : (int)normalCount++;
+		}
+	}
+
+	// every normal has exactly one writer, so the gathers run without locks
+	_normals.resize(normalCount);
+	forBlocks(faceCount, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const TriangleFace &f = _faces[i];
+			const int vn[3] = { f.vn1, f.vn2, f.vn3 };
+			for (int k = 0; k < 3; k++) {
+				char kind = kinds[i * 3 + k];
+				if (kind == Flat) {
+					_normals[vn[k]] = faceNormals[i];
+				}
+				else if (kind == Split) {
+					_normals[vn[k]] = gather(i, cornerVertex(i, k));
+				}
+			}
+		}
+	});
 }
 
 void Scene::getGroupBuffers(
 	group_t **grpBuf, size_t *grpBufLen,
-	face_t **faceBuf, size_t *faceBufLen)
+	triangle_t **triBuf, face_attr_t **attrBuf, size_t *faceBufLen,
+	material_t **matBuf, size_t *matBufLen)
 {
-	const int VerticesPerFace = 3;
-	const int FloatsPerVertex = 3;
-	const int FloatsPerMaterial = 11;
-	const int GroupBufferStride = 4;
+	vector<material_t> materials;
+	*faceBufLen = _faces.size();
+	*grpBufLen = _groups.size();
+	*grpBuf = new group_t[_groups.size()];
+	*triBuf = new triangle_t[*faceBufLen];
+	*attrBuf = new face_attr_t[*faceBufLen];
+	writeGroupBuffers(*grpBuf, *triBuf, *attrBuf, materials);
 
-	MaterialData defaultMat;
+	*matBufLen = materials.size();
+	*matBuf = new material_t[materials.size()];
+	copy(materials.begin(), materials.end(), *matBuf);
+}
 
-	*faceBufLen = 0;
+void Scene::_materialTable(vector<material_t> &materials, map<const Material *, int> &ids) const
+{
+	// materials are deduplicated by value, faces without one use entry 0
+	vector<MaterialData> unique(1);
+	ids.clear();
+	ids[nullptr] = 0;
+	const Material *last = nullptr;
+	for (auto &sf : _faces) {
+		if (sf.mat == last || ids.count(sf.mat)) continue;
+		last = sf.mat;
+		int id = 0;
+		while (id < (int)unique.size() &&
+			memcmp(&unique[id], &sf.mat->data, sizeof(MaterialData)) != 0) id++;
+		if (id == (int)unique.size()) unique.push_back(sf.mat->data);
+		ids[sf.mat] = id;
+	}
 
-	*grpBufLen = _groups.size();
-	*grpBuf = new group_t[_groups.size()];
-	for (int i = 0; i < _groups.size(); i++) {
-		(*grpBuf)[i].fptr = *faceBufLen;
-		(*grpBuf)[i].flen = _groups[i]->faces.size();
-		*faceBufLen += _groups[i]->faces.size();
+	materials.resize(unique.size());
+	for (size_t i = 0; i < unique.size(); i++) {
+		materials[i].setMaterial(unique[i]);
 	}
+}
 
-	*faceBuf = new face_t[*faceBufLen];
+void Scene::writeGroupBuffers(
+	group_t *grpBuf, triangle_t *triBuf, face_attr_t *attrBuf,
+	vector<material_t> &materials)
+{
+	ScopedTimer timer("scene.buffers");
+	map<const Material *, int> materialIds;
+	_materialTable(materials, materialIds);
 
-	int vbptr = 0, bbptr = 0, mbptr = 0;
+	// groups are consecutive ranges of _faces, so the face buffers keep the
+	// face order and each group maps to the same range
 	for (size_t i = 0; i < _groups.size(); i++) {
-		auto *sg = _groups[i];
-		auto *g = &(*grpBuf)[i];
-		for (size_t j = 0; j < sg->faces.size(); j++) {
-			auto *sf = sg->faces[j];
-			auto *f = &(*faceBuf)[g->fptr + j];
-			g->updateBoundingBox(*_vertices[sf->v1], *_vertices[sf->v2], *_vertices[sf->v3]);
-			f->setVertices(*_vertices[sf->v1], *_vertices[sf->v2], *_vertices[sf->v3]);
-			f->setNormals(*_normals[sf->vn1], *_normals[sf->vn2], *_normals[sf->vn3]);
-			if (sf->mat) {
-				f->setMaterial(sf->mat->data);
+		const SceneGroup &sg = _groups[i];
+		writeGroup(i, grpBuf[i]);
+		int materialId = 0;
+		const Material *last = nullptr;
+		for (size_t j = sg.first; j < sg.first + sg.count; j++) {
+			const TriangleFace &sf = _faces[j];
+			writeFace(j, triBuf[j], attrBuf[j]);
+			if (sf.mat != last) {
+				materialId = materialIds[sf.mat];
+				last = sf.mat;
 			}
-			else {
-				f->setMaterial(defaultMat);
+			attrBuf[j].material = materialId;
+		}
+	}
+}
+
+void Scene::writeFace(size_t face, triangle_t &t, face_attr_t &a) const
+{
+	const TriangleFace &sf = _faces[face];
+	t.setVertices(_vertices[sf.v1], _vertices[sf.v2], _vertices[sf.v3]);
+	a.setNormals(_normals[sf.vn1], _normals[sf.vn2], _normals[sf.vn3]);
+}
+
+void Scene::writeGroup(size_t group, group_t &g) const
+{
+	const SceneGroup &sg = _groups[group];
+	g = group_t();
+	g.fptr = (int)sg.first;
+	g.flen = (int)sg.count;
+	for (size_t j = sg.first; j < sg.first + sg.count; j++) {
+		const TriangleFace &sf = _faces[j];
+		g.updateBoundingBox(_vertices[sf.v1], _vertices[sf.v2], _vertices[sf.v3]);
+	}
+}
+
+void Scene::writeMaterials(vector<material_t> &materials, vector<int> &faceMaterials) const
+{
+	map<const Material *, int> materialIds;
+	_materialTable(materials, materialIds);
+	faceMaterials.resize(_faces.size());
+	int materialId = 0;
+	const Material *last = nullptr;
+	for (size_t i = 0; i < _faces.size(); i++) {
+		if (i == 0 || _faces[i].mat != last) {
+			last = _faces[i].mat;
+			materialId = materialIds[last];
+		}
+		faceMaterials[i] = materialId;
+	}
+}
+
+int Scene::findGroup(const string &name) const
+{
+	for (size_t i = 0; i < _groups.size(); i++) {
+		if (_groups[i].name == name) return (int)i;
+	}
+	return -1;
+}
+
+void Scene::_detachGroup(SceneGroup &g)
+{
+	if (g.vertexCount > 0) return;
+
+	// copies are appended, so each group's own range stays contiguous
+	unordered_map<int, int> vertices, normals;
+	g.firstVertex = _vertices.size();
+	g.firstNormal = _normals.size();
+	for (size_t i = g.first; i < g.first + g.count; i++) {
+		TriangleFace &f = _faces[i];
+		for (int *v : { &f.v1, &f.v2, &f.v3 }) {
+			auto it = vertices.find(*v);
+			if (it == vertices.end()) {
+				Vector3f p = _vertices[*v];
+				it = vertices.emplace(*v, (int)_vertices.size()).first;
+				_vertices.push_back(p);
+			}
+			*v = it->second;
+		}
+		if (_normals.empty()) continue;
+		for (int *vn : { &f.vn1, &f.vn2, &f.vn3 }) {
+			auto it = normals.find(*vn);
+			if (it == normals.end()) {
+				Vector3f n = _normals[*vn];
+				it = normals.emplace(*vn, (int)_normals.size()).first;
+				_normals.push_back(n);
 			}
+			*vn = it->second;
 		}
 	}
+	g.vertexCount = _vertices.size() - g.firstVertex;
+	g.normalCount = _normals.size() - g.firstNormal;
+}
+
+bool Scene::transformGroup(size_t group, const Affine3f &transform)
+{
+	if (group >= _groups.size() || _groups[group].removed) {
+		cout << "Error: no group " << group << " to transform" << endl;
+		return false;
+	}
+	SceneGroup &g = _groups[group];
+	_detachGroup(g);
+
+	Matrix3f normalMatrix = transform.linear().inverse().transpose();
+	for (size_t i = g.firstVertex; i < g.firstVertex + g.vertexCount; i++) {
+		_vertices[i] = transform * _vertices[i];
+	}
+	for (size_t i = g.firstNormal; i < g.firstNormal + g.normalCount; i++) {
+		_normals[i] = (normalMatrix * _normals[i]).normalized();
+	}
+	_edits.faces.push_back(make_pair(g.first, g.count));
+	return true;
+}
+
+bool Scene::setMaterial(const char *name, const MaterialData &data)
+{
+	Material *m = _matLib.getMaterialByName(name);
+	if (m == nullptr) {
+		cout << "Error: material not found: " << name << endl;
+		return false;
+	}
+	m->data = data;
+	_edits.materials = true;
+	return true;
 }
 
+int Scene::addGroup(
+	const string &name,
+	const vector<Vector3f> &vertices,
+	const vector<int> &indices,
+	const char *material,
+	const vector<Vector3f> &normals)
+{
+	bool valid = indices.size() % 3 == 0
+		&& (normals.empty() || normals.size() == vertices.size())
+		&& all_of(indices.begin(), indices.end(), [&](int i) { return i >= 0 && i < (int)vertices.size(); });
+	if (!valid) {
+		cout << "Error: invalid geometry for group " << name << endl;
+		return -1;
+	}
+	Material *mat = material ? _matLib.getMaterialByName(material) : nullptr;
+	if (material && mat == nullptr) {
+		cout << "Warn: material not found: " << material << endl;
+	}
+	// the existing faces need their normals before the new ones arrive
+	if (_normals.empty() && !_faces.empty()) {
+		computeNormals();
+	}
+
+	SceneGroup g;
+	g.name = name;
+	g.first = _faces.size();
+	g.count = indices.size() / 3;
+	g.firstVertex = _vertices.size();
+	g.vertexCount = vertices.size();
+	g.firstNormal = _normals.size();
+	_vertices.insert(_vertices.end(), vertices.begin(), vertices.end());
+	_normals.insert(_normals.end(), normals.begin(), normals.end());
+	for (size_t i = 0; i < indices.size(); i += 3) {
+		TriangleFace f;
+		f.v1 = (int)g.firstVertex + indices[i];
+		f.v2 = (int)g.firstVertex + indices[i + 1];
+		f.v3 = (int)g.firstVertex + indices[i + 2];
+		f.vt1 = f.vt2 = f.vt3 = -1;
+		if (normals.empty()) {
+			Vector3f n = (vertices[indices[i + 1]] - vertices[indices[i]])
+				.cross(vertices[indices[i + 2]] - vertices[indices[i]]);
+			f.vn1 = f.vn2 = f.vn3 = (int)_normals.size();
+			_normals.push_back(n.norm() > 0 ? Vector3f(n.normalized()) : Vector3f(0, 0, 0));
+		}
+		else {
+			f.vn1 = (int)g.firstNormal + indices[i];
+			f.vn2 = (int)g.firstNormal + indices[i + 1];
+			f.vn3 = (int)g.firstNormal + indices[i + 2];
+			f.smoothGroup = 1;
+		}
+		f.mat = mat;
+		_faces.push_back(f);
+	}
+	g.normalCount = _normals.size() - g.firstNormal;
+	_groups.push_back(g);
+	if (!_meshes.empty() && g.count > 0) {
+		SceneMesh m = { name, g.first, g.count };
+		_meshes.push_back(m);
+		addInstance(_meshes.size() - 1, Affine3f::Identity());
+	}
+	_edits.added = true;
+	return (int)_groups.size() - 1;
+}
 
+bool Scene::removeGroup(size_t group)
+{
+	if (group >= _groups.size() || _groups[group].removed) {
+		cout << "Error: no group " << group << " to remove" << endl;
+		return false;
+	}
+	SceneGroup &g = _groups[group];
+	for (size_t i = g.first; i < g.first + g.count; i++) {
+		_faces[i].v2 = _faces[i].v3 = _faces[i].v1;
+	}
+	g.removed = true;
+	_edits.faces.push_back(make_pair(g.first, g.count));
+	return true;
+}
@@ -5,6 +5,7 @@
 
 #include <vector>
 #include <string>
+#include <map>
 
 
 struct TriangleFace
@@ -12,49 +13,92 @@ struct TriangleFace
 	int v1, v2, v3;
 	int vt1, vt2, vt3;
 	int vn1, vn2, vn3;
-	bool smooth;
+	unsigned int smoothGroup;	// OBJ "s" group, 0 when smoothing is off
 	Material *mat;
 
-	TriangleFace() : mat(0), smooth(false) {};
+	TriangleFace() : smoothGroup(0), mat(0) {};
 };
 
+// A run of consecutive faces in Scene's face array. A group name seen again
+// later in the file starts a new run.
 struct SceneGroup
 {
 	std::string name;
-	std::vector<Eigen::Vector3f *> vertices;
-	std::vector<Eigen::Vector2f *> textureCoords;
-	std::vector<Eigen::Vector3f *> normals;
-	std::vector<TriangleFace *> faces;
+	size_t first;
+	size_t count;
+	// vertices and normals only this group uses, empty until it is detached
+	// from the shared arrays by its first transform
+	size_t firstVertex, vertexCount;
+	size_t firstNormal, normalCount;
+	bool removed;
+
+	SceneGroup()
+		: first(0), count(0), firstVertex(0), vertexCount(0),
+		  firstNormal(0), normalCount(0), removed(false) {};
+};
 
-	SceneGroup() {};
+// Faces [first, first + count) of Scene's face array, the unit of
+// instancing: the triangles are stored and get a tree once, however many
+// SceneInstances place them.
+struct SceneMesh
+{
+	std::string name;
+	size_t first;
+	size_t count;
 };
 
-struct face_t {
-	// geometry
-	float v1[4];
-	float v2[4];
-	float v3[4];
-	float vn1[4];
-	float vn2[4];
-	float vn3[4];
+struct SceneInstance
+{
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
-	// material
-	float Kd[4];
-	float Ka[4];
-	float Ks[4];
-	float Ns;
-	float Tr;
-	float _padding[2];
+	size_t mesh;
+	Eigen::Affine3f transform;	// object to world
+};
+
+typedef std::vector<SceneInstance, Eigen::aligned_allocator<SceneInstance>> SceneInstanceList;
+
+// What the edits since the last SceneBuffers::update touched: face ranges
+// (first, count) in Scene order whose geometry or normals changed, whether
+// material data changed and whether faces were appended.
+struct SceneEdits
+{
+	std::vector<std::pair<size_t, size_t>> faces;
+	bool materials;
+	bool added;
+
+	SceneEdits() : materials(false), added(false) {};
+
+	bool empty() const { return faces.empty() && !materials && !added; }
+	void clear() { faces.clear(); materials = added = false; }
+};
+
+// Hot intersection data: the first vertex and both edges, so the
+// intersection loop touches 48 bytes per triangle.
+struct triangle_t {
+	float v0[4];
+	float e1[4];
+	float e2[4];
 
 	void setVertices(
 		const Eigen::Vector3f &v1,
 		const Eigen::Vector3f &v2,
 		const Eigen::Vector3f &v3)
 	{
-		memcpy(this->v1, v1.data(), 3 * sizeof(float));
-		memcpy(this->v2, v2.data(), 3 * sizeof(float));
-		memcpy(this->v3, v3.data(), 3 * sizeof(float));
+		Eigen::Vector3f d1 = v2 - v1, d2 = v3 - v1;
+		memcpy(v0, v1.data(), 3 * sizeof(float));
+		memcpy(e1, d1.data(), 3 * sizeof(float));
+		memcpy(e2, d2.data(), 3 * sizeof(float));
+		v0[3] = e1[3] = e2[3] = 0;
 	}
+};
+
+// Shading attributes, only fetched for the closest hit.
+struct face_attr_t {
+	float vn1[3];
+	int material;
+	float vn2[3];
+	float emitterPdf;	// density of light sampling per unit world area on this face
+	float vn3[4];
 
 	void setNormals(
 		const Eigen::Vector3f &vn1,
@@ -64,13 +108,25 @@ struct face_t {
 		memcpy(this->vn1, vn1.data(), 3 * sizeof(float));
 		memcpy(this->vn2, vn2.data(), 3 * sizeof(float));
 		memcpy(this->vn3, vn3.data(), 3 * sizeof(float));
+		this->vn3[3] = 0;
+		emitterPdf = 0;
 	}
+};
+
+// Entry of the deduplicated material table indexed by face_attr_t::material.
+struct material_t {
+	float Kd[3];
+	float Ns;
+	float Ka[3];
+	float Tr;
+	float Ks[4];
 
 	void setMaterial(const MaterialData &d)
 	{
 		Kd[0] = d.diffuse[0], Kd[1] = d.diffuse[1], Kd[2] = d.diffuse[2];
 		Ka[0] = d.ambient[0], Ka[1] = d.ambient[1], Ka[2] = d.ambient[2];
 		Ks[0] = d.specular[0], Ks[1] = d.specular[1], Ks[2] = d.specular[2];
+		Ks[3] = 0;
 		Ns = d.specularExponent;
 		Tr = d.transparency;
 	}
@@ -102,22 +158,98 @@ struct group_t {
 class Scene
 {
 private:
+	// geometry is stored by value in flat arrays; nothing is allocated per
+	// element, so clearing just releases a handful of blocks
 	MaterialLibrary _matLib;
-	std::vector<SceneGroup *> _groups;
-	std::vector<Eigen::Vector3f *> _vertices;
-	std::vector<Eigen::Vector2f *> _textureCoords;
-	std::vector<Eigen::Vector3f *> _normals;
-	std::vector<TriangleFace *> _faces;
+	std::vector<SceneGroup> _groups;
+	std::vector<Eigen::Vector3f> _vertices;
+	std::vector<Eigen::Vector2f> _textureCoords;
+	std::vector<Eigen::Vector3f> _normals;
+	std::vector<TriangleFace> _faces;
+	std::vector<std::string> _sourceFiles;
+	bool _hasSmoothingGroups;
+	SceneEdits _edits;
+	std::vector<SceneMesh> _meshes;
+	SceneInstanceList _instances;
+
+	int _appendMesh(const std::string &name, const Scene &source, const std::vector<std::string> &groups);
+	void _materialTable(std::vector<material_t> &materials, std::map<const Material *, int> &ids) const;
+	void _detachGroup(SceneGroup &g);
 
 public:
-	Scene() {};
+	enum NormalWeighting { UniformWeights, AreaWeights, AngleWeights };
+
+	Scene() : _hasSmoothingGroups(false) {};
 	Scene(const char *objFileName);
 
 	void clear();
-	bool readFromObjFile(const char *objFileName);
-	void computeNormals();
+	bool readFromObjFile(const char *objFileName, bool parallel = true);
+
+	// Generates vertex normals when the OBJ file has none. Faces only share
+	// a normal with faces of the same smoothing group whose normals are
+	// within `creaseAngle` degrees of their own; faces with smoothing off
+	// are flat. Files without any "s" statement are smoothed as one group.
+	void computeNormals(NormalWeighting weighting = AngleWeights, float creaseAngle = 180);
+
+	// Reads a scene description: lines of
+	//   mesh <name> <file.obj> [group...]
+	//   instance <mesh> [scale s | scale x y z] [rotate x y z degrees]
+	//            [translate x y z] [matrix <12 numbers, row major 3x4>]
+	// A mesh is the whole OBJ file, or only the groups with the listed
+	// names; each file is read once. Transforms apply in the order they are written.
+	// OBJ paths are relative to the description file, "#" starts a comment.
+	bool readFromSceneFile(const char *sceneFileName);
+
+	// the OBJ or description file and every file it pulled in
+	const std::vector<std::string> &sourceFiles() const { return _sourceFiles; }
+
+	// Scenes read from a single OBJ file have no meshes or instances; all
+	// faces then form one mesh placed once as it is.
+	const std::vector<SceneMesh> &meshes() const { return _meshes; }
+	const SceneInstanceList &instances() const { return _instances; }
+	int addInstance(size_t mesh, const Eigen::Affine3f &transform);
+
+	size_t groupCount() const { return _groups.size(); }
+	size_t faceCount() const { return _faces.size(); }
+	const SceneGroup &group(size_t i) const { return _groups[i]; }
+	// first group called `name`, -1 when there is none
+	int findGroup(const std::string &name) const;
+
+	// Interactive edits, e.g. from a look-dev session. They change the scene
+	// in place and record what they touched in edits(); SceneBuffers::update
+	// applies the record to buffers built from this scene and clears it.
+	// A group gets its own copy of its vertices and normals the first time
+	// it is transformed, so shared vertices stay with the other groups.
+	// Removed groups keep their face range, collapsed to degenerate faces.
+	// Added groups use flat normals unless per-vertex normals are given; in
+	// a scene with meshes they become a new mesh placed once as it is.
+	bool transformGroup(size_t group, const Eigen::Affine3f &transform);
+	bool setMaterial(const char *name, const MaterialData &data);
+	int addGroup(
+		const std::string &name,
+		const std::vector<Eigen::Vector3f> &vertices,
+		const std::vector<int> &indices,
+		const char *material = nullptr,
+		const std::vector<Eigen::Vector3f> &normals = std::vector<Eigen::Vector3f>());
+	bool removeGroup(size_t group);
+	const SceneEdits &edits() const { return _edits; }
+	void clearEdits() { _edits.clear(); }
 
 	void getGroupBuffers(
 		group_t **grpBuf, size_t *grpBufLen,
-		face_t **faceBuf, size_t *faceBufLen);
+		triangle_t **triBuf, face_attr_t **attrBuf, size_t *faceBufLen,
+		material_t **matBuf, size_t *matBufLen);
+
+	// Same as getGroupBuffers, but fills caller-provided arrays of
+	// groupCount() groups and faceCount() faces, e.g. a mapped file.
+	void writeGroupBuffers(
+		group_t *grpBuf, triangle_t *triBuf, face_attr_t *attrBuf,
+		std::vector<material_t> &materials);
+
+	// Pieces of writeGroupBuffers for updating buffers in place: one face
+	// without its material, one group, and the material table together with
+	// the entry every face uses.
+	void writeFace(size_t face, triangle_t &t, face_attr_t &a) const;
+	void writeGroup(size_t group, group_t &g) const;
+	void writeMaterials(std::vector<material_t> &materials, std::vector<int> &faceMaterials) const;
 };
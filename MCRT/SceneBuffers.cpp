@@ -0,0 +1,856 @@
+#include "SceneBuffers.h"
+#include "Hash.h"
+#include "Stats.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+using namespace Eigen;
+
+struct mcrtbin_section_t {
+	uint64_t offset;
+	uint64_t count;
+	uint32_t elementSize;
+	uint32_t _padding;
+};
+
+struct mcrtbin_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t sourceCount;
+	uint32_t sectionCount;
+	uint32_t _padding;
+	uint64_t fileSize;
+	mcrtbin_section_t sections[8];
+};
+
+struct mcrtbin_source_t {
+	uint64_t hash;
+	char path[248];
+};
+
+static const char Magic[8] = { 'M', 'C', 'R', 'T', 'B', 'I', 'N', 0 };
+
+static const uint32_t SectionElementSizes[] = {
+	sizeof(group_t),
+	sizeof(triangle_t),
+	sizeof(face_attr_t),
+	sizeof(material_t),
+	sizeof(bvh_node_t),
+	sizeof(emitter_t),
+	sizeof(instance_t),
+	sizeof(bvh_node_t)
+};
+
+static inline uint64_t alignOffset(uint64_t offset)
+{
+	return (offset + SceneBuffers::SectionAlignment - 1) & ~(uint64_t)(SceneBuffers::SectionAlignment - 1);
+}
+
+static Vector3f toWorldVector(const instance_t &inst, const float v[3])
+{
+	return Vector3f(
+		inst.toWorld[0][0] * v[0] + inst.toWorld[0][1] * v[1] + inst.toWorld[0][2] * v[2],
+		inst.toWorld[1][0] * v[0] + inst.toWorld[1][1] * v[1] + inst.toWorld[1][2] * v[2],
+		inst.toWorld[2][0] * v[0] + inst.toWorld[2][1] * v[1] + inst.toWorld[2][2] * v[2]);
+}
+
+static float worldArea(const instance_t &inst, const triangle_t &t)
+{
+	return 0.5f * toWorldVector(inst, t.e1).cross(toWorldVector(inst, t.e2)).norm();
+}
+
+static inline bool isEmpty(const bvh_node_t &node)
+{
+	return node.vmin[0] >= BVH::EmptyBound;
+}
+
+// World box around the 8 corners of a mesh root placed by `inst`.
+static AlignedBox3f worldBounds(const instance_t &inst, const bvh_node_t &root)
+{
+	AlignedBox3f box;
+	if (isEmpty(root)) {
+		box.min() = box.max() = Vector3f::Constant(BVH::EmptyBound);
+		return box;
+	}
+	for (int i = 0; i < 8; i++) {
+		float p[3] = {
+			i & 1 ? root.vmax[0] : root.vmin[0],
+			i & 2 ? root.vmax[1] : root.vmin[1],
+			i & 4 ? root.vmax[2] : root.vmin[2]
+		};
+		Vector3f offset(inst.toWorld[0][3], inst.toWorld[1][3], inst.toWorld[2][3]);
+		box.extend(toWorldVector(inst, p) + offset);
+	}
+	return box;
+}
+
+// The meshes of `s` in face order, one over all faces when it has none.
+// They have to cover the faces without gaps, so that leaf slots can be
+// handed out mesh after mesh and the slots of a mesh are its face range.
+static bool sceneMeshes(const Scene &s, vector<SceneMesh> &meshes)
+{
+	meshes = s.meshes();
+	if (meshes.empty()) {
+		SceneMesh all = { "scene", 0, s.faceCount() };
+		meshes.push_back(all);
+	}
+	size_t next = 0;
+	for (auto &m : meshes) {
+		if (m.first != next || (m.count == 0 && meshes.size() > 1)) {
+			cout << "Error: meshes do not cover the faces of the scene in order" << endl;
+			return false;
+		}
+		next += m.count;
+	}
+	if (next != s.faceCount()) {
+		cout << "Error: meshes do not cover the faces of the scene in order" << endl;
+		return false;
+	}
+	return true;
+}
+
+static SceneInstanceList sceneInstances(const Scene &s)
+{
+	SceneInstanceList instances = s.instances();
+	if (instances.empty()) {
+		instances.emplace_back();
+		instances.back().mesh = 0;
+		instances.back().transform = Affine3f::Identity();
+	}
+	return instances;
+}
+
+// The trees of all meshes in one node array, with global node and face
+// indices; slot i of the leaf-ordered face buffers holds face order[i].
+struct MeshForest
+{
+	vector<bvh_node_t> nodes;
+	vector<size_t> order;
+	vector<int> roots;
+};
+
+static void buildForest(const triangle_t *triangles, const vector<SceneMesh> &meshes, MeshForest &forest)
+{
+	forest.order.reserve(meshes.empty() ? 0 : meshes.back().first + meshes.back().count);
+	for (auto &m : meshes) {
+		BVH bvh;
+		bvh.build(triangles + m.first, m.count);
+		int nodeBase = (int)forest.nodes.size();
+		forest.roots.push_back(nodeBase);
+		for (size_t i = 0; i < bvh.nodeCount(); i++) {
+			bvh_node_t node = bvh.nodes()[i];
+			node.start += node.count > 0 ? (int)m.first : nodeBase;
+			forest.nodes.push_back(node);
+		}
+		for (size_t i : bvh.order()) {
+			forest.order.push_back(m.first + i);
+		}
+	}
+}
+
+// Places the meshes and builds the top-level tree over the instances'
+// world bounds, storing the instances in its leaf order.
+static void buildInstances(const SceneInstanceList &placements, const MeshForest &forest,
+	vector<instance_t> &instances, vector<bvh_node_t> &topNodes)
+{
+	vector<instance_t> placed(placements.size());
+	vector<AlignedBox3f> bounds(placements.size());
+	for (size_t i = 0; i < placements.size(); i++) {
+		instance_t &inst = placed[i];
+		inst.setTransform(placements[i].transform);
+		inst.mesh = (int)placements[i].mesh;
+		inst.root = forest.roots[inst.mesh];
+		bounds[i] = worldBounds(inst, forest.nodes[inst.root]);
+	}
+	BVH bvh;
+	bvh.build(bounds.data(), bounds.size());
+	instances.resize(placed.size());
+	for (size_t i = 0; i < placed.size(); i++) {
+		instances[i] = placed[bvh.order()[i]];
+	}
+	topNodes.assign(bvh.nodes(), bvh.nodes() + bvh.nodeCount());
+}
+
+// Recomputes the top-level bounds after mesh trees were refitted.
+static void refitInstances(const vector<instance_t> &instances, const bvh_node_t *nodes, vector<bvh_node_t> &topNodes)
+{
+	for (size_t i = topNodes.size(); i-- > 0;) {
+		bvh_node_t &node = topNodes[i];
+		AlignedBox3f box;
+		if (node.count > 0) {
+			for (int j = node.start; j < node.start + node.count; j++) {
+				box.extend(worldBounds(instances[j], nodes[instances[j].root]));
+			}
+		}
+		else {
+			for (const bvh_node_t *child : { &topNodes[i + 1], &topNodes[node.start] }) {
+				if (isEmpty(*child)) continue;
+				box.extend(Vector3f(child->vmin[0], child->vmin[1], child->vmin[2]));
+				box.extend(Vector3f(child->vmax[0], child->vmax[1], child->vmax[2]));
+			}
+		}
+		if (box.isEmpty()) {
+			box.min() = box.max() = Vector3f::Constant(BVH::EmptyBound);
+		}
+		memcpy(node.vmin, box.min().data(), 3 * sizeof(float));
+		memcpy(node.vmax, box.max().data(), 3 * sizeof(float));
+	}
+}
+
+// Lists every emissive face of every instance with its share of the power
+// emitted in world space, and sets emitterPdf on each face to the density,
+// per unit of world area, of light sampling picking a point on it: the
+// luminance of its Ka over the total power. Faces that emit nothing get 0.
+// `meshes` are the face ranges of the meshes in `triangles`, and emitter
+// faces index `triangles`.
+static void buildEmitters(const triangle_t *triangles, face_attr_t *attributes, size_t count,
+	const material_t *materials, const vector<SceneMesh> &meshes,
+	const vector<instance_t> &instances, vector<emitter_t> &emitters)
+{
+	for (size_t i = 0; i < count; i++) {
+		const float *Ka = materials[attributes[i].material].Ka;
+		attributes[i].emitterPdf = max(0.2126f * Ka[0] + 0.7152f * Ka[1] + 0.0722f * Ka[2], 0.0f);
+	}
+
+	double total = 0;
+	emitters.clear();
+	for (size_t k = 0; k < instances.size(); k++) {
+		const SceneMesh &m = meshes[instances[k].mesh];
+		for (size_t i = m.first; i < m.first + m.count; i++) {
+			if (attributes[i].emitterPdf <= 0) continue;
+			float power = attributes[i].emitterPdf * worldArea(instances[k], triangles[i]);
+			if (power <= 0) continue;
+			emitter_t e = { (int)i, (int)k, power, 0 };
+			emitters.push_back(e);
+			total += power;
+		}
+	}
+
+	float cdf = 0;
+	for (auto &e : emitters) {
+		e.pdf = (float)(e.pdf / total);
+		e.cdf = cdf += e.pdf;
+	}
+	if (!emitters.empty()) emitters.back().cdf = 1;
+	for (size_t i = 0; i < count; i++) {
+		attributes[i].emitterPdf = total > 0 ? (float)(attributes[i].emitterPdf / total) : 0;
+	}
+}
+
+// Renumbers emitter faces from Scene order to leaf slots without a full
+// inverse of `order`.
+static void toLeafSlots(vector<emitter_t> &emitters, const vector<size_t> &order)
+{
+	vector<pair<size_t, size_t>> faces;
+	for (size_t k = 0; k < emitters.size(); k++) {
+		faces.push_back(make_pair((size_t)emitters[k].face, k));
+	}
+	sort(faces.begin(), faces.end());
+	for (size_t i = 0; !faces.empty() && i < order.size(); i++) {
+		auto it = lower_bound(faces.begin(), faces.end(), make_pair(order[i], (size_t)0));
+		for (; it != faces.end() && it->first == order[i]; ++it) {
+			emitters[it->second].face = (int)i;
+		}
+	}
+}
+
+static void addRange(SceneBuffers::DirtyRanges &d, size_t first, size_t count)
+{
+	d.ranges.push_back(make_pair(first, count));
+}
+
+static void mergeRanges(SceneBuffers::DirtyRanges &d)
+{
+	sort(d.ranges.begin(), d.ranges.end());
+	size_t n = 0;
+	for (auto &r : d.ranges) {
+		if (n > 0 && r.first <= d.ranges[n - 1].first + d.ranges[n - 1].second) {
+			auto &last = d.ranges[n - 1];
+			last.second = max(last.second, r.first + r.second - last.first);
+		}
+		else {
+			d.ranges[n++] = r;
+		}
+	}
+	d.ranges.resize(n);
+}
+
+static bool hashFile(const char *fileName, uint64_t &hash)
+{
+	MappedFile f(fileName);
+	if (!f.isOpen()) return false;
+	hash = hashBytes(f.data(), f.size());
+	return true;
+}
+
+SceneBuffers::SceneBuffers()
+	: _groups(nullptr), _groupCount(0),
+	  _triangles(nullptr), _attributes(nullptr), _faceCount(0),
+	  _materials(nullptr), _materialCount(0),
+	  _nodes(nullptr), _nodeCount(0),
+	  _emitters(nullptr), _emitterCount(0),
+	  _instances(nullptr), _instanceCount(0),
+	  _topNodes(nullptr), _topNodeCount(0)
+{
+}
+
+SceneBuffers::~SceneBuffers()
+{
+	clear();
+}
+
+string SceneBuffers::getCacheFileName(const char *fileName)
+{
+	return string(fileName) + ".mcrtbin";
+}
+
+bool SceneBuffers::open(const char *fileName, bool useCache)
+{
+	ScopedTimer timer("scene.open");
+	string cacheFileName = getCacheFileName(fileName);
+	if (useCache && load(cacheFileName.c_str())) {
+		cout << "Loaded scene cache " << cacheFileName << endl;
+		return true;
+	}
+
+	// anything but an OBJ file is taken for a scene description
+	string name(fileName);
+	size_t dot = name.find_last_of('.');
+	string extension = dot == string::npos ? string() : name.substr(dot);
+	bool isObj = extension == ".obj" || extension == ".OBJ";
+	Scene s;
+	if (!(isObj ? s.readFromObjFile(fileName) : s.readFromSceneFile(fileName))) {
+		return false;
+	}
+	if (s.faceCount() == 0) {
+		cout << "Error: scene has no faces: " << fileName << endl;
+		return false;
+	}
+
+	// without the cache the streamed file only backs this scene
+	string streamFileName = useCache ? cacheFileName : cacheFileName + ".scratch";
+	if (!build(s, streamFileName.c_str())) {
+		return false;
+	}
+	if (!_file.isOpen()) {
+		return true;
+	}
+	if (useCache) {
+		cout << "Wrote scene cache " << cacheFileName << endl;
+	}
+	else {
+		_scratchFileName = streamFileName;
+	}
+	return true;
+}
+
+bool SceneBuffers::build(Scene &s, const char *fileName)
+{
+	clear();
+	s.computeNormals();
+
+	if (fileName) {
+		string scratchFileName = string(fileName) + ".faces";
+		MappedFile scratch;
+		if (scratch.create(scratchFileName.c_str(), s.faceCount() * (sizeof(triangle_t) + sizeof(face_attr_t)))) {
+			bool ok = _stream(s, scratch, fileName);
+			scratch.close();
+			remove(scratchFileName.c_str());
+			return ok;
+		}
+		cout << "Warn: cannot create " << scratchFileName << ", building the scene in memory" << endl;
+	}
+
+	group_t *grpBuf;
+	triangle_t *triBuf;
+	face_attr_t *attrBuf;
+	material_t *matBuf;
+	size_t grpBufLen, faceBufLen, matBufLen;
+
+	s.getGroupBuffers(
+		&grpBuf, &grpBufLen,
+		&triBuf, &attrBuf, &faceBufLen,
+		&matBuf, &matBufLen);
+
+	MeshForest forest;
+	bool ok = sceneMeshes(s, _meshes);
+	if (ok) {
+		buildForest(triBuf, _meshes, forest);
+		buildInstances(sceneInstances(s), forest, _instanceStorage, _topNodeStorage);
+		buildEmitters(triBuf, attrBuf, faceBufLen, matBuf, _meshes, _instanceStorage, _emitterStorage);
+	}
+
+	// store triangles and attributes in leaf order
+	const vector<size_t> &order = forest.order;
+	_triangleStorage.resize(order.size());
+	_attributeStorage.resize(order.size());
+	_faceSlots.resize(order.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		_faceSlots[order[i]] = i;
+		_triangleStorage[i] = triBuf[order[i]];
+		_attributeStorage[i] = attrBuf[order[i]];
+	}
+	for (auto &e : _emitterStorage) {
+		e.face = (int)_faceSlots[e.face];
+	}
+	_groupStorage.assign(grpBuf, grpBuf + grpBufLen);
+	_materialStorage.assign(matBuf, matBuf + matBufLen);
+	_nodeStorage.swap(forest.nodes);
+	delete[] grpBuf;
+	delete[] triBuf;
+	delete[] attrBuf;
+	delete[] matBuf;
+	if (!ok) {
+		clear();
+		return false;
+	}
+
+	_setSection(GroupSection, _groupStorage.data(), _groupStorage.size());
+	_setSection(TriangleSection, _triangleStorage.data(), _triangleStorage.size());
+	_setSection(AttributeSection, _attributeStorage.data(), _attributeStorage.size());
+	_setSection(MaterialSection, _materialStorage.data(), _materialStorage.size());
+	_setSection(NodeSection, _nodeStorage.data(), _nodeStorage.size());
+	_setSection(EmitterSection, _emitterStorage.data(), _emitterStorage.size());
+	_setSection(InstanceSection, _instanceStorage.data(), _instanceStorage.size());
+	_setSection(TopNodeSection, _topNodeStorage.data(), _topNodeStorage.size());
+	_setSources(s);
+	return true;
+}
+
+bool SceneBuffers::update(Scene &s)
+{
+	const SceneEdits &edits = s.edits();
+	if (edits.empty()) {
+		return true;
+	}
+	if (_faceSlots.empty() || _faceSlots.size() > s.faceCount()) {
+		cout << "Error: scene buffers were not built in memory from this scene" << endl;
+		return false;
+	}
+	ScopedTimer timer("scene.update");
+
+	// new faces need a new tree
+	if (edits.added) {
+		if (!build(s)) {
+			return false;
+		}
+		for (auto &d : _dirty) {
+			d.resized = true;
+		}
+		s.clearEdits();
+		return true;
+	}
+
+	// rewrite the edited faces in place, keeping their material and weight
+	vector<size_t> faceSlots, attributeSlots;
+	bool reweigh = false;
+	for (auto &range : edits.faces) {
+		for (size_t i = range.first; i < range.first + range.second; i++) {
+			size_t slot = _faceSlots[i];
+			face_attr_t &a = _attributeStorage[slot];
+			int material = a.material;
+			float emitterPdf = a.emitterPdf;
+			s.writeFace(i, _triangleStorage[slot], a);
+			a.material = material;
+			a.emitterPdf = emitterPdf;
+			reweigh |= emitterPdf > 0;
+			faceSlots.push_back(slot);
+		}
+	}
+	sort(faceSlots.begin(), faceSlots.end());
+	faceSlots.erase(unique(faceSlots.begin(), faceSlots.end()), faceSlots.end());
+	attributeSlots = faceSlots;
+
+	if (edits.materials) {
+		vector<material_t> materials;
+		vector<int> faceMaterials;
+		s.writeMaterials(materials, faceMaterials);
+		for (size_t i = 0; i < faceMaterials.size(); i++) {
+			face_attr_t &a = _attributeStorage[_faceSlots[i]];
+			if (a.material != faceMaterials[i]) {
+				a.material = faceMaterials[i];
+				attributeSlots.push_back(_faceSlots[i]);
+			}
+		}
+		if (materials.size() != _materialStorage.size()) {
+			_dirty[MaterialSection].resized = true;
+		}
+		addRange(_dirty[MaterialSection], 0, materials.size());
+		_materialStorage.swap(materials);
+		_setSection(MaterialSection, _materialStorage.data(), _materialStorage.size());
+		reweigh = true;
+	}
+
+	if (reweigh) {
+		vector<float> weights(_faceCount);
+		for (size_t i = 0; i < _faceCount; i++) {
+			weights[i] = _attributeStorage[i].emitterPdf;
+		}
+		size_t emitterCount = _emitterStorage.size();
+		buildEmitters(_triangleStorage.data(), _attributeStorage.data(), _faceCount,
+			_materialStorage.data(), _meshes, _instanceStorage, _emitterStorage);
+		for (size_t i = 0; i < _faceCount; i++) {
+			if (_attributeStorage[i].emitterPdf != weights[i]) attributeSlots.push_back(i);
+		}
+		if (_emitterStorage.size() != emitterCount) {
+			_dirty[EmitterSection].resized = true;
+		}
+		addRange(_dirty[EmitterSection], 0, _emitterStorage.size());
+		_setSection(EmitterSection, _emitterStorage.data(), _emitterStorage.size());
+	}
+
+	// refit the leaves holding edited faces and everything above them
+	if (!faceSlots.empty()) {
+		if (_parents.empty()) {
+			_parents = BVH::parentIndices(_nodeStorage.data(), _nodeStorage.size());
+			_leafOf.resize(_faceCount);
+			for (size_t i = 0; i < _nodeStorage.size(); i++) {
+				const bvh_node_t &node = _nodeStorage[i];
+				for (int j = node.start; node.count > 0 && j < node.start + node.count; j++) {
+					_leafOf[j] = (int)i;
+				}
+			}
+		}
+		vector<int> leaves;
+		for (size_t slot : faceSlots) {
+			if (leaves.empty() || leaves.back() != _leafOf[slot]) leaves.push_back(_leafOf[slot]);
+		}
+		vector<int> nodes = BVH::refit(_nodeStorage.data(), _parents, _triangleStorage.data(), leaves);
+		for (int n : nodes) {
+			addRange(_dirty[NodeSection], n, 1);
+		}
+		refitInstances(_instanceStorage, _nodeStorage.data(), _topNodeStorage);
+		addRange(_dirty[TopNodeSection], 0, _topNodeStorage.size());
+	}
+	for (size_t slot : faceSlots) {
+		addRange(_dirty[TriangleSection], slot, 1);
+	}
+	for (size_t slot : attributeSlots) {
+		addRange(_dirty[AttributeSection], slot, 1);
+	}
+
+	for (size_t i = 0; i < _groupStorage.size(); i++) {
+		const SceneGroup &g = s.group(i);
+		bool edited = any_of(edits.faces.begin(), edits.faces.end(), [&](const pair<size_t, size_t> &r) {
+			return r.first < g.first + g.count && g.first < r.first + r.second;
+		});
+		if (edited) {
+			s.writeGroup(i, _groupStorage[i]);
+			addRange(_dirty[GroupSection], i, 1);
+		}
+	}
+
+	for (auto &d : _dirty) {
+		mergeRanges(d);
+	}
+	s.clearEdits();
+	return true;
+}
+
+void SceneBuffers::clearDirty()
+{
+	for (auto &d : _dirty) {
+		d.clear();
+	}
+}
+
+bool SceneBuffers::_stream(Scene &s, MappedFile &scratch, const char *fileName)
+{
+	size_t faceCount = s.faceCount();
+	triangle_t *triangles = (triangle_t *)scratch.writableData();
+	face_attr_t *attributes = (face_attr_t *)(triangles + faceCount);
+	vector<group_t> groups(s.groupCount());
+	vector<material_t> materials;
+	vector<SceneMesh> meshes;
+	if (!sceneMeshes(s, meshes)) {
+		return false;
+	}
+	SceneInstanceList placements = sceneInstances(s);
+	s.writeGroupBuffers(groups.data(), triangles, attributes, materials);
+	_setSources(s);
+	s.clear();
+
+	MeshForest forest;
+	buildForest(triangles, meshes, forest);
+	vector<instance_t> instances;
+	vector<bvh_node_t> topNodes;
+	buildInstances(placements, forest, instances, topNodes);
+	vector<emitter_t> emitters;
+	buildEmitters(triangles, attributes, faceCount, materials.data(), meshes, instances, emitters);
+	toLeafSlots(emitters, forest.order);
+
+	// gather the faces into leaf order one block at a time
+	const vector<size_t> &order = forest.order;
+	vector<char> block(StreamBlock * max(sizeof(triangle_t), sizeof(face_attr_t)));
+	auto gather = [&](FILE *fp, const char *data, size_t size) {
+		for (size_t i = 0; i < faceCount; i += StreamBlock) {
+			size_t n = min((size_t)StreamBlock, faceCount - i);
+			for (size_t j = 0; j < n; j++) {
+				memcpy(&block[j * size], data + order[i + j] * size, size);
+			}
+			if (fwrite(block.data(), size, n, fp) != n) return false;
+		}
+		return true;
+	};
+
+	size_t counts[SectionCount] = {
+		groups.size(), faceCount, faceCount, materials.size(), forest.nodes.size(), emitters.size(),
+		instances.size(), topNodes.size()
+	};
+	bool ok = _write(fileName, counts, [&](Section section, FILE *fp) {
+		switch (section) {
+		case GroupSection:
+			return fwrite(groups.data(), sizeof(group_t), groups.size(), fp) == groups.size();
+		case TriangleSection:
+			return gather(fp, (const char *)triangles, sizeof(triangle_t));
+		case AttributeSection:
+			return gather(fp, (const char *)attributes, sizeof(face_attr_t));
+		case MaterialSection:
+			return fwrite(materials.data(), sizeof(material_t), materials.size(), fp) == materials.size();
+		case NodeSection:
+			return fwrite(forest.nodes.data(), sizeof(bvh_node_t), forest.nodes.size(), fp) == forest.nodes.size();
+		case EmitterSection:
+			return fwrite(emitters.data(), sizeof(emitter_t), emitters.size(), fp) == emitters.size();
+		case InstanceSection:
+			return fwrite(instances.data(), sizeof(instance_t), instances.size(), fp) == instances.size();
+		case TopNodeSection:
+			return fwrite(topNodes.data(), sizeof(bvh_node_t), topNodes.size(), fp) == topNodes.size();
+		default:
+			return false;
+		}
+	});
+	if (!ok) {
+		_sources.clear();
+		return false;
+	}
+	forest = MeshForest();
+	if (!_map(fileName)) {
+		cout << "Error: cannot map scene file: " << fileName << endl;
+		return false;
+	}
+	return true;
+}
+
+void SceneBuffers::_setSources(const Scene &s)
+{
+	_sources.clear();
+	for (auto &path : s.sourceFiles()) {
+		Source src;
+		src.path = path;
+		if (hashFile(path.c_str(), src.hash)) {
+			_sources.push_back(src);
+		}
+	}
+}
+
+bool SceneBuffers::load(const char *cacheFileName)
+{
+	ScopedTimer timer("scene.cache_load");
+	if (!_map(cacheFileName)) {
+		return false;
+	}
+
+	// the cache is stale as soon as any source file changed or disappeared
+	for (auto &src : _sources) {
+		uint64_t hash;
+		if (!hashFile(src.path.c_str(), hash) || hash != src.hash) {
+			cout << "Scene cache is out of date: " << src.path << " changed" << endl;
+			clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SceneBuffers::_map(const char *fileName)
+{
+	clear();
+	if (!_file.open(fileName)) {
+		return false;
+	}
+
+	const char *data = _file.data();
+	size_t size = _file.size();
+	const mcrtbin_header_t *header = (const mcrtbin_header_t *)data;
+
+	bool valid = size >= sizeof(mcrtbin_header_t)
+		&& memcmp(header->magic, Magic, sizeof(Magic)) == 0
+		&& header->version == Version
+		&& header->sectionCount == SectionCount
+		&& header->fileSize == size
+		&& sizeof(mcrtbin_header_t) + header->sourceCount * sizeof(mcrtbin_source_t) <= size;
+	for (int i = 0; valid && i < SectionCount; i++) {
+		const mcrtbin_section_t &s = header->sections[i];
+		valid = s.elementSize == SectionElementSizes[i]
+			&& s.offset % SectionAlignment == 0
+			&& s.offset + s.count * s.elementSize <= size;
+	}
+	if (valid) {
+		valid = header->sections[NodeSection].count > 0
+			&& header->sections[TopNodeSection].count > 0
+			&& header->sections[InstanceSection].count > 0
+			&& header->sections[TriangleSection].count == header->sections[AttributeSection].count;
+	}
+	if (!valid) {
+		cout << "Warn: ignoring invalid scene cache: " << fileName << endl;
+		clear();
+		return false;
+	}
+
+	const mcrtbin_source_t *sources = (const mcrtbin_source_t *)(header + 1);
+	for (uint32_t i = 0; i < header->sourceCount; i++) {
+		Source src;
+		src.path.assign(sources[i].path, strnlen(sources[i].path, sizeof(sources[i].path)));
+		src.hash = sources[i].hash;
+		_sources.push_back(src);
+	}
+
+	for (int i = 0; i < SectionCount; i++) {
+		const mcrtbin_section_t &s = header->sections[i];
+		_setSection((Section)i, data + s.offset, (size_t)s.count);
+	}
+	return true;
+}
+
+bool SceneBuffers::save(const char *cacheFileName) const
+{
+	const void *sectionData[SectionCount] = {
+		_groups, _triangles, _attributes, _materials, _nodes, _emitters, _instances, _topNodes
+	};
+	size_t counts[SectionCount] = {
+		_groupCount, _faceCount, _faceCount, _materialCount, _nodeCount, _emitterCount,
+		_instanceCount, _topNodeCount
+	};
+	return _write(cacheFileName, counts, [&](Section section, FILE *fp) {
+		size_t count = counts[section];
+		return count == 0 || fwrite(sectionData[section], SectionElementSizes[section], count, fp) == count;
+	});
+}
+
+bool SceneBuffers::_write(const char *fileName, const size_t counts[SectionCount], const SectionWriter &writeSection) const
+{
+	ScopedTimer timer("scene.cache_save");
+	mcrtbin_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, Magic, sizeof(Magic));
+	header.version = Version;
+	header.sourceCount = (uint32_t)_sources.size();
+	header.sectionCount = SectionCount;
+
+	uint64_t offset = sizeof(header) + _sources.size() * sizeof(mcrtbin_source_t);
+	for (int i = 0; i < SectionCount; i++) {
+		mcrtbin_section_t &s = header.sections[i];
+		s.offset = alignOffset(offset);
+		s.count = counts[i];
+		s.elementSize = SectionElementSizes[i];
+		offset = s.offset + s.count * s.elementSize;
+	}
+	header.fileSize = offset;
+
+	// write next to the target and rename, so readers never see a partial file
+	string tmpFileName = string(fileName) + ".tmp";
+	FILE *fp = fopen(tmpFileName.c_str(), "wb");
+	if (fp == NULL) {
+		cout << "Error: cannot write scene cache: " << fileName << endl;
+		return false;
+	}
+
+	static const char zeros[SectionAlignment] = { 0 };
+	uint64_t written = sizeof(header);
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	for (auto &src : _sources) {
+		mcrtbin_source_t entry;
+		memset(&entry, 0, sizeof(entry));
+		entry.hash = src.hash;
+		strncpy(entry.path, src.path.c_str(), sizeof(entry.path) - 1);
+		ok = ok && fwrite(&entry, sizeof(entry), 1, fp) == 1;
+		written += sizeof(entry);
+	}
+	for (int i = 0; i < SectionCount; i++) {
+		const mcrtbin_section_t &s = header.sections[i];
+		size_t padding = (size_t)(s.offset - written);
+		ok = ok && (padding == 0 || fwrite(zeros, 1, padding, fp) == padding);
+		ok = ok && writeSection((Section)i, fp);
+		written = s.offset + s.count * s.elementSize;
+	}
+	ok = fclose(fp) == 0 && ok;
+
+	if (ok) {
+		remove(fileName);
+		ok = rename(tmpFileName.c_str(), fileName) == 0;
+	}
+	if (!ok) {
+		cout << "Error: cannot write scene cache: " << fileName << endl;
+		remove(tmpFileName.c_str());
+	}
+	return ok;
+}
+
+void SceneBuffers::clear()
+{
+	for (int i = 0; i < SectionCount; i++) {
+		_setSection((Section)i, nullptr, 0);
+	}
+	_sources.clear();
+	_groupStorage.clear();
+	_triangleStorage.clear();
+	_attributeStorage.clear();
+	_materialStorage.clear();
+	_nodeStorage.clear();
+	_emitterStorage.clear();
+	_instanceStorage.clear();
+	_topNodeStorage.clear();
+	_faceSlots.clear();
+	_meshes.clear();
+	_parents.clear();
+	_leafOf.clear();
+	clearDirty();
+	_file.close();
+	if (!_scratchFileName.empty()) {
+		remove(_scratchFileName.c_str());
+		_scratchFileName.clear();
+	}
+}
+
+void SceneBuffers::_setSection(Section s, const void *data, size_t count)
+{
+	switch (s) {
+	case GroupSection:
+		_groups = (const group_t *)data;
+		_groupCount = count;
+		break;
+	case TriangleSection:
+		_triangles = (const triangle_t *)data;
+		_faceCount = count;
+		break;
+	case AttributeSection:
+		_attributes = (const face_attr_t *)data;
+		break;
+	case MaterialSection:
+		_materials = (const material_t *)data;
+		_materialCount = count;
+		break;
+	case NodeSection:
+		_nodes = (const bvh_node_t *)data;
+		_nodeCount = count;
+		break;
+	case EmitterSection:
+		_emitters = (const emitter_t *)data;
+		_emitterCount = count;
+		break;
+	case InstanceSection:
+		_instances = (const instance_t *)data;
+		_instanceCount = count;
+		break;
+	case TopNodeSection:
+		_topNodes = (const bvh_node_t *)data;
+		_topNodeCount = count;
+		break;
+	default:
+		break;
+	}
+}
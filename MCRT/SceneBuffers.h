@@ -0,0 +1,202 @@
+#pragma once
+
+#include "Types.h"
+#include "Scene.h"
+#include "BVH.h"
+#include "MappedFile.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Light-emitting face (material Ka > 0) in leaf order, placed by one
+// instance. Entries are picked with probability `pdf`, proportional to the
+// power they emit in world space; `cdf` is the running sum over the list and
+// ends at 1.
+struct emitter_t {
+	int face;
+	int instance;
+	float pdf;
+	float cdf;
+};
+
+// One placement of a mesh: the rows of its object-to-world transform and
+// of the inverse, and the root of the mesh's tree in nodes(). Instances are
+// stored in the leaf order of topNodes().
+struct instance_t {
+	float toWorld[3][4];
+	float toObject[3][4];
+	int root;
+	int mesh;
+	int _padding[2];
+
+	void setTransform(const Eigen::Affine3f &transform)
+	{
+		Eigen::Matrix4f m = transform.matrix(), inv = transform.inverse(Eigen::Affine).matrix();
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 4; c++) {
+				toWorld[r][c] = m(r, c);
+				toObject[r][c] = inv(r, c);
+			}
+		}
+		_padding[0] = _padding[1] = 0;
+	}
+};
+
+// GPU-ready scene data: compact triangles and their shading attributes in
+// BVH leaf order, the deduplicated material table, the per-group bounds and
+// the emitter list for light sampling. The acceleration structure has two
+// levels: nodes() holds one tree per mesh over its faces in object space,
+// concatenated with global node and face indices, and topNodes() is a tree
+// over the world bounds of the instances(), whose leaves index instances.
+// A mesh placed many times is stored once. The arrays are either built in
+// memory from a Scene or point straight into a mapped .mcrtbin file, so
+// createSSBO and CpuTracer can consume them without any conversion.
+//
+// open() never holds the face arrays on the heap: triangles are converted
+// into a mapped scratch file, the Scene is released before the BVH build and
+// the leaf-ordered sections are streamed into the .mcrtbin file in blocks,
+// which is then mapped. The face data is paged by the OS, but this is not
+// out of core: the parsed Scene (roughly 100 bytes per triangle, as normal
+// generation needs the whole vertex adjacency) and then the BVH build state
+// (about 44 bytes per triangle) still have to fit in memory, so peak memory
+// grows with the mesh, only more slowly than with the face arrays on the heap.
+//
+// .mcrtbin layout (little endian):
+//   mcrtbin_header_t                with one mcrtbin_section_t per Section
+//   mcrtbin_source_t[sourceCount]   scene/OBJ/MTL files with their content hash
+//   section data                    each aligned to SectionAlignment
+class SceneBuffers
+{
+public:
+	enum Section {
+		GroupSection,
+		TriangleSection,
+		AttributeSection,
+		MaterialSection,
+		NodeSection,
+		EmitterSection,
+		InstanceSection,
+		TopNodeSection,
+		SectionCount
+	};
+
+	// Elements of one section changed by update(), as sorted disjoint
+	// (first, count) ranges. A resized section has to be replaced whole.
+	struct DirtyRanges
+	{
+		std::vector<std::pair<size_t, size_t>> ranges;
+		bool resized;
+
+		DirtyRanges() : resized(false) {};
+
+		bool empty() const { return ranges.empty() && !resized; }
+		void clear() { ranges.clear(); resized = false; }
+	};
+
+	SceneBuffers();
+	~SceneBuffers();
+
+	SceneBuffers(const SceneBuffers &) = delete;
+	SceneBuffers &operator=(const SceneBuffers &) = delete;
+
+	// Uses <fileName>.mcrtbin when its sources are unchanged, otherwise
+	// parses the OBJ or scene description file (Scene::readFromSceneFile),
+	// builds the buffers and rewrites the cache.
+	bool open(const char *fileName, bool useCache = true);
+
+	// Without a file name the buffers are built on the heap. With one they
+	// are streamed to that file and mapped; `s` is cleared on the way.
+	bool build(Scene &s, const char *fileName = nullptr);
+	bool load(const char *cacheFileName);
+	bool save(const char *cacheFileName) const;
+	void clear();
+
+	// Applies s.edits() to buffers built in memory from `s`: edited faces
+	// are rewritten in their leaf slots and the mesh trees and the top-level
+	// tree are refitted rather than rebuilt, emitters are reweighed when
+	// emissive faces or materials changed, and only added groups or
+	// instances force a full build. What changed is kept in dirtyRanges()
+	// until clearDirty(), for Tracer::updateScene; CpuTracer picks the new
+	// data up through load().
+	bool update(Scene &s);
+	const DirtyRanges &dirtyRanges(Section section) const { return _dirty[section]; }
+	void clearDirty();
+
+	const group_t *groups() const { return _groups; }
+	size_t groupCount() const { return _groupCount; }
+	const triangle_t *triangles() const { return _triangles; }
+	const face_attr_t *attributes() const { return _attributes; }
+	size_t faceCount() const { return _faceCount; }
+	const material_t *materials() const { return _materials; }
+	size_t materialCount() const { return _materialCount; }
+	const bvh_node_t *nodes() const { return _nodes; }
+	size_t nodeCount() const { return _nodeCount; }
+	const emitter_t *emitters() const { return _emitters; }
+	size_t emitterCount() const { return _emitterCount; }
+	const instance_t *instances() const { return _instances; }
+	size_t instanceCount() const { return _instanceCount; }
+	const bvh_node_t *topNodes() const { return _topNodes; }
+	size_t topNodeCount() const { return _topNodeCount; }
+
+	static std::string getCacheFileName(const char *fileName);
+
+	static const uint32_t Version = 4;
+	static const size_t SectionAlignment = 64;
+	static const size_t StreamBlock = 16384;	// faces per write while streaming
+
+private:
+	struct Source {
+		std::string path;
+		uint64_t hash;
+	};
+
+	typedef std::function<bool(Section section, FILE *fp)> SectionWriter;
+
+	void _setSection(Section s, const void *data, size_t count);
+	void _setSources(const Scene &s);
+	bool _stream(Scene &s, MappedFile &scratch, const char *fileName);
+	bool _map(const char *fileName);
+	bool _write(const char *fileName, const size_t counts[SectionCount], const SectionWriter &writeSection) const;
+
+private:
+	const group_t *_groups;
+	size_t _groupCount;
+	const triangle_t *_triangles;
+	const face_attr_t *_attributes;
+	size_t _faceCount;
+	const material_t *_materials;
+	size_t _materialCount;
+	const bvh_node_t *_nodes;
+	size_t _nodeCount;
+	const emitter_t *_emitters;
+	size_t _emitterCount;
+	const instance_t *_instances;
+	size_t _instanceCount;
+	const bvh_node_t *_topNodes;
+	size_t _topNodeCount;
+
+	std::vector<Source> _sources;
+
+	// storage when built in memory, otherwise the mapped cache
+	std::vector<group_t> _groupStorage;
+	std::vector<triangle_t> _triangleStorage;
+	std::vector<face_attr_t> _attributeStorage;
+	std::vector<material_t> _materialStorage;
+	std::vector<bvh_node_t> _nodeStorage;
+	std::vector<emitter_t> _emitterStorage;
+	std::vector<instance_t> _instanceStorage;
+	std::vector<bvh_node_t> _topNodeStorage;
+	MappedFile _file;
+	std::string _scratchFileName;	// removed again by clear()
+
+	// for update(): leaf slot of every Scene face, the slots of every mesh,
+	// and the node parents and leaf of every slot, built on the first update
+	std::vector<size_t> _faceSlots;
+	std::vector<SceneMesh> _meshes;
+	std::vector<int> _parents;
+	std::vector<int> _leafOf;
+	DirtyRanges _dirty[SectionCount];
+};
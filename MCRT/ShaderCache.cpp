@@ -0,0 +1,161 @@
+#include "ShaderCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+static const char Magic[8] = { 'M', 'C', 'R', 'T', 'S', 'H', 'D', 'R' };
+
+struct shader_cache_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint64_t clock;
+};
+
+struct shader_cache_entry_t {
+	uint64_t key;
+	uint64_t driver;
+	uint64_t used;
+	uint32_t format;
+	uint32_t size;
+};
+
+ShaderCache::ShaderCache() : _driver(0), _clock(0), _changed(false)
+{
+}
+
+bool ShaderCache::load(const char *fileName, uint64_t driver)
+{
+	clear();
+	_driver = driver;
+	FILE *fp = fopen(fileName, "rb");
+	if (fp == NULL) {
+		return false;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long remaining = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	shader_cache_header_t header;
+	bool ok = fread(&header, sizeof(header), 1, fp) == 1
+		&& memcmp(header.magic, Magic, sizeof(Magic)) == 0
+		&& header.version == Version;
+	remaining -= (long)sizeof(header);
+	ok = ok && remaining >= 0;
+	if (ok) _clock = header.clock;
+	vector<char> binary;
+	for (uint32_t i = 0; ok && i < header.count; i++) {
+		shader_cache_entry_t entry;
+		ok = fread(&entry, sizeof(entry), 1, fp) == 1;
+		remaining -= (long)sizeof(entry);
+		// a size past the end of the file is corrupt, don't try to allocate it
+		ok = ok && entry.size <= (unsigned long)remaining;
+		if (!ok) break;
+		remaining -= (long)entry.size;
+		binary.resize(entry.size);
+		ok = entry.size == 0 || fread(binary.data(), entry.size, 1, fp) == 1;
+		if (entry.driver != driver) {
+			// built by another driver, it can never load again
+			_changed = true;
+			continue;
+		}
+		Entry &e = _entries[entry.key];
+		e.format = entry.format;
+		e.used = entry.used;
+		e.binary.swap(binary);
+	}
+	fclose(fp);
+
+	// a stale or truncated cache is rebuilt as if it were missing
+	if (!ok) {
+		_entries.clear();
+		_clock = 0;
+		_changed = true;
+	}
+	return ok;
+}
+
+bool ShaderCache::save(const char *fileName)
+{
+	// least recently used entries past the limit are left out
+	vector<const pair<const uint64_t, Entry> *> order;
+	for (auto &kv : _entries) {
+		order.push_back(&kv);
+	}
+	sort(order.begin(), order.end(), [](const pair<const uint64_t, Entry> *a, const pair<const uint64_t, Entry> *b) {
+		return a->second.used > b->second.used;
+	});
+	if (order.size() > MaxEntries) order.resize(MaxEntries);
+
+	// write next to the target and rename, so readers never see a partial file
+	string tmpFileName = string(fileName) + ".tmp";
+	FILE *fp = fopen(tmpFileName.c_str(), "wb");
+	if (fp == NULL) {
+		cout << "Error: cannot write shader cache: " << fileName << endl;
+		return false;
+	}
+
+	shader_cache_header_t header;
+	memcpy(header.magic, Magic, sizeof(Magic));
+	header.version = Version;
+	header.count = (uint32_t)order.size();
+	header.clock = _clock;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	for (auto *kv : order) {
+		const Entry &e = kv->second;
+		shader_cache_entry_t entry;
+		entry.key = kv->first;
+		entry.driver = _driver;
+		entry.used = e.used;
+		entry.format = e.format;
+		entry.size = (uint32_t)e.binary.size();
+		ok = ok && fwrite(&entry, sizeof(entry), 1, fp) == 1;
+		ok = ok && (entry.size == 0 || fwrite(e.binary.data(), entry.size, 1, fp) == 1);
+	}
+	ok = fclose(fp) == 0 && ok;
+
+	if (ok) {
+		remove(fileName);
+		ok = rename(tmpFileName.c_str(), fileName) == 0;
+	}
+	if (!ok) {
+		cout << "Error: cannot write shader cache: " << fileName << endl;
+		remove(tmpFileName.c_str());
+	}
+	_changed = _changed && !ok;
+	return ok;
+}
+
+void ShaderCache::clear()
+{
+	_entries.clear();
+	_clock = 0;
+	_changed = false;
+}
+
+bool ShaderCache::find(uint64_t key, uint32_t &format, vector<char> &binary)
+{
+	auto it = _entries.find(key);
+	if (it == _entries.end()) return false;
+	format = it->second.format;
+	binary = it->second.binary;
+	// recency only needs saving once the entry drifts toward eviction
+	if (_clock - it->second.used >= MaxEntries / 2) _changed = true;
+	it->second.used = ++_clock;
+	return true;
+}
+
+void ShaderCache::store(uint64_t key, uint32_t format, vector<char> binary)
+{
+	Entry &e = _entries[key];
+	e.format = format;
+	e.used = ++_clock;
+	e.binary = move(binary);
+	_changed = true;
+}
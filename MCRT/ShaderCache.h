@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Linked GL program binaries (glGetProgramBinary) kept in one file between
+// runs. Entries are keyed by a hash of the driver (vendor, renderer and
+// version strings) and of the complete source of every stage, defines and
+// includes expanded, so any edit or new variant misses and a driver update
+// usually does; a binary the driver still rejects is simply recompiled.
+// Loading drops the entries of other drivers, and saving keeps only the
+// MaxEntries most recently used ones, so outdated sources age out.
+//
+// File layout (little endian): shader_cache_header_t, then per entry a
+// shader_cache_entry_t followed by `size` bytes of binary.
+class ShaderCache
+{
+public:
+	ShaderCache();
+
+	// A missing or unreadable file leaves the cache empty.
+	bool load(const char *fileName, uint64_t driver);
+	bool save(const char *fileName);
+	void clear();
+
+	bool find(uint64_t key, uint32_t &format, std::vector<char> &binary);
+	void store(uint64_t key, uint32_t format, std::vector<char> binary);
+	bool changed() const { return _changed; }
+
+	static const uint32_t Version = 2;
+	static const uint32_t MaxEntries = 128;
+
+private:
+	struct Entry {
+		uint32_t format;
+		uint64_t used;
+		std::vector<char> binary;
+	};
+
+	std::map<uint64_t, Entry> _entries;
+	uint64_t _driver;
+	uint64_t _clock;
+	bool _changed;
+};
@@ -0,0 +1,450 @@
+#include "SimdKernels.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <limits>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MCRT_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// GCC would fuse mul/add pairs into FMA once AVX-512 is enabled, which
+// changes rounding against the scalar kernel.
+#if defined(__clang__)
+#define MCRT_TARGET(x) __attribute__((target(x)))
+#elif defined(__GNUC__)
+#define MCRT_TARGET(x) __attribute__((target(x), optimize("fp-contract=off")))
+#else
+#define MCRT_TARGET(x)
+#endif
+
+using namespace std;
+
+#define EPS 0.000001f
+
+// ---------------------------------------------------------------- scalar
+
+static bool intersectPackScalar(const SimdRay &r, const float *pack, SimdHit &hit)
+{
+	const int W = 4;
+	bool found = false;
+	for (int i = 0; i < W; i++) {
+		float v0x = pack[i], v0y = pack[W + i], v0z = pack[2 * W + i];
+		float e1x = pack[3 * W + i], e1y = pack[4 * W + i], e1z = pack[5 * W + i];
+		float e2x = pack[6 * W + i], e2y = pack[7 * W + i], e2z = pack[8 * W + i];
+
+		float px = r.dy * e2z - r.dz * e2y;
+		float py = r.dz * e2x - r.dx * e2z;
+		float pz = r.dx * e2y - r.dy * e2x;
+		float det = e1x * px + e1y * py + e1z * pz;
+		if (fabsf(det) < EPS) continue;
+		float inv = 1.0f / det;
+
+		float tx = r.ox - v0x, ty = r.oy - v0y, tz = r.oz - v0z;
+		float u = (tx * px + ty * py + tz * pz) * inv;
+		if (u < -EPS || u > 1.0f + EPS) continue;
+		float qx = ty * e1z - tz * e1y;
+		float qy = tz * e1x - tx * e1z;
+		float qz = tx * e1y - ty * e1x;
+		float v = (r.dx * qx + r.dy * qy + r.dz * qz) * inv;
+		if (v < -EPS || u + v > 1.0f + EPS) continue;
+		float d = (e2x * qx + e2y * qy + e2z * qz) * inv;
+		if (d > EPS && d < hit.dist) {
+			int index;
+			memcpy(&index, &pack[9 * W + i], sizeof(int));
+			hit.dist = d;
+			hit.u = u;
+			hit.v = v;
+			hit.index = index;
+			found = true;
+		}
+	}
+	return found;
+}
+
+static int intersectBoxPacketScalar(const RayPacket &r, int active, const bvh_node_t &node, float *tNear)
+{
+	int mask = 0;
+	for (int i = 0; i < RayPacket::Size; i++) {
+		if (!(active & (1 << i))) continue;
+		float t0x = (node.vmin[0] - r.ox[i]) * r.idx[i], t1x = (node.vmax[0] - r.ox[i]) * r.idx[i];
+		float t0y = (node.vmin[1] - r.oy[i]) * r.idy[i], t1y = (node.vmax[1] - r.oy[i]) * r.idy[i];
+		float t0z = (node.vmin[2] - r.oz[i]) * r.idz[i], t1z = (node.vmax[2] - r.oz[i]) * r.idz[i];
+		float n = max(max(max(min(t0x, t1x), min(t0y, t1y)), min(t0z, t1z)), 0.0f);
+		float f = min(min(min(max(t0x, t1x), max(t0y, t1y)), max(t0z, t1z)), r.tmax[i]);
+		tNear[i] = n;
+		if (n <= f) mask |= 1 << i;
+	}
+	return mask;
+}
+
+#ifdef MCRT_X86
+
+// ------------------------------------------------------------------- sse
+
+MCRT_TARGET("sse4.1")
+static bool intersectPackSse(const SimdRay &r, const float *pack, SimdHit &hit)
+{
+	const int W = 4;
+	const __m128 eps = _mm_set1_ps(EPS), negEps = _mm_set1_ps(-EPS);
+	const __m128 onePlusEps = _mm_set1_ps(1.0f + EPS), one = _mm_set1_ps(1.0f);
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 dx = _mm_set1_ps(r.dx), dy = _mm_set1_ps(r.dy), dz = _mm_set1_ps(r.dz);
+
+	__m128 v0x = _mm_loadu_ps(pack), v0y = _mm_loadu_ps(pack + W), v0z = _mm_loadu_ps(pack + 2 * W);
+	__m128 e1x = _mm_loadu_ps(pack + 3 * W), e1y = _mm_loadu_ps(pack + 4 * W), e1z = _mm_loadu_ps(pack + 5 * W);
+	__m128 e2x = _mm_loadu_ps(pack + 6 * W), e2y = _mm_loadu_ps(pack + 7 * W), e2z = _mm_loadu_ps(pack + 8 * W);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 mask = _mm_cmpnlt_ps(_mm_and_ps(det, absMask), eps);
+	if (!_mm_movemask_ps(mask)) return false;
+	__m128 inv = _mm_div_ps(one, det);
+
+	__m128 tx = _mm_sub_ps(_mm_set1_ps(r.ox), v0x);
+	__m128 ty = _mm_sub_ps(_mm_set1_ps(r.oy), v0y);
+	__m128 tz = _mm_sub_ps(_mm_set1_ps(r.oz), v0z);
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv);
+	mask = _mm_andnot_ps(_mm_or_ps(_mm_cmplt_ps(u, negEps), _mm_cmpgt_ps(u, onePlusEps)), mask);
+	if (!_mm_movemask_ps(mask)) return false;
+
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+	mask = _mm_andnot_ps(_mm_or_ps(_mm_cmplt_ps(v, negEps), _mm_cmpgt_ps(_mm_add_ps(u, v), onePlusEps)), mask);
+	__m128 d = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(d, eps), _mm_cmplt_ps(d, _mm_set1_ps(hit.dist))));
+	int bits = _mm_movemask_ps(mask);
+	if (!bits) return false;
+
+	// first lane holding the minimum, like a sequential strict-less scan
+	alignas(16) float dist[4], us[4], vs[4];
+	_mm_store_ps(dist, d);
+	_mm_store_ps(us, u);
+	_mm_store_ps(vs, v);
+	int best = -1;
+	for (int i = 0; i < W; i++) {
+		if ((bits >> i) & 1 && (best < 0 || dist[i] < dist[best])) best = i;
+	}
+	hit.dist = dist[best];
+	hit.u = us[best];
+	hit.v = vs[best];
+	memcpy(&hit.index, &pack[9 * W + best], sizeof(int));
+	return true;
+}
+
+MCRT_TARGET("sse4.1")
+static int intersectBoxPacketSse(const RayPacket &r, int active, const bvh_node_t &node, float *tNear)
+{
+	int mask = 0;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 minx = _mm_set1_ps(node.vmin[0]), miny = _mm_set1_ps(node.vmin[1]), minz = _mm_set1_ps(node.vmin[2]);
+	const __m128 maxx = _mm_set1_ps(node.vmax[0]), maxy = _mm_set1_ps(node.vmax[1]), maxz = _mm_set1_ps(node.vmax[2]);
+	for (int k = 0; k < RayPacket::Size; k += 4) {
+		if (!((active >> k) & 0xF)) continue;
+		__m128 ox = _mm_loadu_ps(r.ox + k), oy = _mm_loadu_ps(r.oy + k), oz = _mm_loadu_ps(r.oz + k);
+		__m128 ix = _mm_loadu_ps(r.idx + k), iy = _mm_loadu_ps(r.idy + k), iz = _mm_loadu_ps(r.idz + k);
+		__m128 t0x = _mm_mul_ps(_mm_sub_ps(minx, ox), ix), t1x = _mm_mul_ps(_mm_sub_ps(maxx, ox), ix);
+		__m128 t0y = _mm_mul_ps(_mm_sub_ps(miny, oy), iy), t1y = _mm_mul_ps(_mm_sub_ps(maxy, oy), iy);
+		__m128 t0z = _mm_mul_ps(_mm_sub_ps(minz, oz), iz), t1z = _mm_mul_ps(_mm_sub_ps(maxz, oz), iz);
+		__m128 n = _mm_max_ps(_mm_max_ps(_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)), _mm_min_ps(t0z, t1z)), zero);
+		__m128 f = _mm_min_ps(_mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_max_ps(t0z, t1z)), _mm_loadu_ps(r.tmax + k));
+		_mm_storeu_ps(tNear + k, n);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(n, f)) << k;
+	}
+	return mask & active;
+}
+
+// ------------------------------------------------------------------ avx2
+
+MCRT_TARGET("avx2")
+static bool intersectPackAvx2(const SimdRay &r, const float *pack, SimdHit &hit)
+{
+	const int W = 8;
+	const __m256 eps = _mm256_set1_ps(EPS), negEps = _mm256_set1_ps(-EPS);
+	const __m256 onePlusEps = _mm256_set1_ps(1.0f + EPS), one = _mm256_set1_ps(1.0f);
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 dx = _mm256_set1_ps(r.dx), dy = _mm256_set1_ps(r.dy), dz = _mm256_set1_ps(r.dz);
+
+	__m256 v0x = _mm256_loadu_ps(pack), v0y = _mm256_loadu_ps(pack + W), v0z = _mm256_loadu_ps(pack + 2 * W);
+	__m256 e1x = _mm256_loadu_ps(pack + 3 * W), e1y = _mm256_loadu_ps(pack + 4 * W), e1z = _mm256_loadu_ps(pack + 5 * W);
+	__m256 e2x = _mm256_loadu_ps(pack + 6 * W), e2y = _mm256_loadu_ps(pack + 7 * W), e2z = _mm256_loadu_ps(pack + 8 * W);
+
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+	__m256 mask = _mm256_cmp_ps(_mm256_and_ps(det, absMask), eps, _CMP_NLT_UQ);
+	if (!_mm256_movemask_ps(mask)) return false;
+	__m256 inv = _mm256_div_ps(one, det);
+
+	__m256 tx = _mm256_sub_ps(_mm256_set1_ps(r.ox), v0x);
+	__m256 ty = _mm256_sub_ps(_mm256_set1_ps(r.oy), v0y);
+	__m256 tz = _mm256_sub_ps(_mm256_set1_ps(r.oz), v0z);
+	__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv);
+	mask = _mm256_andnot_ps(_mm256_or_ps(_mm256_cmp_ps(u, negEps, _CMP_LT_OQ), _mm256_cmp_ps(u, onePlusEps, _CMP_GT_OQ)), mask);
+	if (!_mm256_movemask_ps(mask)) return false;
+
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+	__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv);
+	mask = _mm256_andnot_ps(_mm256_or_ps(_mm256_cmp_ps(v, negEps, _CMP_LT_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), onePlusEps, _CMP_GT_OQ)), mask);
+	__m256 d = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv);
+	mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(d, eps, _CMP_GT_OQ), _mm256_cmp_ps(d, _mm256_set1_ps(hit.dist), _CMP_LT_OQ)));
+	int bits = _mm256_movemask_ps(mask);
+	if (!bits) return false;
+
+	alignas(32) float dist[8], us[8], vs[8];
+	_mm256_store_ps(dist, d);
+	_mm256_store_ps(us, u);
+	_mm256_store_ps(vs, v);
+	int best = -1;
+	for (int i = 0; i < W; i++) {
+		if ((bits >> i) & 1 && (best < 0 || dist[i] < dist[best])) best = i;
+	}
+	hit.dist = dist[best];
+	hit.u = us[best];
+	hit.v = vs[best];
+	memcpy(&hit.index, &pack[9 * W + best], sizeof(int));
+	return true;
+}
+
+MCRT_TARGET("avx2")
+static int intersectBoxPacketAvx2(const RayPacket &r, int active, const bvh_node_t &node, float *tNear)
+{
+	const __m256 ox = _mm256_loadu_ps(r.ox), oy = _mm256_loadu_ps(r.oy), oz = _mm256_loadu_ps(r.oz);
+	const __m256 ix = _mm256_loadu_ps(r.idx), iy = _mm256_loadu_ps(r.idy), iz = _mm256_loadu_ps(r.idz);
+	__m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.vmin[0]), ox), ix);
+	__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.vmax[0]), ox), ix);
+	__m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.vmin[1]), oy), iy);
+	__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.vmax[1]), oy), iy);
+	__m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.vmin[2]), oz), iz);
+	__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.vmax[2]), oz), iz);
+	__m256 n = _mm256_max_ps(_mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t0x, t1x), _mm256_min_ps(t0y, t1y)), _mm256_min_ps(t0z, t1z)), _mm256_setzero_ps());
+	__m256 f = _mm256_min_ps(_mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t0x, t1x), _mm256_max_ps(t0y, t1y)), _mm256_max_ps(t0z, t1z)), _mm256_loadu_ps(r.tmax));
+	_mm256_storeu_ps(tNear, n);
+	return _mm256_movemask_ps(_mm256_cmp_ps(n, f, _CMP_LE_OQ)) & active;
+}
+
+// --------------------------------------------------------------- avx-512
+
+MCRT_TARGET("avx512f")
+static bool intersectPackAvx512(const SimdRay &r, const float *pack, SimdHit &hit)
+{
+	const int W = 16;
+	const __m512 eps = _mm512_set1_ps(EPS), negEps = _mm512_set1_ps(-EPS);
+	const __m512 onePlusEps = _mm512_set1_ps(1.0f + EPS), one = _mm512_set1_ps(1.0f);
+	const __m512 dx = _mm512_set1_ps(r.dx), dy = _mm512_set1_ps(r.dy), dz = _mm512_set1_ps(r.dz);
+
+	__m512 v0x = _mm512_loadu_ps(pack), v0y = _mm512_loadu_ps(pack + W), v0z = _mm512_loadu_ps(pack + 2 * W);
+	__m512 e1x = _mm512_loadu_ps(pack + 3 * W), e1y = _mm512_loadu_ps(pack + 4 * W), e1z = _mm512_loadu_ps(pack + 5 * W);
+	__m512 e2x = _mm512_loadu_ps(pack + 6 * W), e2y = _mm512_loadu_ps(pack + 7 * W), e2z = _mm512_loadu_ps(pack + 8 * W);
+
+	__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+	__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+	__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+	__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+	__m512 absDet = _mm512_castsi512_ps(_mm512_and_epi32(_mm512_castps_si512(det), _mm512_set1_epi32(0x7fffffff)));
+	__mmask16 mask = _mm512_cmp_ps_mask(absDet, eps, _CMP_NLT_UQ);
+	if (!mask) return false;
+	__m512 inv = _mm512_div_ps(one, det);
+
+	__m512 tx = _mm512_sub_ps(_mm512_set1_ps(r.ox), v0x);
+	__m512 ty = _mm512_sub_ps(_mm512_set1_ps(r.oy), v0y);
+	__m512 tz = _mm512_sub_ps(_mm512_set1_ps(r.oz), v0z);
+	__m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px), _mm512_mul_ps(ty, py)), _mm512_mul_ps(tz, pz)), inv);
+	mask &= ~(_mm512_cmp_ps_mask(u, negEps, _CMP_LT_OQ) | _mm512_cmp_ps_mask(u, onePlusEps, _CMP_GT_OQ));
+	if (!mask) return false;
+
+	__m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(tz, e1y));
+	__m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(tx, e1z));
+	__m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(ty, e1x));
+	__m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)), inv);
+	mask &= ~(_mm512_cmp_ps_mask(v, negEps, _CMP_LT_OQ) | _mm512_cmp_ps_mask(_mm512_add_ps(u, v), onePlusEps, _CMP_GT_OQ));
+	__m512 d = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)), inv);
+	mask &= _mm512_cmp_ps_mask(d, eps, _CMP_GT_OQ) & _mm512_cmp_ps_mask(d, _mm512_set1_ps(hit.dist), _CMP_LT_OQ);
+	if (!mask) return false;
+
+	// first lane holding the minimum, like a sequential strict-less scan
+	__m512 masked = _mm512_mask_blend_ps(mask, _mm512_set1_ps(hit.dist), d);
+	float best = _mm512_reduce_min_ps(masked);
+	unsigned int lanes = mask & _mm512_cmp_ps_mask(masked, _mm512_set1_ps(best), _CMP_EQ_OQ);
+	int lane = 0;
+	while (!((lanes >> lane) & 1)) lane++;
+	__m512i sel = _mm512_set1_epi32(lane);
+	hit.dist = best;
+	hit.u = _mm_cvtss_f32(_mm512_castps512_ps128(_mm512_permutexvar_ps(sel, u)));
+	hit.v = _mm_cvtss_f32(_mm512_castps512_ps128(_mm512_permutexvar_ps(sel, v)));
+	memcpy(&hit.index, &pack[9 * W + lane], sizeof(int));
+	return true;
+}
+
+// ------------------------------------------------------------- detection
+
+static void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+	__cpuidex((int *)regs, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long xgetbv0()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+static bool cpuSupports(const char *name)
+{
+	unsigned int r1[4], r7[4] = { 0 }, r0[4];
+	cpuid(0, 0, r0);
+	cpuid(1, 0, r1);
+	if (r0[0] >= 7) cpuid(7, 0, r7);
+
+	bool sse41 = (r1[2] >> 19) & 1;
+	bool osxsave = (r1[2] >> 27) & 1;
+	unsigned long long xcr0 = osxsave ? xgetbv0() : 0;
+	bool avxState = (xcr0 & 0x6) == 0x6;
+	bool avx512State = (xcr0 & 0xE6) == 0xE6;
+
+	if (strcmp(name, "sse") == 0) return sse41;
+	if (strcmp(name, "avx2") == 0) return avxState && ((r1[2] >> 28) & 1) && ((r7[1] >> 5) & 1);
+	if (strcmp(name, "avx512") == 0) return avx512State && ((r7[1] >> 16) & 1) && cpuSupports("avx2");
+	return false;
+}
+
+#endif
+
+static const SimdKernels KernelTable[] = {
+#ifdef MCRT_X86
+	{ "avx512", 16, intersectPackAvx512, intersectBoxPacketAvx2 },
+	{ "avx2", 8, intersectPackAvx2, intersectBoxPacketAvx2 },
+	{ "sse", 4, intersectPackSse, intersectBoxPacketSse },
+#endif
+	{ "scalar", 4, intersectPackScalar, intersectBoxPacketScalar },
+};
+
+static bool isSupported(const SimdKernels &k)
+{
+	if (strcmp(k.name, "scalar") == 0) return true;
+#ifdef MCRT_X86
+	return cpuSupports(k.name);
+#else
+	return false;
+#endif
+}
+
+const SimdKernels *findSimdKernels(const char *name)
+{
+	for (auto &k : KernelTable) {
+		if (strcmp(k.name, name) == 0) {
+			return isSupported(k) ? &k : nullptr;
+		}
+	}
+	return nullptr;
+}
+
+const SimdKernels &selectSimdKernels()
+{
+	static const SimdKernels *selected = []() {
+		const char *forced = getenv("MCRT_SIMD");
+		if (forced) {
+			const SimdKernels *k = findSimdKernels(forced);
+			if (k) return k;
+		}
+		for (auto &k : KernelTable) {
+			if (isSupported(k)) return &k;
+		}
+		return &KernelTable[0];
+	}();
+	return *selected;
+}
+
+void buildTrianglePacks(
+	const SimdKernels &kernels,
+	const triangle_t *triangles,
+	const bvh_node_t *nodes, size_t nodeCount,
+	vector<bvh_node_t> &packNodes,
+	vector<float> &packs,
+	vector<int> &leafPacks)
+{
+	const int W = kernels.width;
+	const size_t stride = kernels.packStride();
+
+	// leaves are in depth-first order, so every subtree covers a contiguous
+	// triangle range; children always follow their parent
+	// and occupy the node range [n, n + subtree[n])
+	vector<int> first(nodeCount), total(nodeCount), subtree(nodeCount);
+	for (size_t n = nodeCount; n-- > 0;) {
+		// a lone root with count 0 is the empty tree, not an inner node
+		if (nodes[n].count > 0 || n + 1 == nodeCount) {
+			first[n] = nodes[n].start;
+			total[n] = nodes[n].count;
+			subtree[n] = 1;
+		}
+		else {
+			first[n] = first[n + 1];
+			total[n] = total[n + 1] + total[nodes[n].start];
+			subtree[n] = 1 + subtree[n + 1] + subtree[nodes[n].start];
+		}
+	}
+
+	// only leaves reachable after collapsing get packs
+	size_t packCount = 0;
+	packNodes.assign(nodes, nodes + nodeCount);
+	leafPacks.assign(nodeCount, -1);
+	for (size_t n = 0; n < nodeCount;) {
+		if (nodes[n].count == 0 && (total[n] == 0 || total[n] > W)) {
+			n++;
+			continue;
+		}
+		packNodes[n].start = first[n];
+		packNodes[n].count = total[n];
+		leafPacks[n] = (int)packCount;
+		packCount += (total[n] + W - 1) / W;
+		n += subtree[n];
+	}
+
+	// zeroed lanes are degenerate triangles, which every kernel rejects
+	packs.assign(packCount * stride, 0.0f);
+	for (size_t n = 0; n < nodeCount; n++) {
+		const bvh_node_t &node = packNodes[n];
+		if (leafPacks[n] < 0) continue;
+		float *pack = &packs[leafPacks[n] * stride];
+		for (int i = 0; i < node.count; i++) {
+			int lane = i % W;
+			if (i && lane == 0) pack += stride;
+			int index = node.start + i;
+			const triangle_t &t = triangles[index];
+			const float src[9] = {
+				t.v0[0], t.v0[1], t.v0[2],
+				t.e1[0], t.e1[1], t.e1[2],
+				t.e2[0], t.e2[1], t.e2[2]
+			};
+			for (int k = 0; k < 9; k++) pack[k * W + lane] = src[k];
+			memcpy(&pack[9 * W + lane], &index, sizeof(int));
+		}
+		for (int i = node.count % W; i && i < W; i++) {
+			int none = -1;
+			memcpy(&pack[9 * W + i], &none, sizeof(int));
+		}
+	}
+}
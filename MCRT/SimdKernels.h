@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Scene.h"
+#include "BVH.h"
+
+#include <vector>
+
+// Ray/primitive kernels for CpuTracer. Triangles are regrouped into SoA
+// packs of `width` lanes:
+//   v0x[w] v0y[w] v0z[w] e1x[w] e1y[w] e1z[w] e2x[w] e2y[w] e2z[w] index[w]
+// with the index stored as int bits and unused lanes padded with degenerate
+// triangles. Every variant performs the same IEEE operations in the same
+// order as the scalar one, so results agree exactly lane by lane.
+
+struct SimdRay
+{
+	float ox, oy, oz;
+	float dx, dy, dz;
+};
+
+struct SimdHit
+{
+	float dist;
+	float u, v;
+	int index;
+};
+
+// Eight coherent rays in SoA layout, tested together against BVH nodes.
+struct RayPacket
+{
+	static const int Size = 8;
+
+	float ox[Size], oy[Size], oz[Size];
+	float dx[Size], dy[Size], dz[Size];
+	float idx[Size], idy[Size], idz[Size];
+	float tmax[Size];
+};
+
+// Returns true and updates `hit` when a lane is hit closer than hit.dist.
+typedef bool (*IntersectPackFn)(const SimdRay &ray, const float *pack, SimdHit &hit);
+
+// Returns the subset of `active` lanes whose [0, tmax] overlaps the node box
+// and writes their entry distances to tNear.
+typedef int (*IntersectBoxPacketFn)(const RayPacket &rays, int active, const bvh_node_t &node, float *tNear);
+
+struct SimdKernels
+{
+	const char *name;
+	int width;
+	IntersectPackFn intersectPack;
+	IntersectBoxPacketFn intersectBoxPacket;
+
+	size_t packStride() const { return (size_t)width * 10; }
+};
+
+// Best kernel set supported by the CPU, picked once through CPUID. Setting
+// MCRT_SIMD=scalar|sse|avx2|avx512 forces a (supported) variant.
+const SimdKernels &selectSimdKernels();
+const SimdKernels *findSimdKernels(const char *name);
+
+// Packs the triangles of every BVH leaf. Subtrees holding no more triangles
+// than one pack are first collapsed into a single leaf, so `packNodes` is a
+// copy of the tree with the same indices but possibly wider leaves.
+// leafPacks[node] receives the first pack of a leaf; the leaf uses
+// ceil(count / width) consecutive packs.
+void buildTrianglePacks(
+	const SimdKernels &kernels,
+	const triangle_t *triangles,
+	const bvh_node_t *nodes, size_t nodeCount,
+	std::vector<bvh_node_t> &packNodes,
+	std::vector<float> &packs,
+	std::vector<int> &leafPacks);
@@ -0,0 +1,271 @@
+#include "Socket.h"
+
+#include <iostream>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#define closeSocket closesocket
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+#define closeSocket ::close
+#endif
+
+using namespace std;
+
+static bool initSockets()
+{
+#ifdef _WIN32
+	static bool ok = []() {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+	return ok;
+#else
+	// a worker that vanished must surface as a failed send, not kill us
+	static bool ok = []() {
+		signal(SIGPIPE, SIG_IGN);
+		return true;
+	}();
+	return ok;
+#endif
+}
+
+static bool splitAddress(const char *address, string &host, string &port)
+{
+	string s(address);
+	size_t colon = s.rfind(':');
+	if (colon == string::npos || colon + 1 == s.size()) {
+		cout << "Error: expected host:port, got " << address << endl;
+		return false;
+	}
+	host = s.substr(0, colon);
+	port = s.substr(colon + 1);
+	return true;
+}
+
+Socket::Socket() : _fd(InvalidSocket) {}
+
+Socket::~Socket()
+{
+	close();
+}
+
+Socket::Socket(Socket &&other) : _fd(other._fd), _unixPath(move(other._unixPath))
+{
+	other._fd = InvalidSocket;
+	other._unixPath.clear();
+}
+
+Socket &Socket::operator=(Socket &&other)
+{
+	if (this != &other) {
+		close();
+		_fd = other._fd;
+		_unixPath = move(other._unixPath);
+		other._fd = InvalidSocket;
+		other._unixPath.clear();
+	}
+	return *this;
+}
+
+bool Socket::listen(const char *address)
+{
+	close();
+	if (!initSockets()) return false;
+
+	if (strncmp(address, "unix:", 5) == 0) {
+#ifdef _WIN32
+		cout << "Error: Unix sockets are not supported on Windows: " << address << endl;
+		return false;
+#else
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(address + 5) >= sizeof(addr.sun_path)) {
+			cout << "Error: socket path too long: " << address << endl;
+			return false;
+		}
+		strcpy(addr.sun_path, address + 5);
+		unlink(addr.sun_path);
+		_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (_fd == InvalidSocket || ::bind(_fd, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(_fd, 64) != 0) {
+			cout << "Error: cannot listen on " << address << endl;
+			close();
+			return false;
+		}
+		_unixPath = addr.sun_path;
+		return true;
+#endif
+	}
+
+	string host, port;
+	if (!splitAddress(address, host, port)) return false;
+	addrinfo hints, *info = nullptr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &info) != 0) {
+		cout << "Error: cannot resolve " << address << endl;
+		return false;
+	}
+	_fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+	int yes = 1;
+	bool ok = _fd != InvalidSocket
+		&& setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, (const char *)&yes, sizeof(yes)) == 0
+		&& ::bind(_fd, info->ai_addr, (socklen_t)info->ai_addrlen) == 0
+		&& ::listen(_fd, 64) == 0;
+	freeaddrinfo(info);
+	if (!ok) {
+		cout << "Error: cannot listen on " << address << endl;
+		close();
+	}
+	return ok;
+}
+
+bool Socket::connect(const char *address)
+{
+	close();
+	if (!initSockets()) return false;
+
+	if (strncmp(address, "unix:", 5) == 0) {
+#ifdef _WIN32
+		cout << "Error: Unix sockets are not supported on Windows: " << address << endl;
+		return false;
+#else
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, address + 5, sizeof(addr.sun_path) - 1);
+		_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (_fd == InvalidSocket || ::connect(_fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+			close();
+			return false;
+		}
+		return true;
+#endif
+	}
+
+	string host, port;
+	if (!splitAddress(address, host, port)) return false;
+	addrinfo hints, *info = nullptr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &info) != 0) {
+		cout << "Error: cannot resolve " << address << endl;
+		return false;
+	}
+	for (addrinfo *a = info; a != nullptr; a = a->ai_next) {
+		_fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (_fd != InvalidSocket && ::connect(_fd, a->ai_addr, (socklen_t)a->ai_addrlen) == 0) break;
+		close();
+	}
+	freeaddrinfo(info);
+	if (_fd == InvalidSocket) return false;
+
+	// requests are small and latency bound
+	int yes = 1;
+	setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&yes, sizeof(yes));
+	return true;
+}
+
+bool Socket::accept(Socket &client)
+{
+	client.close();
+	Handle fd = ::accept(_fd, nullptr, nullptr);
+	if (fd == InvalidSocket) return false;
+	client._fd = fd;
+	if (_unixPath.empty()) {
+		int yes = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&yes, sizeof(yes));
+	}
+	return true;
+}
+
+void Socket::close()
+{
+	if (_fd != InvalidSocket) closeSocket(_fd);
+	_fd = InvalidSocket;
+#ifndef _WIN32
+	if (!_unixPath.empty()) unlink(_unixPath.c_str());
+#endif
+	_unixPath.clear();
+}
+
+bool Socket::_sendAll(const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	while (size > 0) {
+		int n = (int)::send(_fd, p, (int)min(size, (size_t)1 << 30), 0);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool Socket::_receiveAll(void *data, size_t size)
+{
+	char *p = (char *)data;
+	while (size > 0) {
+		int n = (int)::recv(_fd, p, (int)min(size, (size_t)1 << 30), 0);
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool Socket::sendMessage(uint32_t type, const void *data, size_t size)
+{
+	if (!isOpen() || size > MaxMessageSize) return false;
+	uint32_t header[2] = { type, (uint32_t)size };
+	return _sendAll(header, sizeof(header)) && (size == 0 || _sendAll(data, size));
+}
+
+bool Socket::receiveMessage(uint32_t &type, vector<char> &payload)
+{
+	uint32_t header[2];
+	if (!isOpen() || !_receiveAll(header, sizeof(header)) || header[1] > MaxMessageSize) {
+		return false;
+	}
+	type = header[0];
+	payload.resize(header[1]);
+	return header[1] == 0 || _receiveAll(payload.data(), header[1]);
+}
+
+vector<size_t> Socket::waitReadable(const vector<Socket *> &sockets, double timeout)
+{
+	fd_set set;
+	FD_ZERO(&set);
+	Handle maxFd = 0;
+	for (Socket *s : sockets) {
+		if (!s->isOpen()) continue;
+		FD_SET(s->_fd, &set);
+		maxFd = max(maxFd, s->_fd);
+	}
+
+	timeval tv;
+	tv.tv_sec = (long)timeout;
+	tv.tv_usec = (long)((timeout - (double)tv.tv_sec) * 1e6);
+	vector<size_t> ready;
+	if (select((int)maxFd + 1, &set, nullptr, nullptr, &tv) <= 0) return ready;
+	for (size_t i = 0; i < sockets.size(); i++) {
+		if (sockets[i]->isOpen() && FD_ISSET(sockets[i]->_fd, &set)) ready.push_back(i);
+	}
+	return ready;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Blocking stream socket over TCP ("host:port", ":port" to listen on every
+// interface) or, outside Windows, a Unix domain socket ("unix:/path").
+// Messages are framed as a 32-bit type and a 32-bit payload size followed by
+// the payload, all in host byte order: both ends must share it, which every
+// supported target (x86, ARM) does as little endian.
+class Socket
+{
+public:
+	Socket();
+	~Socket();
+
+	Socket(const Socket &) = delete;
+	Socket &operator=(const Socket &) = delete;
+	Socket(Socket &&other);
+	Socket &operator=(Socket &&other);
+
+	bool listen(const char *address);
+	bool connect(const char *address);
+	bool accept(Socket &client);
+	void close();
+
+	bool isOpen() const { return _fd != InvalidSocket; }
+
+	bool sendMessage(uint32_t type, const void *data, size_t size);
+	bool receiveMessage(uint32_t &type, std::vector<char> &payload);
+
+	// Waits up to `timeout` seconds for any of `sockets` to become readable
+	// and returns their indices; an error or timeout returns none.
+	static std::vector<size_t> waitReadable(const std::vector<Socket *> &sockets, double timeout);
+
+	static const size_t MaxMessageSize = 256 << 20;
+
+private:
+#ifdef _WIN32
+	typedef uintptr_t Handle;
+	static const Handle InvalidSocket = ~(Handle)0;
+#else
+	typedef int Handle;
+	static const Handle InvalidSocket = -1;
+#endif
+
+	bool _sendAll(const void *data, size_t size);
+	bool _receiveAll(void *data, size_t size);
+
+private:
+	Handle _fd;
+	std::string _unixPath;	// removed when a listening Unix socket closes
+};
@@ -0,0 +1,234 @@
+#include "Stats.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+Stats::Stats() : _start(Clock::now()), _dumpInterval(5), _lastDump(0)
+{
+}
+
+Stats &Stats::shared()
+{
+	static Stats stats;
+	return stats;
+}
+
+double Stats::_now() const
+{
+	return chrono::duration<double>(Clock::now() - _start).count();
+}
+
+void Stats::record(const string &stage, double ms)
+{
+	lock_guard<mutex> l(_lock);
+	Series &s = _series[stage];
+	if (s.samples.size() < Window) {
+		s.samples.push_back(ms);
+	}
+	else {
+		s.samples[s.next] = ms;
+	}
+	s.next = (s.next + 1) % Window;
+	s.count++;
+	s.last = ms;
+}
+
+void Stats::count(const string &counter, double amount)
+{
+	double now = _now();
+	lock_guard<mutex> l(_lock);
+	Counter &c = _counters[counter];
+	c.total += amount;
+	if (c.history.size() < Window) {
+		c.history.emplace_back(now, c.total);
+	}
+	else {
+		c.history[c.next] = make_pair(now, c.total);
+	}
+	c.next = (c.next + 1) % Window;
+}
+
+void Stats::reset()
+{
+	lock_guard<mutex> l(_lock);
+	_series.clear();
+	_counters.clear();
+}
+
+Stats::Summary Stats::_summarize(const string &name, const Series &s)
+{
+	Summary r = {};
+	r.name = name;
+	r.count = s.count;
+	r.last = s.last;
+	if (s.samples.empty()) return r;
+
+	vector<double> sorted(s.samples);
+	sort(sorted.begin(), sorted.end());
+	auto percentile = [&](double p) {
+		size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+		return sorted[min(i, sorted.size() - 1)];
+	};
+	double sum = 0;
+	for (double v : sorted) sum += v;
+	r.mean = sum / sorted.size();
+	r.p50 = percentile(0.5);
+	r.p90 = percentile(0.9);
+	r.p99 = percentile(0.99);
+	r.max = sorted.back();
+	return r;
+}
+
+double Stats::_rate(const Counter &c) const
+{
+	if (c.history.size() < 2) return 0;
+	// once the ring has wrapped the oldest entry is the next one overwritten
+	size_t oldest = c.history.size() < Window ? 0 : c.next;
+	size_t newest = (c.next + c.history.size() - 1) % c.history.size();
+	double span = c.history[newest].first - c.history[oldest].first;
+	return span > 0 ? (c.history[newest].second - c.history[oldest].second) / span : 0;
+}
+
+vector<Stats::Summary> Stats::summaries() const
+{
+	lock_guard<mutex> l(_lock);
+	vector<Summary> r;
+	for (auto &s : _series) r.push_back(_summarize(s.first, s.second));
+	return r;
+}
+
+bool Stats::summary(const string &stage, Summary &s) const
+{
+	lock_guard<mutex> l(_lock);
+	auto it = _series.find(stage);
+	if (it == _series.end()) return false;
+	s = _summarize(it->first, it->second);
+	return true;
+}
+
+double Stats::rate(const string &counter) const
+{
+	lock_guard<mutex> l(_lock);
+	auto it = _counters.find(counter);
+	return it != _counters.end() ? _rate(it->second) : 0;
+}
+
+double Stats::total(const string &counter) const
+{
+	lock_guard<mutex> l(_lock);
+	auto it = _counters.find(counter);
+	return it != _counters.end() ? it->second.total : 0;
+}
+
+string Stats::toJson() const
+{
+	vector<Summary> stages = summaries();
+	lock_guard<mutex> l(_lock);
+	ostringstream out;
+	out << "{\"time\": " << _now() << ", \"stages\": {";
+	for (size_t i = 0; i < stages.size(); i++) {
+		const Summary &s = stages[i];
+		out << (i ? ", " : "") << "\"" << s.name << "\": {"
+			<< "\"count\": " << s.count
+			<< ", \"last_ms\": " << s.last
+			<< ", \"mean_ms\": " << s.mean
+			<< ", \"p50_ms\": " << s.p50
+			<< ", \"p90_ms\": " << s.p90
+			<< ", \"p99_ms\": " << s.p99
+			<< ", \"max_ms\": " << s.max << "}";
+	}
+	out << "}, \"counters\": {";
+	bool first = true;
+	for (auto &c : _counters) {
+		out << (first ? "" : ", ") << "\"" << c.first << "\": {"
+			<< "\"total\": " << c.second.total
+			<< ", \"per_second\": " << _rate(c.second) << "}";
+		first = false;
+	}
+	out << "}}\n";
+	return out.str();
+}
+
+string Stats::toCsv(bool header) const
+{
+	vector<Summary> stages = summaries();
+	lock_guard<mutex> l(_lock);
+	ostringstream out;
+	double now = _now();
+	if (header) {
+		out << "time,name,count,last_ms,mean_ms,p50_ms,p90_ms,p99_ms,max_ms,total,per_second\n";
+	}
+	for (const Summary &s : stages) {
+		out << now << "," << s.name << "," << s.count << "," << s.last << "," << s.mean << ","
+			<< s.p50 << "," << s.p90 << "," << s.p99 << "," << s.max << ",,\n";
+	}
+	for (auto &c : _counters) {
+		out << now << "," << c.first << ",,,,,,,," << c.second.total << "," << _rate(c.second) << "\n";
+	}
+	return out.str();
+}
+
+bool Stats::dump(const char *fileName) const
+{
+	const char *dot = strrchr(fileName, '.');
+	bool csv = dot && (strcmp(dot, ".csv") == 0 || strcmp(dot, ".CSV") == 0);
+
+	FILE *fp = fopen(fileName, csv ? "ab" : "wb");
+	if (fp == NULL) {
+		cout << "Error: cannot open stats file for writing: " << fileName << endl;
+		return false;
+	}
+	fseek(fp, 0, SEEK_END);
+	string text = csv ? toCsv(ftell(fp) == 0) : toJson();
+	fwrite(text.data(), 1, text.size(), fp);
+	bool ok = ferror(fp) == 0;
+	fclose(fp);
+	if (!ok) cout << "Error: failed to write stats file: " << fileName << endl;
+	return ok;
+}
+
+void Stats::setDumpFile(const char *fileName, double interval)
+{
+	lock_guard<mutex> l(_lock);
+	_dumpFile = fileName ? fileName : "";
+	_dumpInterval = interval;
+	_lastDump = _now();
+}
+
+void Stats::poll()
+{
+	string fileName;
+	{
+		lock_guard<mutex> l(_lock);
+		double now = _now();
+		if (_dumpFile.empty() || now - _lastDump < _dumpInterval) return;
+		_lastDump = now;
+		fileName = _dumpFile;
+	}
+	dump(fileName.c_str());
+}
+
+void Stats::flush()
+{
+	string fileName;
+	{
+		lock_guard<mutex> l(_lock);
+		_lastDump = _now();
+		fileName = _dumpFile;
+	}
+	if (!fileName.empty()) dump(fileName.c_str());
+}
+
+ScopedTimer::~ScopedTimer()
+{
+	Stats::shared().record(_stage, elapsed());
+}
+
+double ScopedTimer::elapsed() const
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - _start).count();
+}
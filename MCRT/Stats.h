@@ -0,0 +1,105 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+
+// Process-wide timing registry. Every pipeline stage records its duration
+// under a dotted name ("scene.bvh", "gpu.dispatch", ...) and keeps a rolling
+// window of recent samples for percentiles. Counters such as "rays" and
+// "samples" are turned into per-second rates over the same window.
+// All calls are thread-safe but take a lock, so record per frame or per
+// stage, never per ray.
+class Stats
+{
+public:
+	// Durations are in milliseconds and cover the last `Window` samples,
+	// `count` is the number of samples recorded since the last reset().
+	struct Summary
+	{
+		std::string name;
+		size_t count;
+		double last;
+		double mean;
+		double p50;
+		double p90;
+		double p99;
+		double max;
+	};
+
+	static const size_t Window = 256;
+
+	static Stats &shared();
+
+	void record(const std::string &stage, double ms);
+	void count(const std::string &counter, double amount);
+	void reset();
+
+	std::vector<Summary> summaries() const;
+	bool summary(const std::string &stage, Summary &s) const;
+	double rate(const std::string &counter) const;
+	double total(const std::string &counter) const;
+
+	std::string toJson() const;
+	std::string toCsv(bool header = true) const;
+
+	// .csv files get one snapshot appended per call so a long session turns
+	// into a time series, any other extension is overwritten with JSON.
+	bool dump(const char *fileName) const;
+
+	// Render loops call poll() once per frame; it dumps to `fileName` every
+	// `interval` seconds. flush() dumps right away.
+	void setDumpFile(const char *fileName, double interval = 5);
+	void poll();
+	void flush();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Series
+	{
+		std::vector<double> samples;
+		size_t next = 0;
+		size_t count = 0;
+		double last = 0;
+	};
+
+	struct Counter
+	{
+		double total = 0;
+		std::vector<std::pair<double, double>> history;	// (time, total)
+		size_t next = 0;
+	};
+
+	Stats();
+	double _now() const;
+	static Summary _summarize(const std::string &name, const Series &s);
+	double _rate(const Counter &c) const;
+
+private:
+	mutable std::mutex _lock;
+	std::map<std::string, Series> _series;
+	std::map<std::string, Counter> _counters;
+	Clock::time_point _start;
+	std::string _dumpFile;
+	double _dumpInterval;
+	double _lastDump;
+};
+
+// Records the lifetime of the enclosing scope under `stage`.
+class ScopedTimer
+{
+public:
+	explicit ScopedTimer(const char *stage)
+		: _stage(stage), _start(std::chrono::steady_clock::now()) {}
+	~ScopedTimer();
+
+	double elapsed() const;
+
+private:
+	const char *_stage;
+	std::chrono::steady_clock::time_point _start;
+};
@@ -0,0 +1,110 @@
+#include "TaskScheduler.h"
+
+using namespace std;
+
+TaskScheduler::TaskScheduler(unsigned int threads) : _queued(0), _stopping(false)
+{
+	if (threads == 0) threads = thread::hardware_concurrency();
+	if (threads == 0) threads = 1;
+
+	for (unsigned int i = 0; i < threads; i++) {
+		_workers.emplace_back(new Worker);
+	}
+	for (unsigned int i = 1; i < threads; i++) {
+		_threads.emplace_back(&TaskScheduler::_workerMain, this, i);
+	}
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	{
+		lock_guard<mutex> l(_wakeLock);
+		_stopping = true;
+	}
+	_wake.notify_all();
+	for (auto &t : _threads) t.join();
+}
+
+TaskScheduler &TaskScheduler::shared()
+{
+	static TaskScheduler scheduler;
+	return scheduler;
+}
+
+void TaskScheduler::parallelFor(size_t count, const function<void(size_t)> &fn)
+{
+	if (count == 0) return;
+
+	Job job;
+	job.fn = &fn;
+	job.remaining = count;
+
+	// hand out contiguous blocks so neighbouring tasks stay on one worker
+	size_t n = _workers.size();
+	for (size_t w = 0; w < n; w++) {
+		size_t begin = count * w / n, end = count * (w + 1) / n;
+		lock_guard<mutex> l(_workers[w]->lock);
+		for (size_t i = begin; i < end; i++) {
+			_workers[w]->tasks.push_back({ &job, i });
+		}
+	}
+	{
+		lock_guard<mutex> l(_wakeLock);
+		_queued += count;
+	}
+	_wake.notify_all();
+
+	Task task;
+	while (_popTask(0, task)) {
+		_runTask(task);
+	}
+
+	unique_lock<mutex> l(_doneLock);
+	_done.wait(l, [&job] { return job.remaining == 0; });
+}
+
+void TaskScheduler::_workerMain(unsigned int id)
+{
+	Task task;
+	while (true) {
+		if (_popTask(id, task)) {
+			_runTask(task);
+			continue;
+		}
+		unique_lock<mutex> l(_wakeLock);
+		_wake.wait(l, [this] { return _stopping || _queued > 0; });
+		if (_stopping) return;
+	}
+}
+
+bool TaskScheduler::_popTask(unsigned int id, Task &task)
+{
+	size_t n = _workers.size();
+	for (size_t k = 0; k < n; k++) {
+		Worker *w = _workers[(id + k) % n].get();
+		lock_guard<mutex> l(w->lock);
+		if (w->tasks.empty()) continue;
+		if (k == 0) {
+			task = w->tasks.front();
+			w->tasks.pop_front();
+		}
+		else {
+			task = w->tasks.back();
+			w->tasks.pop_back();
+		}
+		lock_guard<mutex> q(_wakeLock);
+		_queued--;
+		return true;
+	}
+	return false;
+}
+
+void TaskScheduler::_runTask(const Task &task)
+{
+	Job *job = task.job;
+	(*job->fn)(task.index);
+	if (job->remaining.fetch_sub(1) == 1) {
+		lock_guard<mutex> l(_doneLock);
+		_done.notify_all();
+	}
+}
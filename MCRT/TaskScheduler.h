@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent thread pool with one task deque per worker. Owners pop from
+// the front of their own deque, idle workers steal from the back of others.
+// The calling thread takes part as worker 0, so parallelFor must not be
+// called from inside one of its own tasks.
+class TaskScheduler
+{
+public:
+	TaskScheduler(unsigned int threads = 0);
+	~TaskScheduler();
+
+	unsigned int threadCount() const { return (unsigned int)_workers.size(); }
+
+	void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+	static TaskScheduler &shared();
+
+private:
+	struct Job {
+		const std::function<void(size_t)> *fn;
+		std::atomic<size_t> remaining;
+	};
+
+	struct Task {
+		Job *job;
+		size_t index;
+	};
+
+	struct Worker {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	void _workerMain(unsigned int id);
+	bool _popTask(unsigned int id, Task &task);
+	void _runTask(const Task &task);
+
+private:
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::vector<std::thread> _threads;
+
+	std::mutex _wakeLock;
+	std::condition_variable _wake;
+	size_t _queued;
+	bool _stopping;
+
+	std::mutex _doneLock;
+	std::condition_variable _done;
+};
@@ -1,9 +1,16 @@
 #include "Tracer.h"
+#include "Stats.h"
+#include "ImageWriter.h"
+#include "Hash.h"
 
 #include <iostream>
 #include <cmath>
 #include <chrono>
-#include <random>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <sstream>
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 
@@ -12,11 +19,12 @@ using namespace Eigen;
 
 Tracer *Tracer::_instance;
 
-void dumpGLErrors(const char *operation)
+// Quiet calls only report errors, for paths that run every frame.
+void dumpGLErrors(const char *operation, bool quiet = false)
 {
 	GLenum err = glGetError();
 	if (err == GL_NO_ERROR) {
-		cout << operation << " finished with no errors." << endl;
+		if (!quiet) cout << operation << " finished with no errors." << endl;
 	}
 	else {
 		cout << operation << " finished with following errors:";
@@ -27,34 +35,90 @@ void dumpGLErrors(const char *operation)
 	}
 }
 
-Tracer::Tracer(int &argc, char *argv[]) : _canvas(0), _frames(0)
+Tracer::Tracer()
+	: _ready(false), _frames(0), _width(0), _height(0), _historyCanvas(0), _historyHits(0),
+	  _converged(false), _adaptiveThreshold(0), _minSamples(16), _maxDepth(3), _sampler(SobolSampler), _emitterCount(0),
+	  _dispatchTimer("gpu.dispatch"), _blitTimer("gpu.blit"),
+	  _moveSpeed(1), _dragging(false), _dragX(0), _dragY(0), _viewChanged(false),
+	  _moving(false), _reproject(false), _previewScale(2), _traced(nullptr),
+	  _samplesPerFrame(1), _nextInFlight(0), _reportedFrames(0),
+	  _nextEvent(true), _singleInstance(false), _shaderCacheFile("mcrt.shadercache"),
+	  _shaderCacheLoaded(false)
 {
-	glutInit(&argc, argv);
-
-	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
-	glutInitWindowSize(640, 480);
-	glutInitContextVersion(4, 2);
-	glutInitContextFlags(GLUT_CORE_PROFILE);
-	glutCreateWindow("MCRT");
+	_programs = ProgramCollection();
+	_full = _preview = RenderTarget();
+	fill(_keys, _keys + 256, false);
+	setView(Vector3f(0, 5, 15), Vector3f(0, 5, 0));
+	_lastIdle = _lastMove = _lastPresent = chrono::steady_clock::now();
+	setPresentRate(60);
+	for (GLsync &fence : _inFlight) fence = nullptr;
+
+	_ssbo.tiles = 0;
+	_ssbo.counters = 0;
+	_ssbo.paths = 0;
+	_ssbo.queues[0] = _ssbo.queues[1] = 0;
+}
 
+static bool initGlew()
+{
+	// GLEW 2.x also looks for a GLX display, which a surfaceless context
+	// lacks; the GL entry points are loaded by then
 	glewExperimental = GL_TRUE;
 	GLenum err = glewInit();
-	if (err != GLEW_OK) {
+	if (err != GLEW_OK && err != GLEW_ERROR_NO_GLX_DISPLAY) {
 		cout << "Error: unable to initialize glew: "
 			<< glewGetErrorString(err) << endl;
+		return false;
 	}
+	return true;
+}
+
+Tracer::Tracer(int &argc, char *argv[]) : Tracer()
+{
+	glutInit(&argc, argv);
+
+	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+	glutInitWindowSize(640, 480);
+	glutInitContextVersion(4, 3);
+	glutInitContextFlags(GLUT_CORE_PROFILE);
+	glutCreateWindow("MCRT");
+	initGlew();
 
 	glutDisplayFunc(_displayFn);
 	glutReshapeFunc(_resizeFn);
 	glutIdleFunc(_idleFn);
+	glutKeyboardFunc(_keyboardFn);
+	glutKeyboardUpFunc(_keyboardUpFn);
+	glutMouseFunc(_mouseFn);
+	glutMotionFunc(_motionFn);
+	glutIgnoreKeyRepeat(1);
 	dumpGLErrors("glutInitialization");
 
 	Tracer::_instance = this;
 }
 
-void Tracer::run(Scene &s)
+Tracer::Tracer(int width, int height) : Tracer()
+{
+	_width = max(width, 1);
+	_height = max(height, 1);
+	_headless.reset(new HeadlessContext());
+	if (!_headless->create() || !initGlew()) {
+		_headless.reset();
+		return;
+	}
+	dumpGLErrors("headlessInitialization");
+}
+
+void Tracer::run(const SceneBuffers &s)
 {
 	cout << "MCRT has started." << endl;
+	// fly through a quarter of the scene per second
+	if (s.topNodeCount() > 0) {
+		const bvh_node_t &root = s.topNodes()[0];
+		Vector3f extent(root.vmax[0] - root.vmin[0], root.vmax[1] - root.vmin[1], root.vmax[2] - root.vmin[2]);
+		_moveSpeed = max(0.25f * extent.norm(), 1e-3f);
+	}
+	_viewChanged = false;	// the first resize applies the view
 	_buildSSBOs(s);
 	dumpGLErrors("_buildSSBOs");
 	_buildVertexArray();
@@ -69,66 +133,368 @@ void Tracer::run(Scene &s)
 	glutMainLoop();
 }
 
-float getRandomOffset() {
-	static std::random_device rd;
-	static std::mt19937 gen(rd());
-	static std::uniform_real_distribution<> dist(-0.5, 0.5);
-	return dist(gen);
+bool Tracer::begin(const SceneBuffers &s)
+{
+	if (!_headless) {
+		cout << "Error: the tracer has no headless context" << endl;
+		return false;
+	}
+	_buildSSBOs(s);
+	dumpGLErrors("_buildSSBOs");
+	if (!_loadShaders()) {
+		return false;
+	}
+	_initShaders();
+	dumpGLErrors("_initShaders");
+	_applyView();
+	_buildCanvas();
+	_ready = true;
+	return true;
+}
+
+bool Tracer::renderFrame()
+{
+	if (!_ready || _converged) return false;
+	_traceFrame();
+	_dispatchTimer.collect();
+	_readback.collect();
+	Stats::shared().poll();
+	return true;
+}
+
+void Tracer::readCanvas(vector<float> &rgba)
+{
+	const RenderTarget &target = _target();
+	rgba.resize((size_t)target.width * target.height * 4);
+	glBindTexture(GL_TEXTURE_2D, target.canvas);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, rgba.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+bool Tracer::saveCanvas(const char *fileName)
+{
+	vector<float> rgba;
+	readCanvas(rgba);
+	return writeImage(fileName, rgba.data(), _target().width, _target().height);
+}
+
+void Tracer::setAdaptive(float threshold, int minSamples)
+{
+	_adaptiveThreshold = threshold;
+	_minSamples = max(minSamples, 2);
+}
+
+void Tracer::setMaxDepth(int depth)
+{
+	_maxDepth = max(depth, 1);
+	_refreshPrograms();
+}
+
+void Tracer::setNextEventEstimation(bool enabled)
+{
+	_nextEvent = enabled;
+	_refreshPrograms();
+}
+
+void Tracer::setShaderCache(const char *fileName)
+{
+	_shaderCacheFile = fileName ? fileName : "";
+	_shaderCache.clear();
+	_shaderCacheLoaded = false;
+}
+
+void Tracer::setSampler(SamplerType type)
+{
+	_sampler = type;
+}
+
+void Tracer::setView(const Vector3f &eye, const Vector3f &at, float fovy)
+{
+	Vector3f dir = (at - eye).normalized();
+	_eye = eye;
+	_yaw = atan2f(dir.x(), -dir.z());
+	_pitch = asinf(max(-1.0f, min(dir.y(), 1.0f)));
+	_fovy = fovy;
+	_viewChanged = true;
+}
+
+void Tracer::setPreviewScale(int scale)
+{
+	_previewScale = max(scale, 1);
+}
+
+void Tracer::setSamplesPerFrame(int samples)
+{
+	_samplesPerFrame = max(samples, 1);
+}
+
+void Tracer::setPresentRate(double hz)
+{
+	_presentInterval = chrono::microseconds(hz > 0 ? (long long)(1e6 / hz) : 0);
+}
+
+void Tracer::setFrameCallback(const function<void()> &callback)
+{
+	_frameCallback = callback;
+}
+
+void Tracer::setReadback(ReadbackFormat format, const FrameReadback::Consumer &consumer)
+{
+	_readback.setConsumer(format, consumer);
+}
+
+void Tracer::restart()
+{
+	_frames = 0;
+	_reproject = false;
+	_traced = nullptr;
+	_resetTiles();
+}
+
+static bool isSingleInstance(const SceneBuffers &s)
+{
+	if (s.instanceCount() != 1) return false;
+	const instance_t &inst = s.instances()[0];
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 4; c++) {
+			if (inst.toWorld[r][c] != (r == c ? 1.0f : 0.0f)) return false;
+		}
+	}
+	return true;
 }
 
-int nextPower2(int x) {
-	if (x == 0) return 1;
-	x -= 1;
-	x |= x >> 1;
-	x |= x >> 2;
-	x |= x >> 4;
-	x |= x >> 8;
-	x |= x >> 16;
-	x += 1;
-	return x;
+void Tracer::updateScene(SceneBuffers &s)
+{
+	ScopedTimer timer("gl.update");
+	_updateSSBO(_ssbo.triangles, s, SceneBuffers::TriangleSection, s.triangles(), s.faceCount(), sizeof(triangle_t));
+	_updateSSBO(_ssbo.nodes, s, SceneBuffers::NodeSection, s.nodes(), s.nodeCount(), sizeof(bvh_node_t));
+	_updateSSBO(_ssbo.attributes, s, SceneBuffers::AttributeSection, s.attributes(), s.faceCount(), sizeof(face_attr_t));
+	_updateSSBO(_ssbo.materials, s, SceneBuffers::MaterialSection, s.materials(), s.materialCount(), sizeof(material_t));
+	_updateSSBO(_ssbo.emitters, s, SceneBuffers::EmitterSection, s.emitters(), s.emitterCount(), sizeof(emitter_t));
+	_updateSSBO(_ssbo.topNodes, s, SceneBuffers::TopNodeSection, s.topNodes(), s.topNodeCount(), sizeof(bvh_node_t));
+	_updateSSBO(_ssbo.instances, s, SceneBuffers::InstanceSection, s.instances(), s.instanceCount(), sizeof(instance_t));
+	if (_emitterCount != (int)s.emitterCount()) {
+		_emitterCount = (int)s.emitterCount();
+		glUseProgram(_programs.shade);
+		glUniform1i(glGetUniformLocation(_programs.shade, "emitter_count"), _emitterCount);
+		glUseProgram(0);
+	}
+	_singleInstance = isSingleInstance(s);
+	_refreshPrograms();
+	s.clearDirty();
+	dumpGLErrors("updateScene", true);
+	restart();
 }
 
 void Tracer::_onUpdating()
 {
-	_frames++;
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	auto start = chrono::steady_clock::now();
 
-	glUseProgram(_computeProgram);
-
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _ssbo.groups);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _ssbo.faces);
-
-	glUniform3f(_variables.eye, _cop[0], _cop[1], _cop[2]);
-	glUniform3f(_variables.ray00, _ray00[0], _ray00[1], _ray00[2]);
-	glUniform3f(_variables.ray01, _ray01[0], _ray01[1], _ray01[2]);
-	glUniform3f(_variables.ray10, _ray10[0], _ray10[1], _ray10[2]);
-	glUniform3f(_variables.ray11, _ray11[0], _ray11[1], _ray11[2]);
+	if (!_converged) {
+		_traceFrame();
+	}
 
-	glUniform2f(_variables.sampleOffset, getRandomOffset(), getRandomOffset());
-	glUniform1i(_variables.frame, _frames);
-	glBindImageTexture(0, _canvas, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
-	glDispatchCompute(
-		nextPower2(_width) / _groupSizeX,
-		nextPower2(_height) / _groupSizeY,
-		1);
-
-	glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
-	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-	glUseProgram(_renderProgram);
+	_blitTimer.begin();
+	glUseProgram(_programs.render);
 	glBindVertexArray(_canvasVertexArray);
-	glBindTexture(GL_TEXTURE_2D, _canvas);
+	glBindTexture(GL_TEXTURE_2D, _target().canvas);
 	glDrawArrays(GL_TRIANGLES, 0, 6);
 	glBindTexture(GL_TEXTURE_2D, 0);
 	glUseProgram(0);
+	_blitTimer.end();
 	glutSwapBuffers();
+	_lastPresent = chrono::steady_clock::now();
+
+	_dispatchTimer.collect();
+	_blitTimer.collect();
+	_readback.collect();
 
+	// wall time of the whole callback, swap included; gpu.* hold GPU time
 	auto end = chrono::steady_clock::now();
 	auto ms = chrono::duration<double, milli>(end - start).count();
-	if (_frames % 500 == 0) 
-		cout << "Frame #" << _frames << " costs "
-			<< ms << " ms, est " << (1000.0 / ms) << " fps, error " << glGetError() << endl;
+	Stats::shared().record("gl.frame", ms);
+	Stats::shared().poll();
+
+	// most frames are traced between presents, so report the first present
+	// past every 500th
+	Stats::Summary dispatch;
+	if (_frames / 500 > _reportedFrames / 500 && !_converged && Stats::shared().summary("gpu.dispatch", dispatch))
+		cout << "Frame #" << _frames << " presented in "
+			<< ms << " ms, dispatch p50 " << dispatch.p50
+			<< " ms, " << Stats::shared().rate("rays") / 1e6 << " Mrays/s, error " << glGetError() << endl;
+	_reportedFrames = _frames;
+}
+
+void Tracer::_traceFrame()
+{
+	_waitForFrameSlot();
+	const RenderTarget &target = _target();
+	int first = _frames;
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, _ssbo.triangles);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, _ssbo.nodes);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, _ssbo.attributes);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, _ssbo.materials);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, _ssbo.tiles);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, _ssbo.counters);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, _ssbo.paths);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, _ssbo.emitters);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, _ssbo.topNodes);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, _ssbo.instances);
+
+	// the first frame after the camera moved starts from the last one
+	bool reproject = _reproject && _traced;
+	if (reproject) {
+		glCopyImageSubData(_traced->canvas, GL_TEXTURE_2D, 0, 0, 0, 0,
+			_historyCanvas, GL_TEXTURE_2D, 0, 0, 0, 0, _traced->width, _traced->height, 1);
+		glCopyImageSubData(_traced->hits, GL_TEXTURE_2D, 0, 0, 0, 0,
+			_historyHits, GL_TEXTURE_2D, 0, 0, 0, 0, _traced->width, _traced->height, 1);
+	}
+	glBindImageTexture(0, target.canvas, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+	glBindImageTexture(1, target.variance, 0, GL_FALSE, 0, GL_READ_WRITE, GL_R32F);
+	glBindImageTexture(2, target.hits, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+	glBindImageTexture(3, _historyCanvas, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+	glBindImageTexture(4, _historyHits, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+
+	// several samples per call keep the per-frame overhead off the sample
+	// rate; previews take one so the view follows the input
+	int samples = _moving ? 1 : _samplesPerFrame;
+	_dispatchTimer.begin();
+	for (int i = 0; i < samples; i++) {
+		if (i > 0) {
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+		}
+		_frames++;
+		_dispatchStages(target, reproject && i == 0);
+	}
+	_dispatchTimer.end();
+	_reproject = false;
+	_traced = &target;
+	_tracedCamera = _camera;
+
+	for (GLuint unit = 0; unit < 5; unit++) {
+		glBindImageTexture(unit, 0, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+	}
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	if (_readback.enabled()) {
+		_captureFrame(target);
+	}
+
+	_inFlight[_nextInFlight] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	_nextInFlight = (_nextInFlight + 1) % MaxFramesInFlight;
+
+	// reading the counters back stalls, so only poll them now and then
+	if (first / 16 != _frames / 16) {
+		_readCounters();
+	}
+}
+
+void Tracer::_waitForFrameSlot()
+{
+	// without a swap to throttle it the CPU could queue frames without
+	// bound, and every queued frame is input latency
+	GLsync &fence = _inFlight[_nextInFlight];
+	if (!fence) return;
+	auto start = chrono::steady_clock::now();
+	while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+	glDeleteSync(fence);
+	fence = nullptr;
+	auto ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	Stats::shared().record("gl.wait", ms);
+}
+
+void Tracer::_dispatchStages(const RenderTarget &target, bool reproject)
+{
+	GLuint groupsX = (target.width + _groupSizeX - 1) / _groupSizeX;
+	GLuint groupsY = (target.height + _groupSizeY - 1) / _groupSizeY;
+
+	// generate fills queue 0; each bounce then reads one queue and fills the
+	// other, so the grid shrinks as paths miss or are terminated
+	const GLuint emptyQueue[4] = { 0, 1, 1, 0 };
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo.queues[0]);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(emptyQueue), emptyQueue);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	glUseProgram(_programs.generate);
+	glUniform3fv(_variables.eye, 1, _camera.eye().data());
+	glUniform3fv(_variables.ray00, 1, _camera.ray00().data());
+	glUniform3fv(_variables.ray01, 1, _camera.ray01().data());
+	glUniform3fv(_variables.ray10, 1, _camera.ray10().data());
+	glUniform3fv(_variables.ray11, 1, _camera.ray11().data());
+	glUniform1i(_variables.frame, _frames);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, _ssbo.queues[0]);
+	glDispatchCompute(groupsX, groupsY, 1);
+
+	for (int depth = 0; depth < _maxDepth; depth++) {
+		GLuint in = _ssbo.queues[depth % 2], out = _ssbo.queues[(depth + 1) % 2];
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, in);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, out);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		glUseProgram(_programs.queue);
+		glDispatchCompute(1, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+		glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, in);
+		glUseProgram(_programs.intersect);
+		glDispatchComputeIndirect(0);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		glUseProgram(_programs.shade);
+		glDispatchComputeIndirect(0);
+	}
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+	// accumulate also reads the primary hits intersect stored as an image
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+	glUseProgram(_programs.accumulate);
+	glUniform1f(_variables.adaptiveThreshold, _adaptiveThreshold);
+	glUniform1i(_variables.minSamples, _minSamples);
+	glUniform1i(_variables.reproject, reproject);
+	if (reproject) {
+		glUniformMatrix4fv(_variables.prevViewProj, 1, GL_FALSE, _tracedCamera.viewProjection().data());
+		glUniform2i(_variables.historySize, _traced->width, _traced->height);
+	}
+	glDispatchCompute(groupsX, groupsY, 1);
+}
+
+void Tracer::_captureFrame(const RenderTarget &target)
+{
+	GLuint buffer = _readback.begin(target.width, target.height, _frames);
+	if (!buffer) return;
+	glUseProgram(_programs.readback);
+	glUniform1i(_variables.readbackFormat, _readback.format());
+	glBindImageTexture(0, target.canvas, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, buffer);
+	glDispatchCompute((target.width + _groupSizeX - 1) / _groupSizeX, (target.height + _groupSizeY - 1) / _groupSizeY, 1);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	_readback.end();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, 0);
+	glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+	glUseProgram(0);
+}
+
+void Tracer::_readCounters()
+{
+	GLuint counters[2] = { 0, 0 };
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo.counters);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counters), counters);
+	GLuint zero[2] = { 0, 0 };
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), zero);
+	Stats::shared().count("rays", counters[0]);
+	Stats::shared().count("samples", counters[1]);
+
+	if (_adaptiveThreshold > 0) {
+		GLuint active = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo.tiles);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &active);
+		if (active == 0) {
+			_converged = true;
+			cout << "Converged after " << _frames << " frames" << endl;
+		}
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
 void Tracer::_onResized(int width, int height)
@@ -139,74 +505,166 @@ void Tracer::_onResized(int width, int height)
 	_width = width;
 	_height = height;
 
-	float aspect = height != 0 ? float(width) / float(height) : width;
-
 	glViewport(0, 0, width, height);
-	_setFrustum(60, aspect, 1., 30.);
-	_setCamera(
-		Vector3f(0, 5, 15),
-		Vector3f(0, 5, 0),
-		Vector3f(0, 1, 0));
-	_computeInvMatrix();
+	_applyView();
 	_buildCanvas();
 }
 
 void Tracer::_onIdle()
 {
-	glutPostRedisplay();
+	if (_frameCallback) _frameCallback();
+
+	auto now = chrono::steady_clock::now();
+	double seconds = chrono::duration<double>(now - _lastIdle).count();
+	_lastIdle = now;
+	if (_moveView(min(seconds, 0.1))) {
+		// every step restarts the preview from the reprojected last frame
+		_applyView();
+		_lastMove = now;
+		_moving = true;
+		_reproject = true;
+		_frames = 0;
+		_resetTiles();
+	}
+	else if (_moving && now - _lastMove > chrono::milliseconds(_stillDelay)) {
+		_moving = false;
+		restart();
+	}
+
+	// compute runs back to back from here and only every present interval
+	// goes through the display callback, whose swap may wait for vsync
+	if (now - _lastPresent >= _presentInterval) {
+		glutPostRedisplay();
+	}
+	else if (!_converged) {
+		_traceFrame();
+		_dispatchTimer.collect();
+		_readback.collect();
+	}
 }
 
-void Tracer::_setFrustum(float fovy, float aspect, float zNear, float zFar)
+void Tracer::_onKeyboard(unsigned char key, bool down)
 {
-	float halfH = tanf(fovy / 180.0f * 3.14159f * 0.5f) * zNear;
-	float halfW = aspect * halfH;
-	float zL = zNear - zFar;
-	_projMat << zNear / halfW, 0, 0, 0,
-				0, zNear / halfH, 0, 0,
-				0, 0, (zFar + zNear) / zL, 2.0f * zFar * zNear / zL,
-				0, 0, -1, 0;
-	//cout << "Projection Matrix:" << endl
-	//	<< _projMat << endl;
+	_keys[tolower(key)] = down;
 }
 
-void Tracer::_setCamera(const Vector3f &eye, const Vector3f &at, const Vector3f &up)
+void Tracer::_onMouse(int button, int state, int x, int y)
 {
-	_cop = eye;
-	Vector3f dn = (at - eye).normalized();
-	Vector3f un = up.normalized();
-	Vector3f rn = dn.cross(un).normalized();
-	_viewMat << rn(0), rn(1), rn(2), -rn.dot(eye),
-				un(0), un(1), un(2), -un.dot(eye),
-				-dn(0), -dn(1), -dn(2), dn.dot(eye),
-				0, 0, 0, 1;
-	//cout << "View Matrix:" << endl
-	//	<< _viewMat << endl;
+	if (button == GLUT_LEFT_BUTTON) {
+		_dragging = state == GLUT_DOWN;
+		_dragX = x;
+		_dragY = y;
+	}
 }
 
-void Tracer::_computeInvMatrix()
+void Tracer::_onMotion(int x, int y)
 {
-	_invMat = (_projMat * _viewMat).inverse();
-	//cout << "Inverse PV Matrix" << endl
-	//	<< _invMat << endl;
-	_ray00 = _getRayVector(-1, -1);
-	//cout << "Ray00: " << endl << _ray00 << endl;
-	_ray01 = _getRayVector(-1, 1);
-	//cout << "Ray01: " << endl << _ray01 << endl;
-	_ray10 = _getRayVector(1, -1);
-	//cout << "Ray10: " << endl << _ray10 << endl;
-	_ray11 = _getRayVector(1, 1);
-	//cout << "Ray11: " << endl << _ray11 << endl;
+	if (!_dragging) return;
+	const float limit = 1.55f;
+	_yaw += (x - _dragX) * _lookSpeed;
+	_pitch = max(-limit, min(_pitch - (y - _dragY) * _lookSpeed, limit));
+	_dragX = x;
+	_dragY = y;
+	_viewChanged = true;
 }
 
-void Tracer::_buildCanvas()
+bool Tracer::_moveView(double seconds)
+{
+	Vector3f forward(sinf(_yaw) * cosf(_pitch), sinf(_pitch), -cosf(_yaw) * cosf(_pitch));
+	Vector3f right = forward.cross(Vector3f(0, 1, 0)).normalized();
+	Vector3f move(0, 0, 0);
+	if (_keys['w']) move += forward;
+	if (_keys['s']) move -= forward;
+	if (_keys['d']) move += right;
+	if (_keys['a']) move -= right;
+	if (_keys['e']) move += Vector3f(0, 1, 0);
+	if (_keys['q']) move -= Vector3f(0, 1, 0);
+	bool changed = _viewChanged;
+	_viewChanged = false;
+	if (!move.isZero()) {
+		_eye += move.normalized() * (float)(_moveSpeed * seconds);
+		changed = true;
+	}
+	return changed;
+}
+
+void Tracer::_applyView()
+{
+	Vector3f forward(sinf(_yaw) * cosf(_pitch), sinf(_pitch), -cosf(_yaw) * cosf(_pitch));
+	float aspect = _height != 0 ? float(_width) / float(_height) : float(_width);
+	_camera.setFrustum(_fovy, aspect, 1., 30.);
+	_camera.setCamera(_eye, _eye + forward, Vector3f(0, 1, 0));
+	_camera.computeInvMatrix();
+}
+
+static GLuint createTexture(GLenum format, int width, int height, GLint filter)
 {
-	if (_canvas) glDeleteTextures(1, &_canvas);
-	glGenTextures(1, &_canvas);
-	glBindTexture(GL_TEXTURE_2D, _canvas);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, _width, _height, 0, GL_RGBA, GL_FLOAT, NULL);
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+	glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
 	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
+
+void Tracer::_buildTarget(RenderTarget &t, int width, int height, int filter)
+{
+	GLuint textures[3] = { t.canvas, t.variance, t.hits };
+	glDeleteTextures(3, textures);
+	t.width = width;
+	t.height = height;
+	t.canvas = createTexture(GL_RGBA32F, width, height, filter);
+	t.variance = createTexture(GL_R32F, width, height, filter);
+	t.hits = createTexture(GL_RGBA32F, width, height, GL_NEAREST);
+}
+
+void Tracer::_buildCanvas()
+{
+	// the preview is stretched over the window, so filter it
+	_buildTarget(_full, _width, _height, GL_NEAREST);
+	_buildTarget(_preview, max(_width / _previewScale, 1), max(_height / _previewScale, 1), GL_LINEAR);
+	GLuint history[2] = { _historyCanvas, _historyHits };
+	glDeleteTextures(2, history);
+	_historyCanvas = createTexture(GL_RGBA32F, _width, _height, GL_NEAREST);
+	_historyHits = createTexture(GL_RGBA32F, _width, _height, GL_NEAREST);
+
+	// one path_t (96 bytes in std430) per pixel and two queues of pixel
+	// slots behind a 16 byte header, enough for either target
+	size_t pixels = (size_t)_width * _height;
+	if (!_ssbo.paths) glGenBuffers(1, &_ssbo.paths);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo.paths);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, pixels * 96, NULL, GL_DYNAMIC_COPY);
+	for (GLuint &queue : _ssbo.queues) {
+		if (!queue) glGenBuffers(1, &queue);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, queue);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, 16 + pixels * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	restart();
+}
+
+void Tracer::_resetTiles()
+{
+	// one tile per work group of the grid, see _dispatchStages
+	const RenderTarget &target = _target();
+	unsigned int tilesX = (target.width + _groupSizeX - 1) / _groupSizeX;
+	unsigned int tilesY = (target.height + _groupSizeY - 1) / _groupSizeY;
+	vector<GLuint> tiles(1 + 2 * tilesX * tilesY, 0);
+	tiles[0] = tilesX * tilesY;
+	_converged = false;
+
+	if (!_ssbo.tiles) glGenBuffers(1, &_ssbo.tiles);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo.tiles);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, tiles.size() * sizeof(GLuint), tiles.data(), GL_DYNAMIC_COPY);
+
+	GLuint counters[2] = { 0, 0 };
+	if (!_ssbo.counters) glGenBuffers(1, &_ssbo.counters);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, _ssbo.counters);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(counters), counters, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
 void Tracer::_buildVertexArray()
@@ -224,53 +682,103 @@ void Tracer::_buildVertexArray()
 	glBindVertexArray(NULL);
 }
 
-GLuint createSSBO(void *buffer, size_t size)
+// Scene buffers can be larger than RAM when they come from a mapped file,
+// so they go up in pieces: the driver only ever stages one chunk and the
+// pages already uploaded can be dropped by the OS.
+static const size_t UploadChunk = 32 << 20;
+
+GLuint createSSBO(const void *buffer, size_t size)
 {
 	GLuint ssbo;
 	glGenBuffers(1, &ssbo);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, size, buffer, GL_STATIC_READ);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, size, NULL, GL_STATIC_DRAW);
+	for (size_t offset = 0; buffer && offset < size; offset += UploadChunk) {
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, offset, min(UploadChunk, size - offset),
+			(const char *)buffer + offset);
+	}
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 	return ssbo;
 }
 
-void Tracer::_buildSSBOs(Scene &s)
+void Tracer::_buildSSBOs(const SceneBuffers &s)
 {
-	group_t *grpBuf;
-	face_t *faceBuf;
-	size_t grpBufLen, faceBufLen;
-
-	s.getGroupBuffers(
-		&grpBuf, &grpBufLen,
-		&faceBuf, &faceBufLen);
-
-	_ssbo.groups = createSSBO((void *)grpBuf, grpBufLen * sizeof(group_t));
-	_ssbo.faces = createSSBO((void *)faceBuf, faceBufLen * sizeof(face_t));
+	ScopedTimer timer("gl.upload");
+	_ssbo.triangles = createSSBO(s.triangles(), s.faceCount() * sizeof(triangle_t));
+	_ssbo.nodes = createSSBO(s.nodes(), s.nodeCount() * sizeof(bvh_node_t));
+	_ssbo.attributes = createSSBO(s.attributes(), s.faceCount() * sizeof(face_attr_t));
+	_ssbo.materials = createSSBO(s.materials(), s.materialCount() * sizeof(material_t));
+	_ssbo.topNodes = createSSBO(s.topNodes(), s.topNodeCount() * sizeof(bvh_node_t));
+	_ssbo.instances = createSSBO(s.instances(), s.instanceCount() * sizeof(instance_t));
+	// binding an empty buffer is an error, so keep room for one emitter
+	_ssbo.emitters = createSSBO(s.emitterCount() ? s.emitters() : nullptr,
+		max<size_t>(s.emitterCount(), 1) * sizeof(emitter_t));
+	_emitterCount = (int)s.emitterCount();
+	_singleInstance = isSingleInstance(s);
+}
 
-	delete grpBuf;
-	delete faceBuf;
+void Tracer::_updateSSBO(GLuint &ssbo, const SceneBuffers &s, SceneBuffers::Section section,
+	const void *data, size_t count, size_t elementSize)
+{
+	const SceneBuffers::DirtyRanges &dirty = s.dirtyRanges(section);
+	if (dirty.resized) {
+		glDeleteBuffers(1, &ssbo);
+		ssbo = createSSBO(count ? data : nullptr, max<size_t>(count, 1) * elementSize);
+		return;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+	for (auto &r : dirty.ranges) {
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, r.first * elementSize, r.second * elementSize,
+			(const char *)data + r.first * elementSize);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
-GLuint compileShader(const char *fname, GLenum type)
+// GLSL has no includes; lines of the form #include "file" are replaced by
+// the file's contents, followed by a #line so errors keep their numbers
+static bool readShaderSource(const char *fname, string &source, int depth = 0)
 {
-	GLuint shader = glCreateShader(type);
-	FILE *fp = fopen(fname, "rb");
-	if (fp == NULL) {
+	ifstream in(fname, ios::binary);
+	if (!in) {
 		cout << "Error: cannot open shader: " << fname << endl;
-		return 0;
+		return false;
+	}
+	if (depth > 8) {
+		cout << "Error: shader includes nested too deeply: " << fname << endl;
+		return false;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	GLint length = ftell(fp);
-	GLchar *buf = new GLchar[length + 1];
-	fseek(fp, 0, SEEK_SET);
-	fread(buf, sizeof(GLchar), length, fp);
-	buf[length] = 0;
-	fclose(fp);
+	string line;
+	int lineNumber = 0;
+	if (depth > 0) source += "#line 1\n";
+	while (getline(in, line)) {
+		lineNumber++;
+		size_t start = line.find_first_not_of(" \t");
+		if (start != string::npos && line.compare(start, 8, "#include") == 0) {
+			size_t open = line.find('"', start), close = line.rfind('"');
+			if (open == string::npos || close <= open) {
+				cout << "Error: malformed include in " << fname << ":" << lineNumber << endl;
+				return false;
+			}
+			if (!readShaderSource(line.substr(open + 1, close - open - 1).c_str(), source, depth + 1)) {
+				return false;
+			}
+			source += "#line " + to_string(lineNumber + 1) + "\n";
+			continue;
+		}
+		source += line;
+		source += '\n';
+	}
+	return true;
+}
 
-	glShaderSource(shader, 1, (const GLchar **)&buf, &length);
+GLuint compileShader(const char *fname, const string &source, GLenum type)
+{
+	GLuint shader = glCreateShader(type);
+	const GLchar *buf = source.c_str();
+	GLint length = (GLint)source.size();
+	glShaderSource(shader, 1, &buf, &length);
 	glCompileShader(shader);
-	delete buf;
 
 	GLint result;
 	glGetShaderiv(shader, GL_COMPILE_STATUS, &result);
@@ -279,56 +787,194 @@ GLuint compileShader(const char *fname, GLenum type)
 		GLsizei loglen;
 		glGetShaderInfoLog(shader, 2048, &loglen, logbuf);
 		logbuf[loglen] = 0;
-		cout << "Error: unable to compile shader:" << endl
+		cout << "Error: unable to compile shader " << fname << ":" << endl
 			<< logbuf << endl;
-		delete logbuf;
+		delete[] logbuf;
+		glDeleteShader(shader);
 		return 0;
 	}
 
 	return shader;
 }
 
-void Tracer::_loadShaders()
+struct ShaderStage {
+	const char *fname;
+	GLenum type;
+};
+
+// Links one program from its stages with `defines` placed after #version,
+// or loads it from `cache` when the driver and every expanded source are
+// unchanged. The program is linked (or failed) on return.
+static GLuint buildProgram(initializer_list<ShaderStage> stages, const string &defines,
+	const string &driver, ShaderCache *cache, bool &cached)
 {
-	GLuint fs = compileShader("quad.frag", GL_FRAGMENT_SHADER);
-	GLuint vs = compileShader("quad.vert", GL_VERTEX_SHADER);
-	GLuint cs = compileShader("trace.comp", GL_COMPUTE_SHADER);
+	cached = false;
+	vector<string> sources;
+	uint64_t key = hashBytes(driver.data(), driver.size());
+	for (const ShaderStage &stage : stages) {
+		string source;
+		if (!readShaderSource(stage.fname, source)) {
+			return 0;
+		}
+		size_t eol = source.find('\n');
+		source.insert(eol == string::npos ? source.size() : eol + 1, defines + "#line 2\n");
+		key = hashBytes(source.data(), source.size(), key);
+		sources.push_back(source);
+	}
+
+	GLuint program = glCreateProgram();
+	if (cache) {
+		uint32_t format;
+		vector<char> binary;
+		if (cache->find(key, format, binary)) {
+			glProgramBinary(program, format, binary.data(), (GLsizei)binary.size());
+			GLint linked = GL_FALSE;
+			glGetProgramiv(program, GL_LINK_STATUS, &linked);
+			if (linked == GL_TRUE) {
+				cached = true;
+				return program;
+			}
+		}
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
 
-	_computeProgram = glCreateProgram();
-	glAttachShader(_computeProgram, cs);
-	glLinkProgram(_computeProgram);
+	vector<GLuint> shaders;
+	size_t i = 0;
+	for (const ShaderStage &stage : stages) {
+		GLuint shader = compileShader(stage.fname, sources[i++], stage.type);
+		if (shader) {
+			glAttachShader(program, shader);
+			shaders.push_back(shader);
+		}
+	}
+	glLinkProgram(program);
+	for (GLuint shader : shaders) {
+		glDetachShader(program, shader);
+		glDeleteShader(shader);
+	}
 
-	_renderProgram = glCreateProgram();
-	glAttachShader(_renderProgram, vs);
-	glAttachShader(_renderProgram, fs);
-	glLinkProgram(_renderProgram);
+	GLint linked = GL_FALSE, length = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (cache && linked == GL_TRUE) {
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	}
+	if (length > 0) {
+		vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(program, length, nullptr, &format, binary.data());
+		cache->store(key, format, move(binary));
+	}
+	return program;
 }
 
-void Tracer::_initShaders()
+// Compile-time constants of this scene's variant of the stages, see the
+// list in trace.glsl. Emitters and instances decide the features, so a
+// scene without lights drops next event estimation and a single untransformed
+// mesh skips the top-level tree.
+string Tracer::_shaderDefines() const
 {
-	glUseProgram(_computeProgram);
-	_variables.eye = glGetUniformLocation(_computeProgram, "eye");
-	_variables.ray00 = glGetUniformLocation(_computeProgram, "ray00");
-	_variables.ray01 = glGetUniformLocation(_computeProgram, "ray01");
-	_variables.ray10 = glGetUniformLocation(_computeProgram, "ray10");
-	_variables.ray11 = glGetUniformLocation(_computeProgram, "ray11");
-	_variables.sampleOffset = glGetUniformLocation(_computeProgram, "sample_offset");
-	_variables.frame = glGetUniformLocation(_computeProgram, "frame");
-
-	glUseProgram(_renderProgram);
-	_variables.tex = glGetUniformLocation(_renderProgram, "tex");
-	glUniform1i(_variables.tex, 0);
+	ostringstream defines;
+	defines << "#define TILE_WIDTH " << _groupSizeX << "\n"
+		<< "#define TILE_HEIGHT " << _groupSizeY << "\n"
+		<< "#define MAX_DEPTH " << _maxDepth << "\n";
+	if (_nextEvent && _emitterCount > 0) defines << "#define NEXT_EVENT\n";
+	if (_singleInstance) defines << "#define SINGLE_INSTANCE\n";
+	return defines.str();
+}
 
-	glUseProgram(NULL);
+void Tracer::_refreshPrograms()
+{
+	// the cache makes switching back and forth cheap
+	if (!_programs.generate || _shaderDefines() == _programDefines) return;
+	_loadShaders();
+	_initShaders();
+	restart();
 }
 
-Vector3f Tracer::_getRayVector(float x, float y)
+bool Tracer::_loadShaders()
 {
-	Vector4f r = _invMat * Vector4f(x, y, 0, 1);
-	r[0] /= r[3];
-	r[1] /= r[3];
-	r[2] /= r[3];
-	return Vector3f(r[0], r[1], r[2]) - _cop;
+	ScopedTimer timer("gl.compile");
+	string driver = string((const char *)glGetString(GL_VENDOR)) + "\n"
+		+ (const char *)glGetString(GL_RENDERER) + "\n" + (const char *)glGetString(GL_VERSION);
+	ShaderCache *c = _shaderCacheFile.empty() ? nullptr : &_shaderCache;
+	if (c && !_shaderCacheLoaded) {
+		// loaded once, later variants of this run add to the same cache
+		_shaderCache.load(_shaderCacheFile.c_str(), hashBytes(driver.data(), driver.size()));
+		_shaderCacheLoaded = true;
+	}
+
+	GLuint old[] = { _programs.generate, _programs.queue, _programs.intersect,
+		_programs.shade, _programs.accumulate, _programs.readback, _programs.render };
+	for (GLuint program : old) {
+		if (program) glDeleteProgram(program);
+	}
+
+	string defines = _shaderDefines();
+	int cached = 0;
+	auto computeProgram = [&](const char *fname) {
+		bool hit;
+		GLuint program = buildProgram({ { fname, GL_COMPUTE_SHADER } }, defines, driver, c, hit);
+		cached += hit;
+		return program;
+	};
+	_programs.generate = computeProgram("generate.comp");
+	_programs.queue = computeProgram("queue.comp");
+	_programs.intersect = computeProgram("intersect.comp");
+	_programs.shade = computeProgram("shade.comp");
+	_programs.accumulate = computeProgram("accumulate.comp");
+	_programs.readback = computeProgram("readback.comp");
+
+	bool hit;
+	_programs.render = buildProgram({ { "quad.vert", GL_VERTEX_SHADER }, { "quad.frag", GL_FRAGMENT_SHADER } },
+		"", driver, c, hit);
+	cached += hit;
+	_programDefines = defines;
+
+	bool ok = true;
+	for (GLuint program : { _programs.generate, _programs.queue, _programs.intersect,
+			_programs.shade, _programs.accumulate, _programs.readback, _programs.render }) {
+		GLint linked = GL_FALSE;
+		if (program) glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (linked != GL_TRUE) {
+			cout << "Error: unable to link shader program" << endl;
+			ok = false;
+		}
+	}
+	if (c && _shaderCache.changed()) {
+		_shaderCache.save(_shaderCacheFile.c_str());
+	}
+	cout << "Shader programs: " << cached << " of 7 from the cache" << endl;
+	return ok;
+}
+
+void Tracer::_initShaders()
+{
+	_variables.eye = glGetUniformLocation(_programs.generate, "eye");
+	_variables.ray00 = glGetUniformLocation(_programs.generate, "ray00");
+	_variables.ray01 = glGetUniformLocation(_programs.generate, "ray01");
+	_variables.ray10 = glGetUniformLocation(_programs.generate, "ray10");
+	_variables.ray11 = glGetUniformLocation(_programs.generate, "ray11");
+	_variables.frame = glGetUniformLocation(_programs.generate, "frame");
+	_variables.adaptiveThreshold = glGetUniformLocation(_programs.accumulate, "adaptive_threshold");
+	_variables.minSamples = glGetUniformLocation(_programs.accumulate, "min_samples");
+	_variables.reproject = glGetUniformLocation(_programs.accumulate, "reproject");
+	_variables.prevViewProj = glGetUniformLocation(_programs.accumulate, "prev_view_proj");
+	_variables.historySize = glGetUniformLocation(_programs.accumulate, "history_size");
+	_variables.readbackFormat = glGetUniformLocation(_programs.readback, "format");
+
+	// the sampler is fixed for the session, so set it once in both stages
+	for (GLuint program : { _programs.generate, _programs.shade }) {
+		glUseProgram(program);
+		glUniform1i(glGetUniformLocation(program, "sampler_type"), _sampler);
+	}
+	glUseProgram(_programs.shade);
+	glUniform1i(glGetUniformLocation(_programs.shade, "emitter_count"), _emitterCount);
+
+	glUseProgram(_programs.render);
+	_variables.tex = glGetUniformLocation(_programs.render, "tex");
+	glUniform1i(_variables.tex, 0);
+
+	glUseProgram(NULL);
 }
 
 void Tracer::_displayFn()
@@ -345,3 +991,23 @@ void Tracer::_idleFn()
 {
 	Tracer::_instance->_onIdle();
 }
+
+void Tracer::_keyboardFn(unsigned char key, int, int)
+{
+	Tracer::_instance->_onKeyboard(key, true);
+}
+
+void Tracer::_keyboardUpFn(unsigned char key, int, int)
+{
+	Tracer::_instance->_onKeyboard(key, false);
+}
+
+void Tracer::_mouseFn(int button, int state, int x, int y)
+{
+	Tracer::_instance->_onMouse(button, state, x, y);
+}
+
+void Tracer::_motionFn(int x, int y)
+{
+	Tracer::_instance->_onMotion(x, y);
+}
@@ -1,66 +1,249 @@
 #pragma once
 
 #include "Types.h"
-#include "Scene.h"
+#include "SceneBuffers.h"
+#include "Camera.h"
+#include "GpuTimer.h"
+#include "FrameReadback.h"
+#include "HeadlessContext.h"
+#include "Sampler.h"
+#include "ShaderCache.h"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 class Tracer
 {
 public:
+	// Interactive: opens a GLUT window and renders from its idle loop.
 	Tracer(int &argc, char *argv[]);
+	// Headless: traces width x height frames in an offscreen context (see
+	// HeadlessContext) for the caller's own render loop.
+	Tracer(int width, int height);
+
+	// Window only; never returns.
+	void run(const SceneBuffers &s);
+
+	// Render loop without GLUT: begin() uploads the scene and builds the
+	// programs, then every renderFrame() traces one sample per pixel. It
+	// returns false, tracing nothing, once adaptive sampling has converged;
+	// convergence is polled every 16 frames, as in the window. After begin()
+	// failed no frames are traced either.
+	bool begin(const SceneBuffers &s);
+	bool renderFrame();
+	int frames() const { return _frames; }
+	bool converged() const { return _converged; }
+
+	// Blocks until the queued frames are done; rows bottom to top.
+	void readCanvas(std::vector<float> &rgba);
+	bool saveCanvas(const char *fileName);
+
+	// Same convergence test as CpuTracer::setAdaptive, evaluated per work
+	// group tile on the GPU. Once every tile has converged no more compute
+	// passes are dispatched.
+	void setAdaptive(float threshold, int minSamples = 16);
+
+	// Longest path in intersections; paths past the first few bounces are
+	// ended by Russian roulette well before this. Compiled into the shaders,
+	// so changing it once running switches programs.
+	void setMaxDepth(int depth);
+
+	// Light sampling at every vertex (on); without it emitters are only
+	// found by BSDF sampling. Scenes without emitters never sample them.
+	void setNextEventEstimation(bool enabled);
+
+	// File that keeps linked program binaries between runs, see ShaderCache
+	// ("mcrt.shadercache"); nullptr compiles every time. Set before run().
+	void setShaderCache(const char *fileName);
+
+	void setSampler(SamplerType type);
+
+	// Starting view. WASD flies, Q and E move down and up, and dragging
+	// with the left mouse button looks around.
+	void setView(const Eigen::Vector3f &eye, const Eigen::Vector3f &at, float fovy = 60);
+
+	// While the camera moves, frames are traced at 1/scale of the window
+	// resolution and each starts from the previous image reprojected onto
+	// the new view. Accumulation restarts at full resolution once the
+	// camera has been still for a moment.
+	void setPreviewScale(int scale);
 
-	void run(Scene &s);
+	// Samples per pixel traced back to back in one frame (1); previews
+	// always take one.
+	void setSamplesPerFrame(int samples);
+
+	// The window is redrawn at most `hz` times a second (60); in between
+	// frames are traced without presenting them. 0 presents every frame.
+	void setPresentRate(double hz);
+
+	// Uploads the ranges SceneBuffers::update changed with glBufferSubData,
+	// replacing only buffers that changed size, and restarts accumulation.
+	// Meant to be called from the frame callback, which runs once per frame
+	// between dispatches.
+	void updateScene(SceneBuffers &s);
+	void restart();
+	void setFrameCallback(const std::function<void()> &callback);
+
+	// Streams every traced frame, previews included, to `consumer` in
+	// `format`, converted on the GPU and delivered a few frames late from
+	// the GL thread (see FrameReadback). An empty consumer stops streaming.
+	void setReadback(ReadbackFormat format, const FrameReadback::Consumer &consumer);
 
 private:
+	Tracer();
+
 	void _onUpdating();
 	void _onResized(int width, int height);
 	void _onIdle();
+	void _onKeyboard(unsigned char key, bool down);
+	void _onMouse(int button, int state, int x, int y);
+	void _onMotion(int x, int y);
 
 private:
-	void _setFrustum(float fovy, float aspect, float zNear, float zFar);
-	void _setCamera(
-		const Eigen::Vector3f &eye,
-		const Eigen::Vector3f &at,
-		const Eigen::Vector3f &up);
-	void _computeInvMatrix();
+	// accumulation images of one resolution; hits holds the first hit of the
+	// latest sample of every pixel, a point or (w = 0) a direction that missed
+	struct RenderTarget {
+		unsigned int canvas;
+		unsigned int variance;
+		unsigned int hits;
+		int width, height;
+	};
+
+	const RenderTarget &_target() const { return _moving ? _preview : _full; }
+	void _buildTarget(RenderTarget &t, int width, int height, int filter);
+	bool _moveView(double seconds);
+	void _applyView();
+
 	void _buildCanvas();
+	void _traceFrame();
+	void _waitForFrameSlot();
+	void _dispatchStages(const RenderTarget &target, bool reproject);
+	void _resetTiles();
+	void _readCounters();
+	void _captureFrame(const RenderTarget &target);
 	void _buildVertexArray();
-	void _buildSSBOs(Scene &s);
-	void _loadShaders();
+	void _buildSSBOs(const SceneBuffers &s);
+	void _updateSSBO(unsigned int &ssbo, const SceneBuffers &s, SceneBuffers::Section section,
+		const void *data, size_t count, size_t elementSize);
+	std::string _shaderDefines() const;
+	void _refreshPrograms();
+	bool _loadShaders();
 	void _initShaders();
-	Eigen::Vector3f _getRayVector(float x, float y);
 
 private:
+	// declared first so the context outlives every GL object below
+	std::unique_ptr<HeadlessContext> _headless;
+	bool _ready;
 	int _frames;
 	int _width;
 	int _height;
-	unsigned int _canvas, _canvasVertexArray;
-	unsigned int _computeProgram, _renderProgram;
-	Eigen::Vector3f _cop, _ray00, _ray01, _ray10, _ray11;
-	Eigen::Matrix4f _viewMat, _projMat, _invMat;
+	unsigned int _canvasVertexArray;
+	RenderTarget _full, _preview;
+	unsigned int _historyCanvas, _historyHits;
+	bool _converged;
+	float _adaptiveThreshold;
+	int _minSamples;
+	int _maxDepth;
+	SamplerType _sampler;
+	int _emitterCount;
+	Camera _camera;
+	GpuTimer _dispatchTimer;
+	GpuTimer _blitTimer;
+	std::function<void()> _frameCallback;
+	FrameReadback _readback;
+
+	// fly camera; _traced is the target of the last frame and _tracedCamera
+	// its view, the source of the next reprojection
+	Eigen::Vector3f _eye;
+	float _yaw, _pitch, _fovy;
+	float _moveSpeed;
+	bool _keys[256];
+	bool _dragging;
+	int _dragX, _dragY;
+	bool _viewChanged;
+	bool _moving;
+	bool _reproject;
+	int _previewScale;
+	std::chrono::steady_clock::time_point _lastIdle, _lastMove;
+	const RenderTarget *_traced;
+	Camera _tracedCamera;
+
+	// throughput: frames queued on the GPU are fenced and at most
+	// MaxFramesInFlight run ahead of the CPU
+	static const int MaxFramesInFlight = 2;
+	int _samplesPerFrame;
+	std::chrono::steady_clock::duration _presentInterval;
+	std::chrono::steady_clock::time_point _lastPresent;
+	GLsync _inFlight[MaxFramesInFlight];
+	int _nextInFlight;
+	int _reportedFrames;
+
+	// shader variant: the features the programs were built with and the
+	// defines that built them
+	bool _nextEvent;
+	bool _singleInstance;
+	std::string _shaderCacheFile;
+	ShaderCache _shaderCache;
+	bool _shaderCacheLoaded;
+	std::string _programDefines;
 
 	struct SSBOCollection {
-		unsigned int groups;
-		unsigned int faces;
+		unsigned int triangles;
+		unsigned int nodes;
+		unsigned int attributes;
+		unsigned int materials;
+		unsigned int emitters;
+		unsigned int topNodes;
+		unsigned int instances;
+		unsigned int tiles;
+		unsigned int counters;
+		unsigned int paths;
+		unsigned int queues[2];
 	} _ssbo;
 
+	// wavefront stages, see trace.glsl
+	struct ProgramCollection {
+		unsigned int generate;
+		unsigned int queue;
+		unsigned int intersect;
+		unsigned int shade;
+		unsigned int accumulate;
+		unsigned int readback;
+		unsigned int render;
+	} _programs;
+
 	struct ShaderVariableCollection {
 		unsigned int eye;
 		unsigned int ray00;
 		unsigned int ray01;
 		unsigned int ray10;
 		unsigned int ray11;
-		unsigned int sampleOffset;
 		unsigned int frame;
+		unsigned int adaptiveThreshold;
+		unsigned int minSamples;
+		unsigned int reproject;
+		unsigned int prevViewProj;
+		unsigned int historySize;
+		unsigned int readbackFormat;
 		unsigned int tex;
 	} _variables;
 
 private:
 	const unsigned int _groupSizeX = 16;
 	const unsigned int _groupSizeY = 8;
+	const int _stillDelay = 150;	// ms without input before full quality
+	const float _lookSpeed = 0.005f;	// radians per pixel dragged
 
 private:
 	static Tracer *_instance;
 	static void _displayFn();
 	static void _resizeFn(int width, int height);
 	static void _idleFn();
+	static void _keyboardFn(unsigned char key, int, int);
+	static void _keyboardUpFn(unsigned char key, int, int);
+	static void _mouseFn(int button, int state, int x, int y);
+	static void _motionFn(int x, int y);
 };
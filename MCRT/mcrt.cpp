@@ -1,14 +1,432 @@
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
 
-#include "Scene.h"
+#include "SceneBuffers.h"
 #include "Tracer.h"
+#include "CpuTracer.h"
+#include "ImageWriter.h"
+#include "Benchmark.h"
+#include "Distributed.h"
+#include "Stats.h"
 
 using namespace std;
+using namespace Eigen;
+
+struct BatchOptions
+{
+	const char *scene = "scene01.obj";
+	const char *output = "mcrt.png";
+	const char *stats = nullptr;
+	const char *listen = nullptr;
+	double statsInterval = 5;
+	int width = 640;
+	int height = 480;
+	int samples = 64;
+	int frameSamples = 4;
+	double timeBudget = 0;
+	float adaptiveThreshold = 0;
+	int minSamples = 16;
+	int maxDepth = 3;
+	SamplerType sampler = SobolSampler;
+	int unitSize = 128;
+	int unitSamples = 0;
+	unsigned int threads = 0;
+	bool useCache = true;
+	bool nextEvent = true;
+	float fovy = 60;
+	Vector3f eye = Vector3f(0, 5, 15);
+	Vector3f at = Vector3f(0, 5, 0);
+	Vector3f up = Vector3f(0, 1, 0);
+};
+
+static void printUsage()
+{
+	cout << "Usage: mcrt [scene] [--adaptive <error>] [--depth <n>] [--sampler <name>] [--stats <file>] [--stats-interval <s>]" << endl
+		<< "                        [--eye <x,y,z>] [--at <x,y,z>] [--fov <degrees>] [--preview <scale>] [--stream <file>]" << endl
+		<< "                        [--frame-spp <n>] [--present <hz>] [--no-nee]" << endl
+		<< "       fly with WASD, Q/E down and up, drag with the left button to look around;" << endl
+		<< "       moving previews at 1/scale resolution (2); --stream writes every frame as an" << endl
+		<< "       sRGB PAM image to a file or pipe, e.g. for ffmpeg -f image2pipe -c:v pam;" << endl
+		<< "       frames trace --frame-spp samples (4) and the window shows --present per second (60)" << endl
+		<< "       mcrt --benchmark [options], see mcrt --benchmark --help" << endl
+		<< "       mcrt --batch [options]" << endl
+		<< "       mcrt --gpu [options]   batch on the GL compute path in an offscreen context;" << endl
+		<< "                              software GL works too (LIBGL_ALWAYS_SOFTWARE=1), --up is ignored" << endl
+		<< "       mcrt --coordinator --listen <address> [options]" << endl
+		<< "       mcrt --worker <address> [--threads <n>] [--no-cache]" << endl
+		<< "  a scene description lists OBJ meshes and their instances, one per line:" << endl
+		<< "    mesh <name> <file.obj> [group...]" << endl
+		<< "    instance <mesh> [scale s|x y z] [rotate x y z deg] [translate x y z] [matrix 3x4]" << endl
+		<< "  --scene <file>        OBJ file or scene description to render (scene01.obj)" << endl
+		<< "  --output <file>       .png, .exr, .pfm or .ppm (mcrt.png)" << endl
+		<< "  --size <w>x<h>        resolution (640x480)" << endl
+		<< "  --spp <n>             samples per pixel (64)" << endl
+		<< "  --frame-spp <n>       samples per GPU frame, --gpu only (4)" << endl
+		<< "  --time <seconds>      stop early when the budget would be exceeded" << endl
+		<< "  --adaptive <error>    stop sampling tiles below this relative error" << endl
+		<< "  --min-spp <n>         samples before a tile may converge (16)" << endl
+		<< "  --depth <n>           longest path, Russian roulette after 3 bounces (3)" << endl
+		<< "  --sampler <name>      sobol (Owen scrambled) or pcg (independent) (sobol)" << endl
+		<< "  --eye <x,y,z>         camera position (0,5,15)" << endl
+		<< "  --at <x,y,z>          camera target (0,5,0)" << endl
+		<< "  --up <x,y,z>          camera up vector (0,1,0)" << endl
+		<< "  --fov <degrees>       vertical field of view (60)" << endl
+		<< "  --threads <n>         worker threads (all cores)" << endl
+		<< "  --no-cache            ignore and do not write the .mcrtbin and shader caches" << endl
+		<< "  --no-nee              no light sampling, --gpu only" << endl
+		<< "  --stats <file>        dump stage timings and rates, .csv appends, else JSON" << endl
+		<< "  --stats-interval <s>  seconds between stats dumps (5)" << endl
+		<< "Distributed rendering, <address> is host:port or unix:/path:" << endl
+		<< "  --listen <address>    where the coordinator accepts workers" << endl
+		<< "  --unit <px>           side of a work unit, best a multiple of 32 (128)" << endl
+		<< "  --unit-spp <n>        samples per work unit (all of --spp)" << endl;
+}
+
+static bool parseVector(const char *s, Vector3f &v)
+{
+	return sscanf(s, "%f,%f,%f", &v[0], &v[1], &v[2]) == 3;
+}
+
+static bool parseSampler(const char *s, SamplerType &type)
+{
+	if (strcmp(s, "sobol") == 0) type = SobolSampler;
+	else if (strcmp(s, "pcg") == 0) type = RandomSampler;
+	else return false;
+	return true;
+}
+
+static bool parseBatchOptions(int argc, char *argv[], BatchOptions &o)
+{
+	for (int i = 2; i < argc; i++) {
+		const char *opt = argv[i];
+		if (strcmp(opt, "--no-cache") == 0) {
+			o.useCache = false;
+			continue;
+		}
+		if (strcmp(opt, "--no-nee") == 0) {
+			o.nextEvent = false;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			cout << "Error: missing value for " << opt << endl;
+			return false;
+		}
+		const char *arg = argv[++i];
+		bool ok = true;
+		if (strcmp(opt, "--scene") == 0) o.scene = arg;
+		else if (strcmp(opt, "--output") == 0) o.output = arg;
+		else if (strcmp(opt, "--size") == 0) ok = sscanf(arg, "%dx%d", &o.width, &o.height) == 2 && o.width > 0 && o.height > 0;
+		else if (strcmp(opt, "--spp") == 0) ok = (o.samples = atoi(arg)) > 0;
+		else if (strcmp(opt, "--frame-spp") == 0) ok = (o.frameSamples = atoi(arg)) > 0;
+		else if (strcmp(opt, "--time") == 0) ok = (o.timeBudget = atof(arg)) >= 0;
+		else if (strcmp(opt, "--adaptive") == 0) ok = (o.adaptiveThreshold = (float)atof(arg)) >= 0;
+		else if (strcmp(opt, "--min-spp") == 0) ok = (o.minSamples = atoi(arg)) > 0;
+		else if (strcmp(opt, "--depth") == 0) ok = (o.maxDepth = atoi(arg)) > 0;
+		else if (strcmp(opt, "--sampler") == 0) ok = parseSampler(arg, o.sampler);
+		else if (strcmp(opt, "--eye") == 0) ok = parseVector(arg, o.eye);
+		else if (strcmp(opt, "--at") == 0) ok = parseVector(arg, o.at);
+		else if (strcmp(opt, "--up") == 0) ok = parseVector(arg, o.up);
+		else if (strcmp(opt, "--fov") == 0) ok = (o.fovy = (float)atof(arg)) > 0 && o.fovy < 180;
+		else if (strcmp(opt, "--threads") == 0) o.threads = (unsigned int)atoi(arg);
+		else if (strcmp(opt, "--stats") == 0) o.stats = arg;
+		else if (strcmp(opt, "--stats-interval") == 0) ok = (o.statsInterval = atof(arg)) > 0;
+		else if (strcmp(opt, "--listen") == 0) o.listen = arg;
+		else if (strcmp(opt, "--unit") == 0) ok = (o.unitSize = atoi(arg)) > 0;
+		else if (strcmp(opt, "--unit-spp") == 0) ok = (o.unitSamples = atoi(arg)) > 0;
+		else {
+			cout << "Error: unknown option " << opt << endl;
+			return false;
+		}
+		if (!ok) {
+			cout << "Error: invalid value for " << opt << ": " << arg << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// runBatch on the GPU: the interactive pipeline, driven frame by frame
+// without a window. Frames are queued ahead, so the time budget is checked
+// against submission and may overshoot by the frames still in flight.
+static int renderOnGpu(const BatchOptions &o, const SceneBuffers &s)
+{
+	typedef chrono::steady_clock Clock;
+	auto seconds = [](Clock::time_point a, Clock::time_point b) {
+		return chrono::duration<double>(b - a).count();
+	};
+
+	auto start = Clock::now();
+	Tracer t(o.width, o.height);
+	t.setShaderCache(o.useCache ? "mcrt.shadercache" : nullptr);
+	t.setAdaptive(o.adaptiveThreshold, o.minSamples);
+	t.setMaxDepth(o.maxDepth);
+	t.setNextEventEstimation(o.nextEvent);
+	t.setSampler(o.sampler);
+	t.setView(o.eye, o.at, o.fovy);
+	if (!t.begin(s)) {
+		return 5;
+	}
+	auto ready = Clock::now();
+
+	cout << "MCRT (gl, headless) rendering " << o.scene << " at " << o.width << "x" << o.height << endl;
+	bool timedOut = false;
+	while (t.frames() < o.samples) {
+		t.setSamplesPerFrame(min(o.frameSamples, o.samples - t.frames()));
+		if (!t.renderFrame()) break;
+		if (o.timeBudget > 0 && seconds(ready, Clock::now()) >= o.timeBudget) {
+			timedOut = t.frames() < o.samples;
+			break;
+		}
+	}
+	vector<float> canvas;
+	t.readCanvas(canvas);
+	auto rendered = Clock::now();
+
+	bool saved = writeImage(o.output, canvas.data(), o.width, o.height);
+	auto end = Clock::now();
+
+	double renderSeconds = seconds(ready, rendered);
+	cout << "setup:     " << seconds(start, ready) << " s" << endl
+		<< "render:    " << renderSeconds << " s, " << t.frames() << "/" << o.samples << " spp"
+		<< (timedOut ? " (time budget reached)" : "")
+		<< (t.converged() ? " (converged)" : "") << endl
+		<< "samples/s: " << (renderSeconds > 0 ? (double)t.frames() * o.width * o.height / renderSeconds : 0) << endl
+		<< "write:     " << seconds(rendered, end) << " s" << endl;
+	return saved ? 0 : 3;
+}
+
+// Offline render for farm jobs: renders to the target sample count or time
+// budget, writes the image and reports timings. Exit codes: 0 success,
+// 1 scene failure, 2 bad arguments, 3 image write failure, 5 no GL context
+// or shader failure (--gpu).
+static int runBatch(int argc, char *argv[])
+{
+	typedef chrono::steady_clock Clock;
+	auto seconds = [](Clock::time_point a, Clock::time_point b) {
+		return chrono::duration<double>(b - a).count();
+	};
+
+	BatchOptions o;
+	if (!parseBatchOptions(argc, argv, o)) {
+		printUsage();
+		return 2;
+	}
+
+	if (o.stats) {
+		Stats::shared().setDumpFile(o.stats, o.statsInterval);
+	}
+
+	auto start = Clock::now();
+	SceneBuffers s;
+	if (!s.open(o.scene, o.useCache)) {
+		return 1;
+	}
+	auto loaded = Clock::now();
+
+	if (strcmp(argv[1], "--gpu") == 0) {
+		cout << "scene:     " << s.faceCount() << " triangles, " << seconds(start, loaded) << " s" << endl;
+		int result = renderOnGpu(o, s);
+		if (o.stats) {
+			Stats::shared().flush();
+		}
+		if (result == 0) {
+			cout << "Canvas has been written to " << o.output << endl;
+		}
+		return result;
+	}
+
+	CpuTracer t(o.width, o.height, o.threads);
+	t.camera().setFrustum(o.fovy, float(o.width) / float(o.height), 1., 30.);
+	t.camera().setCamera(o.eye, o.at, o.up);
+	t.camera().computeInvMatrix();
+	t.setAdaptive(o.adaptiveThreshold, o.minSamples);
+	t.setMaxDepth(o.maxDepth);
+	t.setSampler(o.sampler);
+
+	cout << "MCRT (cpu, " << t.threadCount() << " threads, " << t.kernelName()
+		<< ") rendering " << o.scene << " at " << o.width << "x" << o.height << endl;
+	CpuTracer::RenderStats stats = t.render(s, o.samples, o.timeBudget);
+
+	auto rendered = Clock::now();
+	bool saved = t.saveCanvas(o.output);
+	auto end = Clock::now();
+
+	double samplesPerSecond = stats.renderSeconds > 0
+		? stats.averageSamples * o.width * o.height / stats.renderSeconds : 0;
+	cout << "scene:     " << s.faceCount() << " triangles, " << seconds(start, loaded) << " s" << endl
+		<< "setup:     " << stats.setupSeconds << " s" << endl
+		<< "render:    " << stats.renderSeconds << " s, " << stats.samples << "/" << o.samples << " spp"
+		<< (stats.timedOut ? " (time budget reached)" : "")
+		<< (stats.converged ? " (converged)" : "") << endl;
+	if (o.adaptiveThreshold > 0) {
+		cout << "adaptive:  " << stats.averageSamples << " spp on average, "
+			<< (t.tileCount() - t.activeTileCount()) << "/" << t.tileCount() << " tiles converged" << endl;
+	}
+	cout << "samples/s: " << samplesPerSecond << endl
+		<< "write:     " << seconds(rendered, end) << " s" << endl
+		<< "total:     " << seconds(start, end) << " s" << endl;
+
+	if (o.stats) {
+		Stats::shared().flush();
+	}
+	if (!saved) {
+		return 3;
+	}
+	cout << "Canvas has been written to " << o.output << endl;
+	return 0;
+}
+
+// Splits one frame across worker processes, see Distributed.h. Exit codes
+// as runBatch, plus 4 when the listening socket cannot be opened.
+static int runCoordinator(int argc, char *argv[])
+{
+	typedef chrono::steady_clock Clock;
+
+	BatchOptions o;
+	if (!parseBatchOptions(argc, argv, o) || !o.listen) {
+		if (!o.listen) cout << "Error: --coordinator needs --listen <address>" << endl;
+		printUsage();
+		return 2;
+	}
+	if (strlen(o.scene) >= sizeof(render_job_t::scene)) {
+		cout << "Error: scene path too long: " << o.scene << endl;
+		return 2;
+	}
+	if (o.stats) {
+		Stats::shared().setDumpFile(o.stats, o.statsInterval);
+	}
+
+	render_job_t job;
+	memset(&job, 0, sizeof(job));
+	job.width = o.width;
+	job.height = o.height;
+	job.maxDepth = o.maxDepth;
+	job.sampler = o.sampler;
+	job.minSamples = o.minSamples;
+	job.adaptiveThreshold = o.adaptiveThreshold;
+	job.fovy = o.fovy;
+	memcpy(job.eye, o.eye.data(), sizeof(job.eye));
+	memcpy(job.at, o.at.data(), sizeof(job.at));
+	memcpy(job.up, o.up.data(), sizeof(job.up));
+	strcpy(job.scene, o.scene);
+
+	auto start = Clock::now();
+	RenderCoordinator c(job, o.samples, o.unitSize, o.unitSamples);
+	if (!c.run(o.listen)) {
+		return 4;
+	}
+	double seconds = chrono::duration<double>(Clock::now() - start).count();
+	cout << "render:    " << seconds << " s, " << c.unitCount() << " units, "
+		<< c.duplicatedUnits() << " duplicated, " << c.requeuedUnits() << " requeued" << endl;
+
+	if (o.stats) {
+		Stats::shared().flush();
+	}
+	if (!c.saveImage(o.output)) {
+		return 3;
+	}
+	cout << "Canvas has been written to " << o.output << endl;
+	return 0;
+}
+
+// One PAM image per frame; the size changes while the camera moves.
+static void streamFrame(FILE *fp, const ReadbackFrame &f)
+{
+	fprintf(fp, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", f.width, f.height);
+	fwrite(f.data, 1, f.size, fp);
+	fflush(fp);
+}
 
 int main(int argc, char *argv[])
 {
-	Scene s("scene01.obj");
+	if (argc > 1 && strcmp(argv[1], "--coordinator") == 0) {
+		return runCoordinator(argc, argv);
+	}
+	if (argc > 2 && strcmp(argv[1], "--worker") == 0) {
+		unsigned int threads = 0;
+		bool useCache = true;
+		for (int i = 3; i < argc; i++) {
+			if (strcmp(argv[i], "--no-cache") == 0) useCache = false;
+			else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = (unsigned int)atoi(argv[++i]);
+		}
+		return runWorker(argv[2], threads, useCache);
+	}
+	if (argc > 1 && (strcmp(argv[1], "--batch") == 0 || strcmp(argv[1], "--cpu") == 0 || strcmp(argv[1], "--gpu") == 0)) {
+		return runBatch(argc, argv);
+	}
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+		return runBenchmark(argc, argv);
+	}
+	if (argc > 1 && (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)) {
+		printUsage();
+		return 0;
+	}
+
+	const char *statsFile = nullptr;
+	double statsInterval = 5;
+	float adaptiveThreshold = 0;
+	int maxDepth = 3;
+	SamplerType sampler = SobolSampler;
+	Vector3f eye(0, 5, 15), at(0, 5, 0);
+	float fovy = 60;
+	int previewScale = 2;
+	const char *streamFile = nullptr;
+	int frameSamples = 4;
+	double presentRate = 60;
+	bool nextEvent = true;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--no-nee") == 0) nextEvent = false;
+	}
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "--adaptive") == 0) adaptiveThreshold = (float)atof(argv[i + 1]);
+		else if (strcmp(argv[i], "--depth") == 0) maxDepth = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--sampler") == 0 && !parseSampler(argv[i + 1], sampler)) {
+			cout << "Error: unknown sampler " << argv[i + 1] << endl;
+			return 2;
+		}
+		else if (strcmp(argv[i], "--stats") == 0) statsFile = argv[i + 1];
+		else if (strcmp(argv[i], "--stats-interval") == 0) statsInterval = atof(argv[i + 1]);
+		else if (strcmp(argv[i], "--fov") == 0) fovy = (float)atof(argv[i + 1]);
+		else if (strcmp(argv[i], "--preview") == 0) previewScale = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--stream") == 0) streamFile = argv[i + 1];
+		else if (strcmp(argv[i], "--frame-spp") == 0) frameSamples = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--present") == 0) presentRate = atof(argv[i + 1]);
+		else if ((strcmp(argv[i], "--eye") == 0 && !parseVector(argv[i + 1], eye))
+			|| (strcmp(argv[i], "--at") == 0 && !parseVector(argv[i + 1], at))) {
+			cout << "Error: invalid vector " << argv[i + 1] << endl;
+			return 2;
+		}
+	}
+	if (statsFile) {
+		Stats::shared().setDumpFile(statsFile, statsInterval > 0 ? statsInterval : 5);
+	}
+
+	SceneBuffers s;
+	if (!s.open(argc > 1 && argv[1][0] != '-' ? argv[1] : "scene01.obj")) {
+		return 1;
+	}
+
+	FILE *stream = nullptr;
+	if (streamFile && !(stream = fopen(streamFile, "wb"))) {
+		cout << "Error: unable to open " << streamFile << endl;
+		return 2;
+	}
+
 	Tracer t(argc, argv);
+	if (stream) {
+		t.setReadback(ReadbackSrgb8, [stream](const ReadbackFrame &f) { streamFrame(stream, f); });
+	}
+	t.setAdaptive(adaptiveThreshold);
+	t.setMaxDepth(maxDepth);
+	t.setSampler(sampler);
+	t.setView(eye, at, fovy);
+	t.setPreviewScale(previewScale);
+	t.setSamplesPerFrame(frameSamples);
+	t.setNextEventEstimation(nextEvent);
+	t.setPresentRate(presentRate);
 	t.run(s);
 	return 0;
 }
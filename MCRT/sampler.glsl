@@ -0,0 +1,59 @@
+// GLSL twin of Sampler.h; keep both in sync so the CPU and GPU backends
+// draw the same samples for a (pixel, sample index, dimension).
+
+#define SOBOL_SAMPLER       0
+#define RANDOM_SAMPLER      1
+
+uint bounceDimension(int depth) { return 1u + 3u * uint(depth); }
+uint lightDimension(int depth) { return 2u + 3u * uint(depth); }
+uint choiceDimension(int depth) { return 3u + 3u * uint(depth); }
+
+uint pcgHash(uint v)
+{
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+uint pixelSeed(ivec2 pix, int width)
+{
+	return pcgHash(uint(pix.y * width + pix.x));
+}
+
+uint owenScramble(uint x, uint seed)
+{
+	x = bitfieldReverse(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return bitfieldReverse(x);
+}
+
+uint sobol1(uint index)
+{
+	uint result = 0u;
+	for (uint v = 0x80000000u; index != 0u; index >>= 1, v ^= v >> 1) {
+		if ((index & 1u) != 0u) result ^= v;
+	}
+	return result;
+}
+
+float toUnitFloat(uint x)
+{
+	return float(x >> 8) * (1.0 / 16777216.0);
+}
+
+vec2 sample2D(int type, uint pixel, uint index, uint dimension)
+{
+	uint seed = pcgHash(pixel ^ pcgHash(dimension));
+	if (type == RANDOM_SAMPLER) {
+		uint state = pcgHash(seed ^ pcgHash(index));
+		return vec2(toUnitFloat(state), toUnitFloat(pcgHash(state)));
+	}
+	uint i = owenScramble(index, seed);
+	return vec2(
+		toUnitFloat(owenScramble(bitfieldReverse(i), pcgHash(seed + 1u))),
+		toUnitFloat(owenScramble(sobol1(i), pcgHash(seed + 2u))));
+}
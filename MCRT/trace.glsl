@@ -0,0 +1,582 @@
+// Shared by the wavefront stages (generate, queue, intersect, shade and
+// accumulate .comp). Each stage starts with #version and includes this file.
+// Paths live in one slot per pixel; live slots are passed between stages in
+// ray queues whose header doubles as the indirect dispatch arguments.
+
+#include "sampler.glsl"
+
+layout(binding = 0, rgba32f) uniform image2D framebuffer;
+layout(binding = 1, r32f) uniform image2D variance;
+
+// first hit of each pixel's latest camera ray, (P, 1) or (direction, 0) for
+// a miss, and the previous frame's image and hits for reprojection
+layout(binding = 2, rgba32f) uniform image2D primary_hits;
+layout(binding = 3, rgba32f) readonly uniform image2D history;
+layout(binding = 4, rgba32f) readonly uniform image2D history_hits;
+
+uniform vec3 eye;
+uniform vec3 ray00;
+uniform vec3 ray01;
+uniform vec3 ray10;
+uniform vec3 ray11;
+uniform int frame;
+uniform int sampler_type;
+uniform int emitter_count;
+uniform float adaptive_threshold;
+uniform int min_samples;
+uniform int reproject;
+uniform mat4 prev_view_proj;
+uniform ivec2 history_size;
+
+#define MAX_SCENE_BOUNDS    100.0
+#define EPS                 0.000001
+#define MIN_LUMINANCE       0.01
+#define PI                  3.14159265
+
+// shadow rays stop this fraction short of the sampled light point
+#define SHADOW_EPS          0.001
+
+// bounces before Russian roulette may end a path
+#define RR_DEPTH            3
+
+// weight of a new sample against reprojected history, and how far apart
+// (relative to the distance from the camera) the two hits may be
+#define TEMPORAL_BLEND      0.2
+#define REPROJECT_TOLERANCE 0.03
+
+// Tracer builds one variant of every stage per scene by defining these
+// ahead of the source (see Tracer::_shaderDefines):
+//   TILE_WIDTH, TILE_HEIGHT  work group size of the per-pixel stages
+//   MAX_DEPTH                longest path in intersections
+//   NEXT_EVENT               sample the emitters at every vertex
+//   SINGLE_INSTANCE          one instance placed as modelled: no top-level
+//                            tree walk and no transforms
+#ifndef TILE_WIDTH
+#define TILE_WIDTH          16
+#endif
+#ifndef TILE_HEIGHT
+#define TILE_HEIGHT         8
+#endif
+#ifndef MAX_DEPTH
+#define MAX_DEPTH           3
+#endif
+#define QUEUE_GROUP_SIZE    64
+#define QUEUE_GROUPS_X      32768
+
+struct triangle_t
+{
+	vec4 v0;
+	vec4 e1;
+	vec4 e2;
+};
+
+struct face_attr_t
+{
+	vec3 vn1;
+	int material;
+	vec3 vn2;
+	float emitter_pdf;
+	vec4 vn3;
+};
+
+struct material_t
+{
+	vec3 Kd;
+	float Ns;
+	vec3 Ka;
+	float Tr;
+	vec4 Ks;
+};
+
+struct bvh_node_t
+{
+	vec3 vmin;
+	int start;
+	vec3 vmax;
+	int count;
+};
+
+layout(std430, binding = 2) readonly buffer Triangles
+{
+    triangle_t triangles[];
+};
+
+layout(std430, binding = 3) readonly buffer Nodes
+{
+    bvh_node_t nodes[];
+};
+
+layout(std430, binding = 4) readonly buffer Attributes
+{
+    face_attr_t attributes[];
+};
+
+layout(std430, binding = 5) readonly buffer Materials
+{
+    material_t materials[];
+};
+
+// faces with Ka > 0 placed by one instance, picked in proportion to their
+// emitted power
+struct emitter_t
+{
+	int face;
+	int instance;
+	float pdf;
+	float cdf;
+};
+
+layout(std430, binding = 11) readonly buffer Emitters
+{
+    emitter_t emitters[];
+};
+
+// Two-level scene: `nodes` holds one tree per mesh in object space, the
+// tree in `top_nodes` has instances at its leaves, each placing a mesh
+// tree by the rows of its transform and of the inverse.
+struct instance_t
+{
+	vec4 to_world[3];
+	vec4 to_object[3];
+	int root;
+	int mesh;
+	int _padding[2];
+};
+
+layout(std430, binding = 12) readonly buffer TopNodes
+{
+    bvh_node_t top_nodes[];
+};
+
+layout(std430, binding = 13) readonly buffer Instances
+{
+    instance_t instances[];
+};
+
+// one entry per work group; converged tiles are skipped by later passes
+struct tile_t
+{
+	uint samples;
+	uint converged;
+};
+
+layout(std430, binding = 6) buffer Tiles
+{
+	uint active_tiles;
+	tile_t tiles[];
+};
+
+// throughput counters, read back and cleared by the host now and then
+layout(std430, binding = 7) buffer Counters
+{
+	uint traced_rays;
+	uint traced_samples;
+};
+
+// state of the path started at one pixel; hit_face < 0 marks a miss
+struct path_t
+{
+	vec3 origin;
+	uint pixel_seed;
+	vec3 dir;
+	int depth;
+	vec3 throughput;
+	float hit_dist;
+	vec3 radiance;
+	int hit_face;
+	vec2 hit_uv;
+	uint sample_index;
+	float bsdf_pdf;		// of the last bounce, 0 for camera rays
+	int hit_instance;
+};
+
+layout(std430, binding = 8) buffer Paths
+{
+	path_t paths[];
+};
+
+layout(std430, binding = 9) buffer InQueue
+{
+	uint in_groups_x;
+	uint in_groups_y;
+	uint in_groups_z;
+	uint in_count;
+	uint in_items[];
+};
+
+layout(std430, binding = 10) buffer OutQueue
+{
+	uint out_groups_x;
+	uint out_groups_y;
+	uint out_groups_z;
+	uint out_count;
+	uint out_items[];
+};
+
+const int BVH_STACK_SIZE = 32;
+
+struct hit_info_t
+{
+    float dist;
+	int fptr;
+	vec2 uv;
+	int instance;
+};
+
+#ifdef SINGLE_INSTANCE
+vec3 toObjectPoint(int i, vec3 p) { return p; }
+vec3 toObjectVector(int i, vec3 v) { return v; }
+vec3 toWorldPoint(int i, vec3 p) { return p; }
+vec3 toWorldVector(int i, vec3 v) { return v; }
+vec3 toWorldNormal(int i, vec3 n) { return normalize(n); }
+#else
+vec3 toObjectPoint(int i, vec3 p)
+{
+	vec4 q = vec4(p, 1.0);
+	return vec3(dot(instances[i].to_object[0], q), dot(instances[i].to_object[1], q), dot(instances[i].to_object[2], q));
+}
+
+// directions stay unnormalized, so distances along the ray are the same in
+// object and world space
+vec3 toObjectVector(int i, vec3 v)
+{
+	vec4 q = vec4(v, 0.0);
+	return vec3(dot(instances[i].to_object[0], q), dot(instances[i].to_object[1], q), dot(instances[i].to_object[2], q));
+}
+
+vec3 toWorldPoint(int i, vec3 p)
+{
+	vec4 q = vec4(p, 1.0);
+	return vec3(dot(instances[i].to_world[0], q), dot(instances[i].to_world[1], q), dot(instances[i].to_world[2], q));
+}
+
+vec3 toWorldVector(int i, vec3 v)
+{
+	vec4 q = vec4(v, 0.0);
+	return vec3(dot(instances[i].to_world[0], q), dot(instances[i].to_world[1], q), dot(instances[i].to_world[2], q));
+}
+
+// normals go through the transposed inverse
+vec3 toWorldNormal(int i, vec3 n)
+{
+	return normalize(n.x * instances[i].to_object[0].xyz + n.y * instances[i].to_object[1].xyz
+		+ n.z * instances[i].to_object[2].xyz);
+}
+#endif
+
+float intersectNode(vec3 origin, vec3 invDir, bvh_node_t node, float maxDist)
+{
+    vec3 tMin = (node.vmin - origin) * invDir;
+    vec3 tMax = (node.vmax - origin) * invDir;
+    vec3 t1 = min(tMin, tMax);
+    vec3 t2 = max(tMin, tMax);
+    float tNear = max(max(max(t1.x, t1.y), t1.z), 0.0);
+    float tFar = min(min(min(t2.x, t2.y), t2.z), maxDist);
+    return tNear <= tFar ? tNear : MAX_SCENE_BOUNDS;
+}
+
+bool intersectTriangle(vec3 origin, vec3 dir, triangle_t tri, out float dist, out vec2 uv)
+{
+	vec3 a = tri.v0.xyz;
+    vec3 e1 = tri.e1.xyz;
+    vec3 e2 = tri.e2.xyz;
+    vec3 p = cross(dir, e2);
+    float det = dot(e1, p);
+    if(abs(det) < EPS) return false;
+    det = 1.0 / det;
+
+    vec3 t = origin - a;
+    float u = dot(t, p) * det;
+    if(u < -EPS || u > 1.0 + EPS) return false;
+    vec3 q = cross(t, e1);
+    float v = dot(dir, q) * det;
+    if(v < -EPS || u + v > 1.0 + EPS) return false;
+    dist = dot(e2, q) * det;
+    uv = vec2(u, v);
+    if(dist > EPS) return true;
+    return false;
+}
+
+// Closest hit in the mesh tree at `root` for a ray in the mesh's object
+// space; h.dist bounds the search and true means a closer hit was found.
+bool intersectMesh(int root, vec3 origin, vec3 dir, inout hit_info_t h)
+{
+    float dist;
+    vec2 uv;
+    vec3 invDir = 1.0 / dir;
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    int node = root;
+    bool found = false;
+
+    if (intersectNode(origin, invDir, nodes[root], h.dist) == MAX_SCENE_BOUNDS)
+        return false;
+
+    while (true) {
+        if (nodes[node].count > 0) {
+            int fptr = nodes[node].start;
+            for (int j = 0; j < nodes[node].count; j++) {
+                if (intersectTriangle(origin, dir, triangles[fptr + j], dist, uv)
+                        && dist > EPS && dist < h.dist) {
+                    h.fptr = fptr + j;
+                    h.dist = dist;
+                    h.uv = uv;
+                    found = true;
+                }
+            }
+        } else {
+            // visit the nearer child first, defer the other one
+            int nearChild = node + 1;
+            int farChild = nodes[node].start;
+            float dNear = intersectNode(origin, invDir, nodes[nearChild], h.dist);
+            float dFar = intersectNode(origin, invDir, nodes[farChild], h.dist);
+            if (dFar < dNear) {
+                int t = nearChild; nearChild = farChild; farChild = t;
+                float d = dNear; dNear = dFar; dFar = d;
+            }
+            if (dNear != MAX_SCENE_BOUNDS) {
+                if (dFar != MAX_SCENE_BOUNDS) stack[sp++] = farChild;
+                node = nearChild;
+                continue;
+            }
+        }
+        if (sp == 0) break;
+        node = stack[--sp];
+    }
+    return found;
+}
+
+// The top-level tree is walked like a mesh tree; at its leaves the ray
+// moves into each instance's object space and descends into its mesh tree.
+bool isIntersected(vec3 origin, vec3 dir, out hit_info_t h)
+{
+    h.dist = MAX_SCENE_BOUNDS;
+    h.instance = -1;
+#ifdef SINGLE_INSTANCE
+    if (intersectMesh(instances[0].root, origin, dir, h)) {
+        h.instance = 0;
+    }
+    return h.instance >= 0;
+#else
+    vec3 invDir = 1.0 / dir;
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    int node = 0;
+
+    if (intersectNode(origin, invDir, top_nodes[0], h.dist) == MAX_SCENE_BOUNDS)
+        return false;
+
+    while (true) {
+        if (top_nodes[node].count > 0) {
+            int first = top_nodes[node].start;
+            for (int i = first; i < first + top_nodes[node].count; i++) {
+                if (intersectMesh(instances[i].root, toObjectPoint(i, origin), toObjectVector(i, dir), h)) {
+                    h.instance = i;
+                }
+            }
+        } else {
+            int nearChild = node + 1;
+            int farChild = top_nodes[node].start;
+            float dNear = intersectNode(origin, invDir, top_nodes[nearChild], h.dist);
+            float dFar = intersectNode(origin, invDir, top_nodes[farChild], h.dist);
+            if (dFar < dNear) {
+                int t = nearChild; nearChild = farChild; farChild = t;
+                float d = dNear; dNear = dFar; dFar = d;
+            }
+            if (dNear != MAX_SCENE_BOUNDS) {
+                if (dFar != MAX_SCENE_BOUNDS) stack[sp++] = farChild;
+                node = nearChild;
+                continue;
+            }
+        }
+        if (sp == 0) break;
+        node = stack[--sp];
+    }
+    return h.instance >= 0;
+#endif
+}
+
+bool isMeshOccluded(int root, vec3 origin, vec3 dir, float tmin, float tmax)
+{
+    float dist;
+    vec2 uv;
+    vec3 invDir = 1.0 / dir;
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    int node = root;
+
+    if (intersectNode(origin, invDir, nodes[root], tmax) == MAX_SCENE_BOUNDS)
+        return false;
+
+    while (true) {
+        if (nodes[node].count > 0) {
+            int fptr = nodes[node].start;
+            for (int j = 0; j < nodes[node].count; j++) {
+                if (intersectTriangle(origin, dir, triangles[fptr + j], dist, uv)
+                        && dist > tmin && dist < tmax) {
+                    return true;
+                }
+            }
+        } else {
+            int first = node + 1;
+            int second = nodes[node].start;
+            bool hitFirst = intersectNode(origin, invDir, nodes[first], tmax) != MAX_SCENE_BOUNDS;
+            bool hitSecond = intersectNode(origin, invDir, nodes[second], tmax) != MAX_SCENE_BOUNDS;
+            if (hitFirst || hitSecond) {
+                if (hitFirst && hitSecond) stack[sp++] = second;
+                node = hitFirst ? first : second;
+                continue;
+            }
+        }
+        if (sp == 0) break;
+        node = stack[--sp];
+    }
+    return false;
+}
+
+// Any-hit query for shadow rays: true as soon as any triangle is hit in
+// (tmin, tmax). Children are taken in tree order and no hit data is kept.
+bool isOccluded(vec3 origin, vec3 dir, float tmin, float tmax)
+{
+#ifdef SINGLE_INSTANCE
+    return isMeshOccluded(instances[0].root, origin, dir, tmin, tmax);
+#else
+    vec3 invDir = 1.0 / dir;
+    int stack[BVH_STACK_SIZE];
+    int sp = 0;
+    int node = 0;
+
+    if (intersectNode(origin, invDir, top_nodes[0], tmax) == MAX_SCENE_BOUNDS)
+        return false;
+
+    while (true) {
+        if (top_nodes[node].count > 0) {
+            int first = top_nodes[node].start;
+            for (int i = first; i < first + top_nodes[node].count; i++) {
+                if (isMeshOccluded(instances[i].root, toObjectPoint(i, origin), toObjectVector(i, dir), tmin, tmax)) {
+                    return true;
+                }
+            }
+        } else {
+            int first = node + 1;
+            int second = top_nodes[node].start;
+            bool hitFirst = intersectNode(origin, invDir, top_nodes[first], tmax) != MAX_SCENE_BOUNDS;
+            bool hitSecond = intersectNode(origin, invDir, top_nodes[second], tmax) != MAX_SCENE_BOUNDS;
+            if (hitFirst || hitSecond) {
+                if (hitFirst && hitSecond) stack[sp++] = second;
+                node = hitFirst ? first : second;
+                continue;
+            }
+        }
+        if (sp == 0) break;
+        node = stack[--sp];
+    }
+    return false;
+#endif
+}
+
+vec3 getNormal(int instance, int face, vec2 uv)
+{
+	face_attr_t attr = attributes[face];
+	float w = 1.0 - uv.x - uv.y;
+	return toWorldNormal(instance, w * attr.vn1 + uv.x * attr.vn2 + uv.y * attr.vn3.xyz);
+}
+
+vec3 sampleHemisphere(vec3 w, vec2 s)
+{
+	float r1 = 2.0f * 3.14159f * s.x;
+	float r2 = s.y;
+	float r2s = sqrt(r2);
+
+	vec3 u;
+	if (abs(w[0]) > 0.1f) u = cross(vec3(0, 1, 0), w);
+	else u = cross(vec3(1, 0, 0), w);
+	u = normalize(u);
+
+	vec3 v = cross(w, u);
+	vec3 d = (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1 - r2));
+
+	return normalize(d);
+}
+
+// Diffuse plus the Phong lobe around the mirror direction of `wi`, the
+// model that sampleHemisphere and shade.comp importance sample with pdf
+// cos / PI.
+vec3 evalBsdf(material_t mat, vec3 n, vec3 dir, vec3 wi)
+{
+	float LdN = max(dot(wi, n), 0.0);
+	vec3 R = normalize(2 * LdN * n - wi);
+	float sfactor = dot(R, -dir);
+	vec3 f = mat.Kd;
+	if (sfactor > 0) {
+		f += mat.Ks.rgb * pow(sfactor, mat.Ns);
+	}
+	return f / PI;
+}
+
+float powerHeuristic(float a, float b)
+{
+	return a * a / max(a * a + b * b, EPS);
+}
+
+// solid angle density of light sampling picking the hit point on `face`
+// of `instance` from a point `dist` away along `dir`
+float lightPdf(int instance, int face, vec3 dir, float dist)
+{
+	triangle_t tri = triangles[face];
+	vec3 c = cross(toWorldVector(instance, tri.e1.xyz), toWorldVector(instance, tri.e2.xyz));
+	float cosL = abs(dot(c, dir)) / max(length(c), EPS);
+	return attributes[face].emitter_pdf * dist * dist / max(cosL, EPS);
+}
+
+int pickEmitter(float u)
+{
+	int lo = 0, hi = emitter_count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (emitters[mid].cdf < u) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Next event estimation: radiance from one point sampled on the emitters,
+// MIS weighted against having hit it by BSDF sampling.
+vec3 sampleDirect(vec3 P, vec3 N, vec3 dir, material_t mat, float choice, vec2 s)
+{
+	emitter_t e = emitters[pickEmitter(choice)];
+	triangle_t tri = triangles[e.face];
+	vec3 e1 = toWorldVector(e.instance, tri.e1.xyz);
+	vec3 e2 = toWorldVector(e.instance, tri.e2.xyz);
+	float su = sqrt(s.x);
+	vec3 L = toWorldPoint(e.instance, tri.v0.xyz) + e1 * (su * (1.0 - s.y)) + e2 * (su * s.y);
+	vec3 d = L - P;
+	float dist = length(d);
+	vec3 wi = d / dist;
+	float cosS = dot(wi, N);
+	float cosL = abs(dot(normalize(cross(e1, e2)), wi));
+	if (cosS <= 0 || cosL < EPS) {
+		return vec3(0);
+	}
+
+	if (isOccluded(P, wi, 2.0 * EPS, dist * (1.0 - SHADOW_EPS))) {
+		return vec3(0);
+	}
+
+	float pdf = attributes[e.face].emitter_pdf * dist * dist / cosL;
+	vec3 Le = materials[attributes[e.face].material].Ka;
+	return evalBsdf(mat, N, dir, wi) * Le * cosS * powerHeuristic(pdf, cosS / PI) / pdf;
+}
+
+// queue entry handled by this invocation; the grid wraps into y because a
+// single dimension is limited to 65535 groups
+uint queueIndex()
+{
+    return (gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x) * QUEUE_GROUP_SIZE
+        + gl_LocalInvocationIndex;
+}
+
+float luminance(vec3 c)
+{
+	return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}